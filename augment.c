@@ -0,0 +1,225 @@
+/*
+  augment.c
+  Random distortions of image inputs.
+
+  The sampling coordinates are built one row at a time with the
+  vector kernels, and the elastic field is smoothed with a Gaussian
+  that runs as long axpys over whole rows (once in each direction,
+  transposing in between). Only the bilinear lookup is scalar.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "cnn.h"
+#include "augment.h"
+#include "shuffle.h"
+#include "simd.h"
+
+#define DEBUG_AUGMENT 0
+
+
+/* augment_uniform(state): returns a random number in [-1, 1). */
+static nn_real augment_uniform(uint64_t* state)
+{
+    return (shuffle_next(state) >> 8) * (2.0 / 16777216) - 1.0;
+}
+
+/* augment_transpose(w, h, x, y)
+   Transposes a (h x w) matrix x into y.
+*/
+static void augment_transpose(int w, int h, const nn_real* x, nn_real* y)
+{
+    for (int i = 0; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+            y[j*h + i] = x[i*w + j];
+        }
+    }
+}
+
+/* Augment_create(width, height, shift, rotate, alpha, sigma, noise)
+   Creates an Augment for (height x width) images.
+*/
+Augment* Augment_create(
+    int width, int height, int shift, double rotate,
+    double alpha, double sigma, double noise)
+{
+    assert (0 < width && 0 < height);
+    assert (0 <= shift);
+    assert (0 <= rotate);
+    assert (0 <= alpha);
+    assert (alpha == 0 || 0 < sigma);
+    assert (0 <= noise);
+
+    Augment* self = (Augment*)calloc(1, sizeof(Augment));
+    if (self == NULL) return NULL;
+    self->width = width;
+    self->height = height;
+    self->shift = shift;
+    self->rotate = rotate;
+    self->alpha = alpha;
+    self->sigma = sigma;
+    self->noise = noise;
+
+    /* Normalized Gaussian, cut at 3 sigma. */
+    self->radius = (alpha == 0)? 0 : (int)ceil(3 * sigma);
+    self->kernel = (nn_real*)calloc(2*self->radius+1, sizeof(nn_real));
+    double t = 0;
+    for (int i = -self->radius; i <= self->radius; i++) {
+        double k = (alpha == 0)? 1 : exp(-i*i / (2 * sigma*sigma));
+        self->kernel[i + self->radius] = k;
+        t += k;
+    }
+    for (int i = 0; i < 2*self->radius+1; i++) {
+        self->kernel[i] /= t;
+    }
+    int n = (width < height)? height : width;
+    self->ramp = (nn_real*)calloc(n, sizeof(nn_real));
+    for (int i = 0; i < n; i++) {
+        self->ramp[i] = i;
+    }
+
+#if DEBUG_AUGMENT
+    fprintf(stderr, "Augment_create: shift=%d, rotate=%.1f, alpha=%.1f, "
+            "sigma=%.1f, noise=%.3f\n", shift, rotate, alpha, sigma, noise);
+#endif
+    return self;
+}
+
+/* Augment_destroy(self)
+   Releases the memory.
+*/
+void Augment_destroy(Augment* self)
+{
+    assert (self != NULL);
+    free(self->kernel);
+    free(self->ramp);
+    free(self);
+}
+
+/* Augment_getWorkSize(self)
+   Returns the size of the work buffer.
+*/
+int Augment_getWorkSize(const Augment* self)
+{
+    assert (self != NULL);
+    /* u, v, field, blurred field, original image. */
+    return 5 * self->width * self->height;
+}
+
+/* Augment_blur(self, w, h, x, y)
+   Smooths a (h x w) matrix x along the columns into y.
+*/
+static void Augment_blur(
+    const Augment* self, int w, int h, const nn_real* x, nn_real* y)
+{
+    int r = self->radius;
+    for (int i = 0; i < w*h; i++) {
+        y[i] = 0;
+    }
+    for (int d = -r; d <= r; d++) {
+        /* Rows i such that 0 <= i+d < h. */
+        int i0 = (d < 0)? -d : 0;
+        int i1 = (d < 0)? h : h-d;
+        if (i1 <= i0) continue;
+        simd_axpy((i1-i0) * w, self->kernel[d + r],
+                  &x[(i0+d) * w], &y[i0 * w]);
+    }
+}
+
+/* Augment_field(self, state, f, t, b)
+   Adds a smoothed random displacement field to f.
+*/
+static void Augment_field(
+    const Augment* self, uint64_t* state, nn_real* f, nn_real* t, nn_real* b)
+{
+    int w = self->width;
+    int h = self->height;
+    for (int i = 0; i < w*h; i++) {
+        t[i] = augment_uniform(state);
+    }
+    Augment_blur(self, w, h, t, b);
+    augment_transpose(w, h, b, t);
+    Augment_blur(self, h, w, t, b);
+    augment_transpose(h, w, b, t);
+    simd_axpy(w*h, self->alpha, t, f);
+}
+
+/* Augment_apply(self, seed, x, work)
+   Distorts an image x in place.
+*/
+void Augment_apply(const Augment* self, uint64_t seed, nn_real* x, nn_real* work)
+{
+    assert (self != NULL);
+    assert (x != NULL);
+    assert (work != NULL);
+
+    int w = self->width;
+    int h = self->height;
+    int n = w*h;
+    uint64_t state = shuffle_seed(seed, 0);
+    nn_real* u = work;
+    nn_real* v = work + n;
+    nn_real* t = work + 2*n;
+    nn_real* b = work + 3*n;
+    nn_real* src = work + 4*n;
+
+    if (self->shift != 0 || self->rotate != 0 || self->alpha != 0) {
+        /* Where each output pixel comes from. */
+        double a = self->rotate * augment_uniform(&state) * M_PI / 180;
+        double c = cos(a), s = sin(a);
+        int dx = 0, dy = 0;
+        if (self->shift != 0) {
+            dx = shuffle_below(&state, 2*self->shift+1) - self->shift;
+            dy = shuffle_below(&state, 2*self->shift+1) - self->shift;
+        }
+        double cx = (w-1) / 2.0, cy = (h-1) / 2.0;
+        for (int i = 0; i < h; i++) {
+            nn_real u0 = -c*cx + s*(i-cy) + cx - dx;
+            nn_real v0 = s*cx + c*(i-cy) + cy - dy;
+            for (int j = 0; j < w; j++) {
+                u[i*w + j] = u0;
+                v[i*w + j] = v0;
+            }
+            simd_axpy(w, c, self->ramp, &u[i*w]);
+            simd_axpy(w, -s, self->ramp, &v[i*w]);
+        }
+        if (self->alpha != 0) {
+            Augment_field(self, &state, u, t, b);
+            Augment_field(self, &state, v, t, b);
+        }
+
+        /* Bilinear lookup (zero outside). */
+        for (int i = 0; i < n; i++) {
+            src[i] = x[i];
+        }
+        for (int i = 0; i < n; i++) {
+            nn_real fx = floor(u[i]), fy = floor(v[i]);
+            nn_real ax = u[i] - fx, ay = v[i] - fy;
+            int x0 = (int)fx, y0 = (int)fy;
+            nn_real p00 = 0, p01 = 0, p10 = 0, p11 = 0;
+            if (0 <= y0 && y0 < h) {
+                if (0 <= x0 && x0 < w) p00 = src[y0*w + x0];
+                if (0 <= x0+1 && x0+1 < w) p01 = src[y0*w + x0+1];
+            }
+            if (0 <= y0+1 && y0+1 < h) {
+                if (0 <= x0 && x0 < w) p10 = src[(y0+1)*w + x0];
+                if (0 <= x0+1 && x0+1 < w) p11 = src[(y0+1)*w + x0+1];
+            }
+            x[i] = ((p00 * (1-ax) + p01 * ax) * (1-ay) +
+                    (p10 * (1-ax) + p11 * ax) * ay);
+        }
+    }
+
+    if (self->noise != 0) {
+        /* Uniform noise with the given stddev. */
+        for (int i = 0; i < n; i++) {
+            t[i] = augment_uniform(&state);
+        }
+        simd_axpy(n, self->noise * sqrt(3.0), t, x);
+        for (int i = 0; i < n; i++) {
+            x[i] = (x[i] < 0)? 0 : (1 < x[i])? 1 : x[i];
+        }
+    }
+}
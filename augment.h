@@ -0,0 +1,52 @@
+/*
+  augment.h
+  Random distortions of image inputs.
+  Requires cnn.h.
+*/
+
+#include <stdint.h>
+
+
+/*  Augment
+ */
+typedef struct _Augment {
+
+    int width, height;          /* Image size */
+    int shift;                  /* Max. shift (pixels) */
+    double rotate;              /* Max. rotation (degrees) */
+    double alpha;               /* Elastic displacement scale (pixels) */
+    double sigma;               /* Elastic smoothness (pixels) */
+    double noise;               /* Noise stddev */
+
+    int radius;                 /* Radius of the Gaussian kernel */
+    nn_real* kernel;            /* Gaussian kernel (2*radius+1) */
+    nn_real* ramp;              /* 0, 1, 2, ... (max(width, height)) */
+
+} Augment;
+
+/* Augment_create(width, height, shift, rotate, alpha, sigma, noise)
+   Creates an Augment for (height x width) images.
+   Each distortion is disabled by a zero parameter.
+*/
+Augment* Augment_create(
+    int width, int height, int shift, double rotate,
+    double alpha, double sigma, double noise);
+
+/* Augment_destroy(self)
+   Releases the memory.
+*/
+void Augment_destroy(Augment* self);
+
+/* Augment_getWorkSize(self)
+   Returns the num. of nn_reals of work buffer for Augment_apply().
+*/
+int Augment_getWorkSize(const Augment* self);
+
+/* Augment_apply(self, seed, x, work)
+   Distorts an image x in place: shift and rotation about the
+   center, plus an elastic displacement (a random field smoothed
+   with a Gaussian), resampled bilinearly, then adds uniform noise
+   and clamps the values to [0, 1]. The distortion only depends
+   on seed. self is not changed, so threads can share it.
+*/
+void Augment_apply(const Augment* self, uint64_t seed, nn_real* x, nn_real* work);
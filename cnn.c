@@ -6,11 +6,54 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <sys/mman.h>
 #include "cnn.h"
+#include "gemm.h"
+#include "simd.h"
 
 #define DEBUG_LAYER 0
 
+/*  ConvSpec
+    Conv kernels specialized for a (kernsize, stride, padding).
+ */
+typedef struct _ConvSpec {
+    int kernsize, stride, padding;
+    void (*feedForw)(Layer* self);
+    void (*im2col)(const Layer* self, const nn_real* src, nn_real* cols);
+    void (*col2im)(const Layer* self, const nn_real* dcols, nn_real* dst);
+} ConvSpec;
+
+#ifdef NN_FLOAT
+#define nn_exp expf
+#define nn_tanh tanhf
+#else
+#define nn_exp exp
+#define nn_tanh tanh
+#endif
+
+#ifdef NN_FAST_MATH
+/* Polynomial approximations (simd.h). */
+#define nn_vexp simd_exp
+#define nn_vtanh simd_tanh
+#else
+/* nn_vexp(n, x, y): y[i] = exp(x[i]) */
+static void nn_vexp(int n, const nn_real* x, nn_real* y)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] = nn_exp(x[i]);
+    }
+}
+/* nn_vtanh(n, x, y): y[i] = tanh(x[i]) */
+static void nn_vtanh(int n, const nn_real* x, nn_real* y)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] = nn_tanh(x[i]);
+    }
+}
+#endif
+
 
 /*  Misc. functions
  */
@@ -48,18 +91,18 @@ static inline double tanh(double x)
 }
 #endif
 /* tanh_g(y): hyperbolic tangent gradient */
-static inline double tanh_g(double y)
+static inline nn_real tanh_g(nn_real y)
 {
     return 1.0 - y*y;
 }
 
 /* relu(x): ReLU */
-static inline double relu(double x)
+static inline nn_real relu(nn_real x)
 {
     return (0 < x)? x : 0;
 }
 /* relu_g(y): ReLU gradient */
-static inline double relu_g(double y)
+static inline nn_real relu_g(nn_real y)
 {
     return (0 < y)? 1 : 0;
 }
@@ -94,21 +137,240 @@ static Layer* Layer_create(
 
     /* Nnodes: number of outputs. */
     self->nnodes = depth * width * height;
-    self->outputs = (double*)calloc(self->nnodes, sizeof(double));
-    self->gradients = (double*)calloc(self->nnodes, sizeof(double));
-    self->errors = (double*)calloc(self->nnodes, sizeof(double));
+    self->nbatch = 1;
+    self->maxbatch = 1;
+    self->outputs = (nn_real*)calloc(self->nnodes, sizeof(nn_real));
+    self->gradients = (nn_real*)calloc(self->nnodes, sizeof(nn_real));
+    self->errors = (nn_real*)calloc(self->nnodes, sizeof(nn_real));
+    self->dnets = (nn_real*)calloc(self->nnodes, sizeof(nn_real));
 
     self->nbiases = nbiases;
-    self->biases = (double*)calloc(self->nbiases, sizeof(double));
-    self->u_biases = (double*)calloc(self->nbiases, sizeof(double));
+    self->biases = (nn_real*)calloc(self->nbiases, sizeof(nn_real));
+    self->u_biases = (nn_real*)calloc(self->nbiases, sizeof(nn_real));
 
     self->nweights = nweights;
-    self->weights = (double*)calloc(self->nweights, sizeof(double));
-    self->u_weights = (double*)calloc(self->nweights, sizeof(double));
+    self->weights = (nn_real*)calloc(self->nweights, sizeof(nn_real));
+    self->u_weights = (nn_real*)calloc(self->nweights, sizeof(nn_real));
+
+    return self;
+}
+
+
+/*  Arena
+ */
+
+#define ARENA_ALIGN 64
+#define ARENA_HUGEPAGE (2*1024*1024)
+
+/* arena_round(n): rounds n up to a multiple of ARENA_ALIGN bytes. */
+static size_t arena_round(size_t n)
+{
+    size_t k = ARENA_ALIGN / sizeof(nn_real);
+    return (n + k-1) / k * k;
+}
+
+/* arena_alloc(n)
+   Allocates n zeroed elements aligned to ARENA_ALIGN.
+   Large blocks are aligned to huge pages and marked for them.
+*/
+static nn_real* arena_alloc(size_t n)
+{
+    size_t size = n * sizeof(nn_real);
+    size_t align = ARENA_ALIGN;
+    void* p = NULL;
+    if (size == 0) return NULL;
+    if (ARENA_HUGEPAGE <= size) {
+        align = ARENA_HUGEPAGE;
+        size = (size + ARENA_HUGEPAGE-1) / ARENA_HUGEPAGE * ARENA_HUGEPAGE;
+    }
+    if (posix_memalign(&p, align, size) != 0) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (align == ARENA_HUGEPAGE) {
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+#endif
+    memset(p, 0, size);
+    return (nn_real*)p;
+}
+
+/* Arena_bindActs(self, maxbatch)
+   Allocates the per-sample block for maxbatch samples
+   and points the buffers of the Layers into it.
+*/
+static void Arena_bindActs(Arena* self, int maxbatch)
+{
+    size_t n = 0;
+    for (Layer* layer = self->linput; layer != NULL; layer = layer->lnext) {
+        int nbufs = (layer->inference)? 1 : 4;
+        n += nbufs * arena_round(maxbatch * layer->nnodes);
+        if (layer->ltype == LAYER_CONV) {
+            n += arena_round(maxbatch * layer->conv.ncols);
+            if (!layer->inference) {
+                n += arena_round(layer->conv.ncols);
+            }
+            n += arena_round(layer->conv.nwino);
+        }
+    }
+    nn_real* p = arena_alloc(n);
+    assert (p != NULL);
+    free(self->acts);
+    self->acts = p;
+    self->nacts = n;
+    self->maxbatch = maxbatch;
+
+    for (Layer* layer = self->linput; layer != NULL; layer = layer->lnext) {
+        size_t m = arena_round(maxbatch * layer->nnodes);
+        layer->outputs = p; p += m;
+        if (!layer->inference) {
+            layer->gradients = p; p += m;
+            layer->errors = p; p += m;
+            layer->dnets = p; p += m;
+        }
+        if (layer->ltype == LAYER_CONV) {
+            layer->conv.cols = p;
+            p += arena_round(maxbatch * layer->conv.ncols);
+            if (!layer->inference) {
+                layer->conv.dcols = p;
+                p += arena_round(layer->conv.ncols);
+            }
+            if (layer->conv.nwino != 0) {
+                layer->conv.wino = p;
+                layer->conv.winow = 0;
+                p += arena_round(layer->conv.nwino);
+            }
+        }
+        if (layer->ltype == LAYER_POOL && !layer->inference) {
+            /* Not an nn_real buffer. */
+            free(layer->pool.argmax);
+            layer->pool.argmax = (int*)calloc(
+                maxbatch * layer->nnodes, sizeof(int));
+        }
+        layer->maxbatch = maxbatch;
+    }
+}
+
+/* Arena_create(linput)
+   Moves the buffers of all the Layers into an Arena.
+*/
+Arena* Arena_create(Layer* linput)
+{
+    assert (linput != NULL);
+    assert (linput->lprev == NULL);
+    int shared = linput->shared;
+    int inference = linput->inference;
+
+    Arena* self = (Arena*)calloc(1, sizeof(Arena));
+    if (self == NULL) return NULL;
+    self->linput = linput;
+
+    size_t n = 0;
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        assert (layer->arena == NULL);
+        assert (layer->shared == shared);
+        assert (layer->inference == inference);
+        n += arena_round(layer->nbiases) + arena_round(layer->nweights);
+    }
+    self->nparams = n;
+    if (!shared) {
+        self->params = arena_alloc(n);
+    }
+    if (!inference) {
+        self->updates = arena_alloc(n);
+    }
+
+    nn_real* p = self->params;
+    nn_real* u = self->updates;
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        if (!shared) {
+            memcpy(p, layer->biases, layer->nbiases * sizeof(nn_real));
+            free(layer->biases);
+            layer->biases = p;
+            p += arena_round(layer->nbiases);
+            memcpy(p, layer->weights, layer->nweights * sizeof(nn_real));
+            free(layer->weights);
+            layer->weights = p;
+            p += arena_round(layer->nweights);
+        }
+        if (!inference) {
+            memcpy(u, layer->u_biases, layer->nbiases * sizeof(nn_real));
+            free(layer->u_biases);
+            layer->u_biases = u;
+            u += arena_round(layer->nbiases);
+            memcpy(u, layer->u_weights, layer->nweights * sizeof(nn_real));
+            free(layer->u_weights);
+            layer->u_weights = u;
+            u += arena_round(layer->nweights);
+        }
+
+        free(layer->outputs);
+        free(layer->gradients);
+        free(layer->errors);
+        free(layer->dnets);
+        if (layer->ltype == LAYER_CONV) {
+            free(layer->conv.cols);
+            free(layer->conv.dcols);
+            free(layer->conv.wino);
+            layer->conv.cols = NULL;
+            layer->conv.dcols = NULL;
+            layer->conv.wino = NULL;
+        }
+        layer->arena = self;
+    }
+    Arena_bindActs(self, linput->maxbatch);
 
     return self;
 }
 
+/* Arena_destroy(self)
+   Releases the memory.
+*/
+void Arena_destroy(Arena* self)
+{
+    assert (self != NULL);
+    free(self->params);
+    free(self->updates);
+    free(self->acts);
+    free(self);
+}
+
+
+/* Layer_reserve(self, nbatch)
+   Grows the per-sample buffers of the Layers to hold nbatch samples.
+*/
+static void Layer_reserve(Layer* self, int nbatch)
+{
+    if (self->arena != NULL && self->arena->maxbatch < nbatch) {
+        Arena_bindActs(self->arena, nbatch);
+    }
+    while (self != NULL) {
+        if (self->maxbatch < nbatch) {
+            int n = nbatch * self->nnodes;
+            free(self->outputs);
+            self->outputs = (nn_real*)calloc(n, sizeof(nn_real));
+            if (!self->inference) {
+                free(self->gradients);
+                free(self->errors);
+                free(self->dnets);
+                self->gradients = (nn_real*)calloc(n, sizeof(nn_real));
+                self->errors = (nn_real*)calloc(n, sizeof(nn_real));
+                self->dnets = (nn_real*)calloc(n, sizeof(nn_real));
+            }
+            if (self->ltype == LAYER_CONV) {
+                free(self->conv.cols);
+                self->conv.cols = (nn_real*)calloc(
+                    nbatch * self->conv.ncols, sizeof(nn_real));
+            }
+            if (self->ltype == LAYER_POOL && !self->inference) {
+                free(self->pool.argmax);
+                self->pool.argmax = (int*)calloc(n, sizeof(int));
+            }
+            self->maxbatch = nbatch;
+        }
+        self->nbatch = nbatch;
+        self = self->lnext;
+    }
+}
+
 /* Layer_destroy(self)
    Releases the memory.
 */
@@ -116,18 +378,159 @@ void Layer_destroy(Layer* self)
 {
     assert (self != NULL);
 
+    free(self->active);
+    if (self->ltype == LAYER_FULL) {
+        free(self->full.wt);
+    }
+    if (self->ltype == LAYER_POOL) {
+        free(self->pool.argmax);
+    }
+    if (self->ltype == LAYER_CONV) {
+        free(self->conv.nhwc);
+    }
+    if (self->arena != NULL) {
+        /* The buffers belong to the Arena. */
+        free(self);
+        return;
+    }
+
     free(self->outputs);
     free(self->gradients);
     free(self->errors);
+    free(self->dnets);
 
-    free(self->biases);
+    if (!self->shared) {
+        free(self->biases);
+        free(self->weights);
+    }
     free(self->u_biases);
-    free(self->weights);
     free(self->u_weights);
 
+    if (self->ltype == LAYER_CONV) {
+        free(self->conv.cols);
+        free(self->conv.dcols);
+        free(self->conv.wino);
+    }
+
     free(self);
 }
 
+/* Layer_setInference(linput)
+   Converts the Layers starting from linput for inference only.
+*/
+void Layer_setInference(Layer* linput)
+{
+    assert (linput != NULL);
+    assert (linput->lprev == NULL);
+
+    Arena* arena = linput->arena;
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        if (arena == NULL) {
+            free(layer->gradients);
+            free(layer->errors);
+            free(layer->dnets);
+            free(layer->u_biases);
+            free(layer->u_weights);
+            if (layer->ltype == LAYER_CONV) {
+                free(layer->conv.dcols);
+            }
+        }
+        layer->gradients = NULL;
+        layer->errors = NULL;
+        layer->dnets = NULL;
+        layer->u_biases = NULL;
+        layer->u_weights = NULL;
+        if (layer->ltype == LAYER_CONV) {
+            layer->conv.dcols = NULL;
+        }
+        if (layer->ltype == LAYER_FULL) {
+            /* Transposed again from the final weights. */
+            free(layer->full.wt);
+            layer->full.wt = NULL;
+        }
+        if (layer->ltype == LAYER_POOL) {
+            free(layer->pool.argmax);
+            layer->pool.argmax = NULL;
+        }
+        layer->inference = 1;
+    }
+
+    if (arena != NULL) {
+        /* Repack the per-sample block without the training buffers. */
+        free(arena->updates);
+        arena->updates = NULL;
+        Arena_bindActs(arena, arena->maxbatch);
+    }
+}
+
+/* Layer_setConvAlgo(self, algo)
+   Selects the algorithm of a convolutional Layer.
+*/
+void Layer_setConvAlgo(Layer* self, ConvAlgo algo)
+{
+    assert (self != NULL);
+    assert (self->ltype == LAYER_CONV);
+    assert (algo != CONV_WINOGRAD || self->conv.nwino != 0);
+    assert (algo == CONV_GEMM || self->conv.layout == CONV_NCHW);
+    self->conv.algo = algo;
+    self->conv.winow = 0;
+}
+
+/* Layer_setConvLayout(self, layout)
+   Selects the activation layout of a convolutional Layer.
+*/
+void Layer_setConvLayout(Layer* self, ConvLayout layout)
+{
+    assert (self != NULL);
+    assert (self->ltype == LAYER_CONV);
+    self->conv.layout = layout;
+    free(self->conv.nhwc);
+    self->conv.nhwc = NULL;
+    self->conv.nhwcw = 0;
+    if (layout == CONV_NHWC) {
+        self->conv.algo = CONV_GEMM;
+        self->conv.nhwc = (nn_real*)calloc(
+            2 * self->nweights + 2 * self->lprev->nnodes, sizeof(nn_real));
+    }
+}
+
+/*  NHWC layout
+    The inputs are lowered in (y, x, depth) order: each kernel row
+    is a contiguous run of kernsize*depth inputs, and cols is a
+    (width*height) x (kernsize*kernsize*depth) matrix. The weights
+    are permuted to (depth, dy, dx, z0) order to match it.
+ */
+
+/* Layer_isNHWC(self)
+   Returns 1 if the outputs of self are stored in (y, x, depth) order.
+*/
+static int Layer_isNHWC(const Layer* self)
+{
+    return (self->ltype == LAYER_CONV && self->conv.layout == CONV_NHWC &&
+            self->lnext != NULL && self->lnext->ltype == LAYER_CONV &&
+            self->lnext->conv.layout == CONV_NHWC);
+}
+
+/* nhwc_to(depth, npixels, src, dst): (depth, pixel) -> (pixel, depth) */
+static void nhwc_to(int depth, int npixels, const nn_real* src, nn_real* dst)
+{
+    for (int z = 0; z < depth; z++) {
+        for (int j = 0; j < npixels; j++) {
+            dst[j * depth + z] = src[z * npixels + j];
+        }
+    }
+}
+
+/* nhwc_from(depth, npixels, src, dst): (pixel, depth) -> (depth, pixel) */
+static void nhwc_from(int depth, int npixels, const nn_real* src, nn_real* dst)
+{
+    for (int j = 0; j < npixels; j++) {
+        for (int z = 0; z < depth; z++) {
+            dst[z * npixels + j] = src[j * depth + z];
+        }
+    }
+}
+
 /* Layer_dump(self, fp)
    Shows the debug output.
 */
@@ -142,17 +545,25 @@ void Layer_dump(const Layer* self, FILE* fp)
     fprintf(fp, "shape=(%d,%d,%d), nodes=%d\n",
             self->depth, self->width, self->height, self->nnodes);
     {
+        const nn_real* outputs = self->outputs;
+        nn_real* t = NULL;
+        if (Layer_isNHWC(self)) {
+            t = (nn_real*)calloc(self->nnodes, sizeof(nn_real));
+            nhwc_from(self->depth, self->width * self->height, outputs, t);
+            outputs = t;
+        }
         int i = 0;
         for (int z = 0; z < self->depth; z++) {
             fprintf(fp, "  %d:\n", z);
             for (int y = 0; y < self->height; y++) {
                 fprintf(fp, "    [");
                 for (int x = 0; x < self->width; x++) {
-                    fprintf(fp, " %.4f", self->outputs[i++]);
+                    fprintf(fp, " %.4f", outputs[i++]);
                 }
                 fprintf(fp, "]\n");
             }
         }
+        free(t);
     }
 
     switch (self->ltype) {
@@ -195,11 +606,111 @@ void Layer_dump(const Layer* self, FILE* fp)
         }
         break;
 
+    case LAYER_POOL:
+        /* Pooling layer. */
+        assert (lprev != NULL);
+        fprintf(fp, "  %s, stride=%d, kernsize=%d\n",
+                (self->pool.ptype == POOL_MAX)? "max" : "avg",
+                self->pool.stride, self->pool.kernsize);
+        break;
+
+    case LAYER_DWCONV:
+        /* Depthwise convolutional layer. */
+        assert (lprev != NULL);
+        fprintf(fp, "  stride=%d, kernsize=%d\n",
+                self->dwconv.stride, self->dwconv.kernsize);
+        {
+            int ksize = self->dwconv.kernsize * self->dwconv.kernsize;
+            for (int z = 0; z < self->depth; z++) {
+                fprintf(fp, "  %d: bias=%.4f, weights = [", z, self->biases[z]);
+                for (int j = 0; j < ksize; j++) {
+                    fprintf(fp, " %.4f", self->weights[z * ksize + j]);
+                }
+                fprintf(fp, "]\n");
+            }
+        }
+        break;
+
     default:
         break;
     }
 }
 
+/* Layer_sparseInputs(self, density, npasses)
+   Counts the nonzero inputs of the batch and returns 1 if
+   their share is below density and the zero inputs make up for
+   npasses extra passes over the whole input of a sample.
+*/
+static int Layer_sparseInputs(Layer* self, double density, int npasses)
+{
+    const Layer* lprev = self->lprev;
+    int n = self->nbatch * lprev->nnodes;
+    int nz = 0;
+    for (int i = 0; i < n; i++) {
+        nz += (lprev->outputs[i] != 0);
+    }
+    self->nzinputs += nz;
+    self->ninputs += n;
+    return (nz < density * n && npasses * lprev->nnodes <= n - nz);
+}
+
+/* Layer_compact(self, x, n)
+   Stores the indices of the nonzero x[i] in active
+   and returns their number.
+*/
+static int Layer_compact(Layer* self, const nn_real* x, int n)
+{
+    int* active = self->active;
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (x[i] != 0) {
+            active[m++] = i;
+        }
+    }
+    return m;
+}
+
+/* Layer_feedForw_full_sparse(self)
+   Computes Y = (W * X + B) as a sum of the columns of W at the
+   nonzero inputs of each sample. The columns are taken from a
+   transposed copy of W, made once per batch (once for all in
+   inference mode, where W is fixed).
+*/
+static void Layer_feedForw_full_sparse(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int nnodes = self->nnodes;
+    int lnnodes = lprev->nnodes;
+    nn_real* wt = self->full.wt;
+    if (wt == NULL || !self->inference) {
+        if (wt == NULL) {
+            wt = (nn_real*)calloc(self->nweights, sizeof(nn_real));
+            self->full.wt = wt;
+        }
+        for (int i0 = 0; i0 < nnodes; i0 += 16) {
+            int i1 = (nnodes < i0+16)? nnodes : i0+16;
+            for (int j = 0; j < lnnodes; j++) {
+                for (int i = i0; i < i1; i++) {
+                    wt[j * nnodes + i] = self->weights[i * lnnodes + j];
+                }
+            }
+        }
+    }
+
+    const int* active = self->active;
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lnnodes];
+        nn_real* outputs = &self->outputs[s * nnodes];
+        int m = Layer_compact(self, inputs, lnnodes);
+        memcpy(outputs, self->biases, nnodes * sizeof(nn_real));
+        for (int k = 0; k < m; k++) {
+            int j = active[k];
+            simd_axpy(nnodes, inputs[j], &wt[j * nnodes], outputs);
+        }
+    }
+}
+
 /* Layer_feedForw_full(self)
    Performs feed forward updates.
 */
@@ -209,42 +720,65 @@ static void Layer_feedForw_full(Layer* self)
     assert (self->lprev != NULL);
     Layer* lprev = self->lprev;
 
-    int k = 0;
-    for (int i = 0; i < self->nnodes; i++) {
-        /* Compute Y = (W * X + B) without activation function. */
-        double x = self->biases[i];
-        for (int j = 0; j < lprev->nnodes; j++) {
-            x += (lprev->outputs[j] * self->weights[k++]);
+    int nbatch = self->nbatch;
+    /* In training, the sparse path also transposes W first. */
+    if (Layer_sparseInputs(self, FULL_SPARSE_DENSITY, !self->inference)) {
+        Layer_feedForw_full_sparse(self);
+    } else if (nbatch == 1) {
+        for (int i = 0; i < self->nnodes; i++) {
+            /* Compute Y = (W * X + B) without activation function. */
+            const nn_real* w = &self->weights[i * lprev->nnodes];
+            self->outputs[i] = self->biases[i] +
+                simd_dot(lprev->nnodes, w, lprev->outputs);
+        }
+    } else {
+        /* Compute Y^T = (W * X^T + B) for all the samples at once. */
+        for (int s = 0; s < nbatch; s++) {
+            for (int i = 0; i < self->nnodes; i++) {
+                self->outputs[s*self->nnodes + i] = self->biases[i];
+            }
         }
-        self->outputs[i] = x;
+        gemm(self->nnodes, nbatch, lprev->nnodes,
+             self->weights, lprev->nnodes, 1,
+             lprev->outputs, 1, lprev->nnodes,
+             self->outputs, 1, self->nnodes);
     }
 
     if (self->lnext == NULL) {
         /* Last layer - use Softmax. */
-        double m = -1;
-        for (int i = 0; i < self->nnodes; i++) {
-            double x = self->outputs[i];
-            if (m < x) { m = x; }
-        }
-        double t = 0;
-        for (int i = 0; i < self->nnodes; i++) {
-            double x = self->outputs[i];
-            double y = exp(x-m);
-            self->outputs[i] = y;
-            t += y;
-        }
-        for (int i = 0; i < self->nnodes; i++) {
-            self->outputs[i] /= t;
-            /* This isn't right, but set the same value to all the gradients. */
-            self->gradients[i] = 1;
+        for (int s = 0; s < nbatch; s++) {
+            nn_real* outputs = &self->outputs[s*self->nnodes];
+            nn_real m = -1;
+            for (int i = 0; i < self->nnodes; i++) {
+                nn_real x = outputs[i];
+                if (m < x) { m = x; }
+            }
+            for (int i = 0; i < self->nnodes; i++) {
+                outputs[i] -= m;
+            }
+            nn_vexp(self->nnodes, outputs, outputs);
+            nn_real t = 0;
+            for (int i = 0; i < self->nnodes; i++) {
+                t += outputs[i];
+            }
+            for (int i = 0; i < self->nnodes; i++) {
+                outputs[i] /= t;
+            }
+            if (!self->inference) {
+                nn_real* gradients = &self->gradients[s*self->nnodes];
+                for (int i = 0; i < self->nnodes; i++) {
+                    /* This isn't right, but set the same value to all the gradients. */
+                    gradients[i] = 1;
+                }
+            }
         }
     } else {
         /* Otherwise, use Tanh. */
-        for (int i = 0; i < self->nnodes; i++) {
-            double x = self->outputs[i];
-            double y = tanh(x);
-            self->outputs[i] = y;
-            self->gradients[i] = tanh_g(y);
+        nn_vtanh(nbatch * self->nnodes, self->outputs, self->outputs);
+        if (!self->inference) {
+            for (int i = 0; i < nbatch * self->nnodes; i++) {
+                self->gradients[i] = tanh_g(self->outputs[i]);
+            }
         }
     }
 
@@ -268,31 +802,59 @@ static void Layer_feedBack_full(Layer* self)
     assert (self->lprev != NULL);
     Layer* lprev = self->lprev;
 
-    /* Clear errors. */
-    for (int j = 0; j < lprev->nnodes; j++) {
-        lprev->errors[j] = 0;
-    }
-
-    int k = 0;
-    for (int i = 0; i < self->nnodes; i++) {
-        /* Computer the weight/bias updates. */
-        double dnet = self->errors[i] * self->gradients[i];
+    int nbatch = self->nbatch;
+    if (nbatch == 1) {
+        /* Clear errors. */
         for (int j = 0; j < lprev->nnodes; j++) {
+            lprev->errors[j] = 0;
+        }
+
+        for (int i = 0; i < self->nnodes; i++) {
+            /* Computer the weight/bias updates. */
+            nn_real dnet = self->errors[i] * self->gradients[i];
+            int k = i * lprev->nnodes;
             /* Propagate the errors to the previous layer. */
-            lprev->errors[j] += self->weights[k] * dnet;
-            self->u_weights[k] += dnet * lprev->outputs[j];
-            k++;
+            simd_axpy(lprev->nnodes, dnet, &self->weights[k], lprev->errors);
+            simd_axpy(lprev->nnodes, dnet, lprev->outputs, &self->u_weights[k]);
+            self->u_biases[i] += dnet;
+        }
+    } else {
+        /* Compute the deltas of all the samples. */
+        for (int i = 0; i < nbatch * self->nnodes; i++) {
+            self->dnets[i] = self->errors[i] * self->gradients[i];
+        }
+        for (int s = 0; s < nbatch; s++) {
+            for (int i = 0; i < self->nnodes; i++) {
+                self->u_biases[i] += self->dnets[s*self->nnodes + i];
+            }
+        }
+
+        /* dW (nnodes x lprev->nnodes) += dnet^T (nnodes x nbatch) * X (nbatch x lprev->nnodes) */
+        gemm(self->nnodes, lprev->nnodes, nbatch,
+             self->dnets, 1, self->nnodes,
+             lprev->outputs, lprev->nnodes, 1,
+             self->u_weights, lprev->nnodes, 1);
+
+        /* The input layer has no use for its errors. */
+        if (lprev->ltype != LAYER_INPUT) {
+            /* dX (nbatch x lprev->nnodes) = dnet (nbatch x nnodes) * W (nnodes x lprev->nnodes) */
+            for (int j = 0; j < nbatch * lprev->nnodes; j++) {
+                lprev->errors[j] = 0;
+            }
+            gemm(nbatch, lprev->nnodes, self->nnodes,
+                 self->dnets, self->nnodes, 1,
+                 self->weights, lprev->nnodes, 1,
+                 lprev->errors, lprev->nnodes, 1);
         }
-        self->u_biases[i] += dnet;
     }
 
 #if DEBUG_LAYER
     fprintf(stderr, "Layer_feedBack_full(Layer%d):\n", self->lid);
     for (int i = 0; i < self->nnodes; i++) {
-        double dnet = self->errors[i] * self->gradients[i];
+        nn_real dnet = self->errors[i] * self->gradients[i];
         fprintf(stderr, "  dnet = %.4f, dw = [", dnet);
         for (int j = 0; j < lprev->nnodes; j++) {
-            double dw = dnet * lprev->outputs[j];
+            nn_real dw = dnet * lprev->outputs[j];
             fprintf(stderr, " %.4f", dw);
         }
         fprintf(stderr, "]\n");
@@ -300,142 +862,1654 @@ static void Layer_feedBack_full(Layer* self)
 #endif
 }
 
-/* Layer_feedForw_conv(self)
-   Performs feed forward updates.
+/* Layer_feedForw_conv_direct(self)
+   Computes the convolution with the reference loop.
 */
-static void Layer_feedForw_conv(Layer* self)
+static void Layer_feedForw_conv_direct(Layer* self)
 {
-    assert (self->ltype == LAYER_CONV);
-    assert (self->lprev != NULL);
     Layer* lprev = self->lprev;
 
     int kernsize = self->conv.kernsize;
-    int i = 0;
-    for (int z1 = 0; z1 < self->depth; z1++) {
-        /* z1: dst matrix */
-        /* qbase: kernel matrix base index */
-        int qbase = z1 * lprev->depth * kernsize * kernsize;
-        for (int y1 = 0; y1 < self->height; y1++) {
-            int y0 = self->conv.stride * y1 - self->conv.padding;
-            for (int x1 = 0; x1 < self->width; x1++) {
-                int x0 = self->conv.stride * x1 - self->conv.padding;
-                /* Compute the kernel at (x1,y1) */
-                /* (x0,y0): src pixel */
-                double v = self->biases[z1];
-                for (int z0 = 0; z0 < lprev->depth; z0++) {
-                    /* z0: src matrix */
-                    /* pbase: src matrix base index */
-                    int pbase = z0 * lprev->width * lprev->height;
-                    for (int dy = 0; dy < kernsize; dy++) {
-                        int y = y0+dy;
-                        if (0 <= y && y < lprev->height) {
-                            int p = pbase + y*lprev->width;
-                            int q = qbase + dy*kernsize;
-                            for (int dx = 0; dx < kernsize; dx++) {
-                                int x = x0+dx;
-                                if (0 <= x && x < lprev->width) {
-                                    v += lprev->outputs[p+x] * self->weights[q+dx];
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lprev->nnodes];
+        nn_real* outputs = &self->outputs[s * self->nnodes];
+        int i = 0;
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            /* z1: dst matrix */
+            /* qbase: kernel matrix base index */
+            int qbase = z1 * lprev->depth * kernsize * kernsize;
+            for (int y1 = 0; y1 < self->height; y1++) {
+                int y0 = self->conv.stride * y1 - self->conv.padding;
+                for (int x1 = 0; x1 < self->width; x1++) {
+                    int x0 = self->conv.stride * x1 - self->conv.padding;
+                    /* Compute the kernel at (x1,y1) */
+                    /* (x0,y0): src pixel */
+                    nn_real v = self->biases[z1];
+                    for (int z0 = 0; z0 < lprev->depth; z0++) {
+                        /* z0: src matrix */
+                        /* pbase: src matrix base index */
+                        int pbase = z0 * lprev->width * lprev->height;
+                        for (int dy = 0; dy < kernsize; dy++) {
+                            int y = y0+dy;
+                            if (0 <= y && y < lprev->height) {
+                                int p = pbase + y*lprev->width;
+                                int q = qbase + (z0*kernsize + dy)*kernsize;
+                                for (int dx = 0; dx < kernsize; dx++) {
+                                    int x = x0+dx;
+                                    if (0 <= x && x < lprev->width) {
+                                        v += inputs[p+x] * self->weights[q+dx];
+                                    }
                                 }
                             }
                         }
                     }
+                    outputs[i++] = v;
                 }
-                /* Apply the activation function. */
-                v = relu(v);
-                self->outputs[i] = v;
-                self->gradients[i] = relu_g(v);
-                i++;
             }
         }
+        assert (i == self->nnodes);
     }
-    assert (i == self->nnodes);
-
-#if DEBUG_LAYER
-    fprintf(stderr, "Layer_feedForw_conv(Layer%d):\n", self->lid);
-    fprintf(stderr, "  outputs = [");
-    for (int i = 0; i < self->nnodes; i++) {
-        fprintf(stderr, " %.4f", self->outputs[i]);
-    }
-    fprintf(stderr, "]\n  gradients = [");
-    for (int i = 0; i < self->nnodes; i++) {
-        fprintf(stderr, " %.4f", self->gradients[i]);
-    }
-    fprintf(stderr, "]\n");
-#endif
 }
 
-static void Layer_feedBack_conv(Layer* self)
+/* Layer_im2col(self, src, cols)
+   Lowers the input of one sample into the column buffer.
+   cols is a (lprev->depth*kernsize*kernsize) x (width*height) matrix
+   whose row order matches the kernel weights.
+*/
+static void Layer_im2col(const Layer* self, const nn_real* src, nn_real* cols)
 {
-    assert (self->ltype == LAYER_CONV);
-    assert (self->lprev != NULL);
     Layer* lprev = self->lprev;
 
-    /* Clear errors. */
-    for (int j = 0; j < lprev->nnodes; j++) {
-        lprev->errors[j] = 0;
-    }
-
     int kernsize = self->conv.kernsize;
-    int i = 0;
-    for (int z1 = 0; z1 < self->depth; z1++) {
-        /* z1: dst matrix */
-        /* qbase: kernel matrix base index */
-        int qbase = z1 * lprev->depth * kernsize * kernsize;
-        for (int y1 = 0; y1 < self->height; y1++) {
-            int y0 = self->conv.stride * y1 - self->conv.padding;
-            for (int x1 = 0; x1 < self->width; x1++) {
-                int x0 = self->conv.stride * x1 - self->conv.padding;
-                /* Compute the kernel at (x1,y1) */
-                /* (x0,y0): src pixel */
-                double dnet = self->errors[i] * self->gradients[i];
-                for (int z0 = 0; z0 < lprev->depth; z0++) {
-                    /* z0: src matrix */
-                    /* pbase: src matrix base index */
-                    int pbase = z0 * lprev->width * lprev->height;
-                    for (int dy = 0; dy < kernsize; dy++) {
-                        int y = y0+dy;
-                        if (0 <= y && y < lprev->height) {
-                            int p = pbase + y*lprev->width;
-                            int q = qbase + dy*kernsize;
-                            for (int dx = 0; dx < kernsize; dx++) {
-                                int x = x0+dx;
-                                if (0 <= x && x < lprev->width) {
-                                    lprev->errors[p+x] += self->weights[q+dx] * dnet;
-                                    self->u_weights[q+dx] += dnet * lprev->outputs[p+x];
-                                }
-                            }
+    int stride = self->conv.stride;
+    int padding = self->conv.padding;
+    for (int z0 = 0; z0 < lprev->depth; z0++) {
+        for (int dy = 0; dy < kernsize; dy++) {
+            for (int dx = 0; dx < kernsize; dx++) {
+                for (int y1 = 0; y1 < self->height; y1++) {
+                    int y = stride * y1 - padding + dy;
+                    if (y < 0 || lprev->height <= y) {
+                        for (int x1 = 0; x1 < self->width; x1++) {
+                            *cols++ = 0;
                         }
+                        continue;
+                    }
+                    const nn_real* row = &src[y * lprev->width];
+                    for (int x1 = 0; x1 < self->width; x1++) {
+                        int x = stride * x1 - padding + dx;
+                        *cols++ = (0 <= x && x < lprev->width)? row[x] : 0;
                     }
                 }
-                self->u_biases[z1] += dnet;
-                i++;
             }
         }
+        src += lprev->width * lprev->height;
     }
-    assert (i == self->nnodes);
-
-#if DEBUG_LAYER
-    fprintf(stderr, "Layer_feedBack_conv(Layer%d):\n", self->lid);
-    for (int i = 0; i < self->nnodes; i++) {
-        double dnet = self->errors[i] * self->gradients[i];
-        fprintf(stderr, "  dnet=%.4f, dw=[", dnet);
-        for (int j = 0; j < lprev->nnodes; j++) {
-            double dw = dnet * lprev->outputs[j];
-            fprintf(stderr, " %.4f", dw);
-        }
-        fprintf(stderr, "]\n");
-    }
-#endif
 }
 
-/* Layer_setInputs(self, values)
-   Sets the input values.
+/* Layer_feedForw_conv_gemm(self)
+   Computes the convolution as a matrix product for each sample:
+   outputs (depth x width*height) = weights (depth x K) * cols (K x width*height).
+   For 1x1 kernels (ncols == 0) the inputs are the columns.
+*/
+static void Layer_feedForw_conv_gemm(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int nk = lprev->depth * kernsize * kernsize;
+    int npixels = self->width * self->height;
+
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* cols = &lprev->outputs[s * lprev->nnodes];
+        nn_real* outputs = &self->outputs[s * self->nnodes];
+        if (self->conv.ncols != 0) {
+            nn_real* c = &self->conv.cols[s * self->conv.ncols];
+            self->conv.spec->im2col(self, cols, c);
+            cols = c;
+        }
+        int i = 0;
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            for (int j = 0; j < npixels; j++) {
+                outputs[i++] = self->biases[z1];
+            }
+        }
+        gemm(self->depth, npixels, nk,
+             self->weights, nk, 1,
+             cols, npixels, 1,
+             outputs, npixels, 1);
+    }
+}
+
+/* Layer_nhwc_inputs(self, s)
+   Returns the inputs of sample s in (y, x, depth) order,
+   converted into the scratch if needed.
+*/
+static const nn_real* Layer_nhwc_inputs(Layer* self, int s)
+{
+    Layer* lprev = self->lprev;
+    const nn_real* src = &lprev->outputs[s * lprev->nnodes];
+    /* Both orders are the same for a single channel. */
+    if (Layer_isNHWC(lprev) || lprev->depth == 1) return src;
+    nn_real* x = &self->conv.nhwc[2 * self->nweights];
+    nhwc_to(lprev->depth, lprev->width * lprev->height, src, x);
+    return x;
+}
+
+/* Layer_nhwc_im2col(self, src, cols)
+   Lowers the (y, x, depth) input of one sample.
+*/
+static void Layer_nhwc_im2col(const Layer* self, const nn_real* src, nn_real* cols)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int depth = lprev->depth;
+    int n = kernsize * depth;
+    for (int y1 = 0; y1 < self->height; y1++) {
+        int y0 = self->conv.stride * y1 - self->conv.padding;
+        for (int x1 = 0; x1 < self->width; x1++) {
+            int x0 = self->conv.stride * x1 - self->conv.padding;
+            for (int dy = 0; dy < kernsize; dy++) {
+                int y = y0 + dy;
+                if (y < 0 || lprev->height <= y) {
+                    memset(cols, 0, n * sizeof(nn_real));
+                } else if (0 <= x0 && x0 + kernsize <= lprev->width) {
+                    /* The kernel row is contiguous. */
+                    memcpy(cols, &src[(y * lprev->width + x0) * depth],
+                           n * sizeof(nn_real));
+                } else {
+                    for (int dx = 0; dx < kernsize; dx++) {
+                        int x = x0 + dx;
+                        nn_real* c = &cols[dx * depth];
+                        if (0 <= x && x < lprev->width) {
+                            memcpy(c, &src[(y * lprev->width + x) * depth],
+                                   depth * sizeof(nn_real));
+                        } else {
+                            memset(c, 0, depth * sizeof(nn_real));
+                        }
+                    }
+                }
+                cols += n;
+            }
+        }
+    }
+}
+
+/* Layer_nhwc_col2im(self, dcols, dst)
+   The adjoint of Layer_nhwc_im2col().
+*/
+static void Layer_nhwc_col2im(const Layer* self, const nn_real* dcols, nn_real* dst)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int depth = lprev->depth;
+    int n = kernsize * depth;
+    for (int y1 = 0; y1 < self->height; y1++) {
+        int y0 = self->conv.stride * y1 - self->conv.padding;
+        for (int x1 = 0; x1 < self->width; x1++) {
+            int x0 = self->conv.stride * x1 - self->conv.padding;
+            for (int dy = 0; dy < kernsize; dy++) {
+                int y = y0 + dy;
+                if (y < 0 || lprev->height <= y) {
+                    /* Padding. */
+                } else if (0 <= x0 && x0 + kernsize <= lprev->width) {
+                    simd_axpy(n, 1, dcols, &dst[(y * lprev->width + x0) * depth]);
+                } else {
+                    for (int dx = 0; dx < kernsize; dx++) {
+                        int x = x0 + dx;
+                        if (0 <= x && x < lprev->width) {
+                            simd_axpy(depth, 1, &dcols[dx * depth],
+                                      &dst[(y * lprev->width + x) * depth]);
+                        }
+                    }
+                }
+                dcols += n;
+            }
+        }
+    }
+}
+
+/* Layer_nhwc_weights(self)
+   Permutes the weights into (depth, dy, dx, lprev depth) order.
+   The copy is kept until the next backward pass, after which
+   the weights get updated (once for all in inference mode).
+*/
+static void Layer_nhwc_weights(Layer* self)
+{
+    if (self->conv.nhwcw) return;
+
+    int ksize = self->conv.kernsize * self->conv.kernsize;
+    int ldepth = self->lprev->depth;
+    int nk = ldepth * ksize;
+    nn_real* wp = self->conv.nhwc;
+    for (int z1 = 0; z1 < self->depth; z1++) {
+        const nn_real* w = &self->weights[z1 * nk];
+        for (int z0 = 0; z0 < ldepth; z0++) {
+            for (int k = 0; k < ksize; k++) {
+                wp[z1 * nk + k * ldepth + z0] = w[z0 * ksize + k];
+            }
+        }
+    }
+    self->conv.nhwcw = 1;
+}
+
+/* Layer_feedForw_conv_nhwc(self)
+   Computes the convolution as a matrix product for each sample:
+   outputs (width*height x depth) = cols (width*height x K) * weights^T,
+   stored in (depth, y, x) order unless the next Layer is NHWC.
+*/
+static void Layer_feedForw_conv_nhwc(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int ksize = self->conv.kernsize * self->conv.kernsize;
+    int ldepth = lprev->depth;
+    int nk = ldepth * ksize;
+    int npixels = self->width * self->height;
+    /* Output (pixel j, channel z1) at j*rj + z1*rz. */
+    int nhwc = Layer_isNHWC(self);
+    int rj = nhwc? self->depth : 1;
+    int rz = nhwc? 1 : npixels;
+
+    Layer_nhwc_weights(self);
+    const nn_real* wp = self->conv.nhwc;
+
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* cols = Layer_nhwc_inputs(self, s);
+        nn_real* outputs = &self->outputs[s * self->nnodes];
+        if (self->conv.ncols != 0) {
+            nn_real* c = &self->conv.cols[s * self->conv.ncols];
+            Layer_nhwc_im2col(self, cols, c);
+            cols = c;
+        }
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            for (int j = 0; j < npixels; j++) {
+                outputs[j * rj + z1 * rz] = self->biases[z1];
+            }
+        }
+        gemm(npixels, self->depth, nk,
+             cols, nk, 1,
+             wp, 1, nk,
+             outputs, rj, rz);
+    }
+}
+
+/*  Winograd F(2x2,3x3)
+    Each 2x2 output tile is computed from a 4x4 input tile d as
+      Y = A^T [(G g G^T) .* (B^T d B)] A
+    which takes 16 multiplies instead of 36. Summed over the input
+    channels, the elementwise product becomes 16 matrix products
+    over a chunk of n tiles (taken from all the samples):
+      M[e] (depth x n) = U[e] (depth x lprev->depth) * V[e] (lprev->depth x n)
+    The chunks are small enough to keep V and M in the cache. The 16
+    values of a tile are contiguous in V and M (the matrices are
+    strided), which avoids scattering them over 16 distant rows.
+    The backward pass runs the adjoint of every step, transforming
+    the inputs again instead of keeping V.
+
+    wino holds U, its gradient dU, and V and M of one chunk.
+ */
+
+#define WINO_NC 64
+/* Below this input depth the transforms cost more than they save. */
+#define WINO_MINDEPTH 32
+
+/* wino_b(x, sx, y, sy): y = B^T x (4 -> 4) */
+static inline void wino_b(const nn_real* x, int sx, nn_real* y, int sy)
+{
+    nn_real x0 = x[0], x1 = x[sx], x2 = x[2*sx], x3 = x[3*sx];
+    y[0] = x0 - x2;
+    y[sy] = x1 + x2;
+    y[2*sy] = x2 - x1;
+    y[3*sy] = x1 - x3;
+}
+/* wino_bt(x, sx, y, sy): y = B x (4 -> 4), the adjoint of wino_b */
+static inline void wino_bt(const nn_real* x, int sx, nn_real* y, int sy)
+{
+    nn_real x0 = x[0], x1 = x[sx], x2 = x[2*sx], x3 = x[3*sx];
+    y[0] = x0;
+    y[sy] = x1 - x2 + x3;
+    y[2*sy] = x1 + x2 - x0;
+    y[3*sy] = -x3;
+}
+/* wino_g(x, sx, y, sy): y = G x (3 -> 4) */
+static inline void wino_g(const nn_real* x, int sx, nn_real* y, int sy)
+{
+    nn_real x0 = x[0], x1 = x[sx], x2 = x[2*sx];
+    y[0] = x0;
+    y[sy] = (x0 + x1 + x2) * 0.5;
+    y[2*sy] = (x0 - x1 + x2) * 0.5;
+    y[3*sy] = x2;
+}
+/* wino_gt(x, sx, y, sy): y = G^T x (4 -> 3), the adjoint of wino_g */
+static inline void wino_gt(const nn_real* x, int sx, nn_real* y, int sy)
+{
+    nn_real x0 = x[0], x1 = x[sx], x2 = x[2*sx], x3 = x[3*sx];
+    y[0] = x0 + (x1 + x2) * 0.5;
+    y[sy] = (x1 - x2) * 0.5;
+    y[2*sy] = x3 + (x1 + x2) * 0.5;
+}
+/* wino_a(x, sx, y, sy): y = A^T x (4 -> 2) */
+static inline void wino_a(const nn_real* x, int sx, nn_real* y, int sy)
+{
+    nn_real x0 = x[0], x1 = x[sx], x2 = x[2*sx], x3 = x[3*sx];
+    y[0] = x0 + x1 + x2;
+    y[sy] = x1 - x2 - x3;
+}
+/* wino_at(x, sx, y, sy): y = A x (2 -> 4), the adjoint of wino_a */
+static inline void wino_at(const nn_real* x, int sx, nn_real* y, int sy)
+{
+    nn_real x0 = x[0], x1 = x[sx];
+    y[0] = x0;
+    y[sy] = x0 + x1;
+    y[2*sy] = x0 - x1;
+    y[3*sy] = -x1;
+}
+
+/* Layer_wino_size(lprev, depth, kernsize, stride)
+   Returns the size of the Winograd scratch (0 if not applicable).
+*/
+static int Layer_wino_size(
+    const Layer* lprev, int depth, int kernsize, int stride)
+{
+    if (kernsize != 3 || stride != 1) return 0;
+    return 16 * (2 * depth * lprev->depth + (lprev->depth + depth) * WINO_NC);
+}
+
+/* Layer_wino_weights(self)
+   Transforms the weights: U = G g G^T, at the start of wino.
+   U is kept until the next backward pass, after which the
+   weights get updated (once for all in inference mode).
+*/
+static void Layer_wino_weights(Layer* self)
+{
+    if (self->conv.winow) return;
+
+    nn_real* U = self->conv.wino;
+    int ldepth = self->lprev->depth;
+    for (int z1 = 0; z1 < self->depth; z1++) {
+        for (int z0 = 0; z0 < ldepth; z0++) {
+            const nn_real* g = &self->weights[(z1 * ldepth + z0) * 9];
+            nn_real t[12], u[16];
+            for (int c = 0; c < 3; c++) {
+                wino_g(&g[c], 3, &t[c], 3);
+            }
+            for (int r = 0; r < 4; r++) {
+                wino_g(&t[r*3], 1, &u[r*4], 1);
+            }
+            for (int e = 0; e < 16; e++) {
+                U[(e * self->depth + z1) * ldepth + z0] = u[e];
+            }
+        }
+    }
+    self->conv.winow = 1;
+}
+
+/* Layer_wino_inputs(self, j0, n, V)
+   Transforms the input tiles j0...j0+n-1: V = B^T d B.
+   Tile j is the tile (j % ntiles) of the sample (j / ntiles).
+*/
+static void Layer_wino_inputs(const Layer* self, int j0, int n, nn_real* V)
+{
+    const Layer* lprev = self->lprev;
+    int lwidth = lprev->width;
+    int lheight = lprev->height;
+    int tw = (self->width+1)/2;
+    int ntiles = tw * ((self->height+1)/2);
+    int padding = self->conv.padding;
+
+    for (int j = 0; j < n; j++) {
+        int s = (j0+j) / ntiles;
+        int t = (j0+j) % ntiles;
+        int y0 = (t / tw) * 2 - padding;
+        int x0 = (t % tw) * 2 - padding;
+        int inside = (0 <= y0 && y0+4 <= lheight && 0 <= x0 && x0+4 <= lwidth);
+        const nn_real* src = &lprev->outputs[s * lprev->nnodes];
+        for (int z0 = 0; z0 < lprev->depth; z0++) {
+            nn_real d[16], b[16], v[16];
+            if (inside) {
+                /* Transform the columns in place. */
+                const nn_real* p = &src[y0 * lwidth + x0];
+                for (int c = 0; c < 4; c++) {
+                    wino_b(&p[c], lwidth, &b[c], 4);
+                }
+            } else {
+                for (int dy = 0; dy < 4; dy++) {
+                    int y = y0+dy;
+                    for (int dx = 0; dx < 4; dx++) {
+                        int x = x0+dx;
+                        d[dy*4+dx] = (0 <= y && y < lheight &&
+                                      0 <= x && x < lwidth)?
+                            src[y * lwidth + x] : 0;
+                    }
+                }
+                for (int c = 0; c < 4; c++) {
+                    wino_b(&d[c], 4, &b[c], 4);
+                }
+            }
+            for (int r = 0; r < 4; r++) {
+                wino_b(&b[r*4], 1, &v[r*4], 1);
+            }
+            for (int e = 0; e < 16; e++) {
+                V[(z0 * n + j) * 16 + e] = v[e];
+            }
+            src += lwidth * lheight;
+        }
+    }
+}
+
+/* Layer_feedForw_conv_winograd(self)
+   Computes the convolution with Winograd F(2x2,3x3).
+*/
+static void Layer_feedForw_conv_winograd(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int ldepth = lprev->depth;
+    int tw = (self->width+1)/2;
+    int ntiles = tw * ((self->height+1)/2);
+    int npixels = self->width * self->height;
+    nn_real* U = self->conv.wino;
+    nn_real* V = &U[2 * 16 * self->depth * ldepth];
+    nn_real* M = &V[16 * ldepth * WINO_NC];
+
+    Layer_wino_weights(self);
+
+    for (int j0 = 0; j0 < self->nbatch * ntiles; j0 += WINO_NC) {
+        int n = self->nbatch * ntiles - j0;
+        if (WINO_NC < n) { n = WINO_NC; }
+        Layer_wino_inputs(self, j0, n, V);
+
+        /* M[e] = U[e] * V[e] */
+        for (int i = 0; i < 16 * self->depth * n; i++) {
+            M[i] = 0;
+        }
+        for (int e = 0; e < 16; e++) {
+            gemm(self->depth, n, ldepth,
+                 &U[e * self->depth * ldepth], ldepth, 1,
+                 &V[e], 16 * n, 16,
+                 &M[e], 16 * n, 16);
+        }
+
+        /* Y = A^T M A */
+        for (int j = 0; j < n; j++) {
+            int s = (j0+j) / ntiles;
+            int t = (j0+j) % ntiles;
+            int y1 = (t / tw) * 2;
+            int x1 = (t % tw) * 2;
+            nn_real* dst = &self->outputs[s * self->nnodes + y1 * self->width + x1];
+            for (int z1 = 0; z1 < self->depth; z1++) {
+                nn_real m[16], a[8], y[4];
+                for (int e = 0; e < 16; e++) {
+                    m[e] = M[(z1 * n + j) * 16 + e];
+                }
+                for (int c = 0; c < 4; c++) {
+                    wino_a(&m[c], 4, &a[c], 4);
+                }
+                for (int r = 0; r < 2; r++) {
+                    wino_a(&a[r*4], 1, &y[r*2], 1);
+                }
+                for (int dy = 0; dy < 2 && y1+dy < self->height; dy++) {
+                    for (int dx = 0; dx < 2 && x1+dx < self->width; dx++) {
+                        dst[dy * self->width + dx] = self->biases[z1] + y[dy*2+dx];
+                    }
+                }
+                dst += npixels;
+            }
+        }
+    }
+}
+
+/* Layer_feedForw_conv_sparse(self)
+   Computes the convolution by scattering the nonzero input pixels
+   of each sample into the outputs. For each sample, the (output,
+   weight, input) triples of every nonzero input and kernel tap
+   are listed once and replayed for every output channel.
+   The GEMM and Winograd backward passes still get the buffers
+   they expect from the forward pass.
+*/
+static void Layer_feedForw_conv_sparse(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int stride = self->conv.stride;
+    int padding = self->conv.padding;
+    int npixels = self->width * self->height;
+    int lsize = lprev->width * lprev->height;
+    int nk = lprev->depth * kernsize * kernsize;
+    int* triples = self->active;
+
+    if (self->conv.algo == CONV_WINOGRAD && !self->inference) {
+        Layer_wino_weights(self);
+    }
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lprev->nnodes];
+        nn_real* outputs = &self->outputs[s * self->nnodes];
+        if (self->conv.algo == CONV_GEMM && !self->inference &&
+            self->conv.ncols != 0) {
+            self->conv.spec->im2col(
+                self, inputs, &self->conv.cols[s * self->conv.ncols]);
+        }
+        int m = 0;
+        for (int p = 0; p < lprev->nnodes; p++) {
+            if (inputs[p] == 0) continue;
+            /* (x,y): src pixel */
+            int z0 = p / lsize;
+            int y = (p % lsize) / lprev->width + padding;
+            int x = (p % lsize) % lprev->width + padding;
+            for (int dy = 0; dy < kernsize; dy++) {
+                int y1 = (y - dy) / stride;
+                if (y < dy || y1 * stride != y - dy || self->height <= y1) continue;
+                for (int dx = 0; dx < kernsize; dx++) {
+                    int x1 = (x - dx) / stride;
+                    if (x < dx || x1 * stride != x - dx || self->width <= x1) continue;
+                    triples[m++] = y1 * self->width + x1;
+                    triples[m++] = (z0 * kernsize + dy) * kernsize + dx;
+                    triples[m++] = p;
+                }
+            }
+        }
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            const nn_real* w = &self->weights[z1 * nk];
+            nn_real* out = &outputs[z1 * npixels];
+            for (int j = 0; j < npixels; j++) {
+                out[j] = self->biases[z1];
+            }
+            for (int k = 0; k < m; k += 3) {
+                out[triples[k]] += w[triples[k+1]] * inputs[triples[k+2]];
+            }
+        }
+    }
+}
+
+/* Layer_feedForw_conv(self)
+   Performs feed forward updates.
+*/
+static void Layer_feedForw_conv(Layer* self)
+{
+    assert (self->ltype == LAYER_CONV);
+    assert (self->lprev != NULL);
+
+    if (self->conv.layout == CONV_NHWC) {
+        Layer_feedForw_conv_nhwc(self);
+    } else if (Layer_sparseInputs(self, CONV_SPARSE_INPUT_DENSITY, 0)) {
+        Layer_feedForw_conv_sparse(self);
+    } else {
+        switch (self->conv.algo) {
+        case CONV_GEMM:
+            Layer_feedForw_conv_gemm(self);
+            break;
+        case CONV_WINOGRAD:
+            Layer_feedForw_conv_winograd(self);
+            break;
+        default:
+            self->conv.spec->feedForw(self);
+            break;
+        }
+    }
+
+    /* Apply the activation function. */
+    if (self->inference) {
+        for (int i = 0; i < self->nbatch * self->nnodes; i++) {
+            self->outputs[i] = relu(self->outputs[i]);
+        }
+    } else {
+        for (int i = 0; i < self->nbatch * self->nnodes; i++) {
+            nn_real v = relu(self->outputs[i]);
+            self->outputs[i] = v;
+            self->gradients[i] = relu_g(v);
+        }
+    }
+
+#if DEBUG_LAYER
+    fprintf(stderr, "Layer_feedForw_conv(Layer%d):\n", self->lid);
+    fprintf(stderr, "  outputs = [");
+    for (int i = 0; i < self->nnodes; i++) {
+        fprintf(stderr, " %.4f", self->outputs[i]);
+    }
+    fprintf(stderr, "]\n  gradients = [");
+    for (int i = 0; i < self->nnodes; i++) {
+        fprintf(stderr, " %.4f", self->gradients[i]);
+    }
+    fprintf(stderr, "]\n");
+#endif
+}
+
+/* Layer_feedBack_conv_direct(self)
+   Computes the conv gradients with the reference loop.
+*/
+static void Layer_feedBack_conv_direct(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lprev->nnodes];
+        nn_real* errors = &lprev->errors[s * lprev->nnodes];
+        int i = s * self->nnodes;
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            /* z1: dst matrix */
+            /* qbase: kernel matrix base index */
+            int qbase = z1 * lprev->depth * kernsize * kernsize;
+            for (int y1 = 0; y1 < self->height; y1++) {
+                int y0 = self->conv.stride * y1 - self->conv.padding;
+                for (int x1 = 0; x1 < self->width; x1++) {
+                    int x0 = self->conv.stride * x1 - self->conv.padding;
+                    /* Compute the kernel at (x1,y1) */
+                    /* (x0,y0): src pixel */
+                    nn_real dnet = self->errors[i] * self->gradients[i];
+                    for (int z0 = 0; z0 < lprev->depth; z0++) {
+                        /* z0: src matrix */
+                        /* pbase: src matrix base index */
+                        int pbase = z0 * lprev->width * lprev->height;
+                        for (int dy = 0; dy < kernsize; dy++) {
+                            int y = y0+dy;
+                            if (0 <= y && y < lprev->height) {
+                                int p = pbase + y*lprev->width;
+                                int q = qbase + (z0*kernsize + dy)*kernsize;
+                                for (int dx = 0; dx < kernsize; dx++) {
+                                    int x = x0+dx;
+                                    if (0 <= x && x < lprev->width) {
+                                        errors[p+x] += self->weights[q+dx] * dnet;
+                                        self->u_weights[q+dx] += dnet * inputs[p+x];
+                                    }
+                                }
+                            }
+                        }
+                    }
+                    self->u_biases[z1] += dnet;
+                    i++;
+                }
+            }
+        }
+        assert (i == (s+1) * self->nnodes);
+    }
+}
+
+/* Layer_col2im(self, dcols, dst)
+   Folds the column gradients of one sample back into dst.
+   This is the adjoint of Layer_im2col().
+*/
+static void Layer_col2im(const Layer* self, const nn_real* dcols, nn_real* dst)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int stride = self->conv.stride;
+    int padding = self->conv.padding;
+    for (int z0 = 0; z0 < lprev->depth; z0++) {
+        for (int dy = 0; dy < kernsize; dy++) {
+            for (int dx = 0; dx < kernsize; dx++) {
+                for (int y1 = 0; y1 < self->height; y1++) {
+                    int y = stride * y1 - padding + dy;
+                    if (y < 0 || lprev->height <= y) {
+                        dcols += self->width;
+                        continue;
+                    }
+                    nn_real* row = &dst[y * lprev->width];
+                    for (int x1 = 0; x1 < self->width; x1++) {
+                        int x = stride * x1 - padding + dx;
+                        if (0 <= x && x < lprev->width) {
+                            row[x] += *dcols;
+                        }
+                        dcols++;
+                    }
+                }
+            }
+        }
+        dst += lprev->width * lprev->height;
+    }
+}
+
+/*  Specialized kernels
+    The functions below are templates: they are always inlined into
+    the CONV_SPEC() instances with constant (K, S, P), so that the
+    kernel loops can be unrolled. The border checks are hoisted out
+    of the loops by computing the interior ranges first.
+ */
+#define CONV_TEMPLATE static inline __attribute__((always_inline))
+
+/* conv_range(n0, n1, s, off, a, b)
+   Finds the range [a, b) of i in [0, n1) such that
+   0 <= s*i + off < n0.
+*/
+CONV_TEMPLATE void conv_range(int n0, int n1, int s, int off, int* a, int* b)
+{
+    int lo = (off < 0)? (-off + s-1) / s : 0;
+    int hi = (n0 - off + s-1) / s;
+    if (n1 < lo) { lo = n1; }
+    if (n1 < hi) { hi = n1; }
+    if (hi < lo) { hi = lo; }
+    *a = lo;
+    *b = hi;
+}
+
+/* conv_im2col(self, src, cols, K, S, P)
+   Layer_im2col() with the interior rows and columns copied
+   without checks.
+*/
+CONV_TEMPLATE void conv_im2col(
+    const Layer* self, const nn_real* src, nn_real* cols,
+    const int K, const int S, const int P)
+{
+    const Layer* lprev = self->lprev;
+    int width = self->width;
+    int height = self->height;
+    int lwidth = lprev->width;
+    for (int z0 = 0; z0 < lprev->depth; z0++) {
+        for (int dy = 0; dy < K; dy++) {
+            int ya, yb;
+            conv_range(lprev->height, height, S, dy-P, &ya, &yb);
+            for (int dx = 0; dx < K; dx++) {
+                int xa, xb;
+                conv_range(lwidth, width, S, dx-P, &xa, &xb);
+                for (int i = 0; i < ya * width; i++) {
+                    *cols++ = 0;
+                }
+                for (int y1 = ya; y1 < yb; y1++) {
+                    const nn_real* row = &src[(S*y1 - P + dy) * lwidth];
+                    for (int x1 = 0; x1 < xa; x1++) {
+                        cols[x1] = 0;
+                    }
+                    for (int x1 = xa; x1 < xb; x1++) {
+                        cols[x1] = row[S*x1 - P + dx];
+                    }
+                    for (int x1 = xb; x1 < width; x1++) {
+                        cols[x1] = 0;
+                    }
+                    cols += width;
+                }
+                for (int i = yb * width; i < height * width; i++) {
+                    *cols++ = 0;
+                }
+            }
+        }
+        src += lwidth * lprev->height;
+    }
+}
+
+/* conv_col2im(self, dcols, dst, K, S, P)
+   The adjoint of conv_im2col().
+*/
+CONV_TEMPLATE void conv_col2im(
+    const Layer* self, const nn_real* dcols, nn_real* dst,
+    const int K, const int S, const int P)
+{
+    const Layer* lprev = self->lprev;
+    int width = self->width;
+    int height = self->height;
+    int lwidth = lprev->width;
+    for (int z0 = 0; z0 < lprev->depth; z0++) {
+        for (int dy = 0; dy < K; dy++) {
+            int ya, yb;
+            conv_range(lprev->height, height, S, dy-P, &ya, &yb);
+            for (int dx = 0; dx < K; dx++) {
+                int xa, xb;
+                conv_range(lwidth, width, S, dx-P, &xa, &xb);
+                const nn_real* cols = &dcols[((z0*K + dy)*K + dx) * height * width];
+                for (int y1 = ya; y1 < yb; y1++) {
+                    nn_real* row = &dst[(S*y1 - P + dy) * lwidth];
+                    for (int x1 = xa; x1 < xb; x1++) {
+                        row[S*x1 - P + dx] += cols[y1 * width + x1];
+                    }
+                }
+            }
+        }
+        dst += lwidth * lprev->height;
+    }
+}
+
+/* conv_pixel(self, inputs, z1, x0, y0, K)
+   Computes the net input of one border pixel with checks.
+*/
+CONV_TEMPLATE nn_real conv_pixel(
+    const Layer* self, const nn_real* inputs, int z1, int x0, int y0,
+    const int K)
+{
+    const Layer* lprev = self->lprev;
+    const nn_real* w = &self->weights[z1 * lprev->depth * K*K];
+    nn_real v = self->biases[z1];
+    for (int z0 = 0; z0 < lprev->depth; z0++) {
+        for (int dy = 0; dy < K; dy++) {
+            int y = y0+dy;
+            if (y < 0 || lprev->height <= y) continue;
+            for (int dx = 0; dx < K; dx++) {
+                int x = x0+dx;
+                if (0 <= x && x < lprev->width) {
+                    v += inputs[y * lprev->width + x] * w[dy*K + dx];
+                }
+            }
+        }
+        inputs += lprev->width * lprev->height;
+        w += K*K;
+    }
+    return v;
+}
+
+/* conv_feedForw(self, K, S, P)
+   Layer_feedForw_conv_direct() with the interior pixels
+   computed without checks.
+*/
+CONV_TEMPLATE void conv_feedForw(Layer* self, const int K, const int S, const int P)
+{
+    const Layer* lprev = self->lprev;
+    int lwidth = lprev->width;
+    int lsize = lwidth * lprev->height;
+    /* Pixels whose window is inside the input. */
+    int ya, yb, xa, xb;
+    conv_range(lprev->height - K+1, self->height, S, -P, &ya, &yb);
+    conv_range(lwidth - K+1, self->width, S, -P, &xa, &xb);
+
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lprev->nnodes];
+        nn_real* outputs = &self->outputs[s * self->nnodes];
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            const nn_real* w = &self->weights[z1 * lprev->depth * K*K];
+            for (int y1 = 0; y1 < self->height; y1++) {
+                int y0 = S*y1 - P;
+                int inside = (ya <= y1 && y1 < yb);
+                for (int x1 = 0; x1 < self->width; x1++) {
+                    int x0 = S*x1 - P;
+                    if (!inside || x1 < xa || xb <= x1) {
+                        *outputs++ = conv_pixel(self, inputs, z1, x0, y0, K);
+                        continue;
+                    }
+                    const nn_real* p = &inputs[y0 * lwidth + x0];
+                    const nn_real* q = w;
+                    nn_real v = self->biases[z1];
+                    for (int z0 = 0; z0 < lprev->depth; z0++) {
+                        for (int dy = 0; dy < K; dy++) {
+                            for (int dx = 0; dx < K; dx++) {
+                                v += p[dy * lwidth + dx] * q[dy*K + dx];
+                            }
+                        }
+                        p += lsize;
+                        q += K*K;
+                    }
+                    *outputs++ = v;
+                }
+            }
+        }
+    }
+}
+
+/* CONV_SPEC(K, S, P)
+   Defines the kernels of one specialization.
+*/
+#define CONV_SPEC(K, S, P)                                              \
+    static void Layer_feedForw_conv_##K##S##P(Layer* self)              \
+    { conv_feedForw(self, K, S, P); }                                   \
+    static void Layer_im2col_##K##S##P(                                 \
+        const Layer* self, const nn_real* src, nn_real* cols)           \
+    { conv_im2col(self, src, cols, K, S, P); }                          \
+    static void Layer_col2im_##K##S##P(                                 \
+        const Layer* self, const nn_real* dcols, nn_real* dst)          \
+    { conv_col2im(self, dcols, dst, K, S, P); }
+#define CONV_SPEC_ENTRY(K, S, P)                                        \
+    { K, S, P, Layer_feedForw_conv_##K##S##P,                           \
+      Layer_im2col_##K##S##P, Layer_col2im_##K##S##P }
+
+CONV_SPEC(3, 1, 1)
+CONV_SPEC(3, 2, 1)
+CONV_SPEC(5, 1, 2)
+CONV_SPEC(1, 1, 0)
+
+static const ConvSpec conv_specs[] = {
+    CONV_SPEC_ENTRY(3, 1, 1),
+    CONV_SPEC_ENTRY(3, 2, 1),
+    CONV_SPEC_ENTRY(5, 1, 2),
+    CONV_SPEC_ENTRY(1, 1, 0),
+    /* Any other shape: the reference loops. */
+    { 0, 0, 0, Layer_feedForw_conv_direct, Layer_im2col, Layer_col2im },
+};
+
+/* conv_findSpec(kernsize, stride, padding)
+   Returns the kernels for the shape.
+*/
+static const ConvSpec* conv_findSpec(int kernsize, int stride, int padding)
+{
+    const ConvSpec* spec = conv_specs;
+    while (spec->kernsize != 0 &&
+           (spec->kernsize != kernsize ||
+            spec->stride != stride ||
+            spec->padding != padding)) {
+        spec++;
+    }
+    return spec;
+}
+
+/* Layer_feedBack_conv_gemm(self)
+   Computes the conv gradients as two matrix products for each sample:
+   u_weights += dnet * cols^T, and dcols = weights^T * dnet
+   followed by col2im. cols must be filled by the forward pass,
+   and dnets by Layer_feedBack_conv().
+*/
+static void Layer_feedBack_conv_gemm(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int nk = lprev->depth * kernsize * kernsize;
+    int npixels = self->width * self->height;
+
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* dnets = &self->dnets[s * self->nnodes];
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            nn_real t = 0;
+            for (int j = 0; j < npixels; j++) {
+                t += dnets[z1 * npixels + j];
+            }
+            self->u_biases[z1] += t;
+        }
+
+        /* dW = dnet (depth x npixels) * cols^T (npixels x nk) */
+        const nn_real* cols = (self->conv.ncols == 0)?
+            &lprev->outputs[s * lprev->nnodes] :
+            &self->conv.cols[s * self->conv.ncols];
+        gemm(self->depth, nk, npixels,
+             dnets, npixels, 1,
+             cols, 1, npixels,
+             self->u_weights, nk, 1);
+
+        /* The input layer has no use for its errors. */
+        if (lprev->ltype == LAYER_INPUT) continue;
+
+        if (self->conv.ncols == 0) {
+            /* 1x1: dX += W^T * dnet without col2im. */
+            gemm(nk, npixels, self->depth,
+                 self->weights, 1, nk,
+                 dnets, npixels, 1,
+                 &lprev->errors[s * lprev->nnodes], npixels, 1);
+            continue;
+        }
+
+        /* dX = W^T (nk x depth) * dnet (depth x npixels) */
+        for (int j = 0; j < nk * npixels; j++) {
+            self->conv.dcols[j] = 0;
+        }
+        gemm(nk, npixels, self->depth,
+             self->weights, 1, nk,
+             dnets, npixels, 1,
+             self->conv.dcols, npixels, 1);
+        self->conv.spec->col2im(
+            self, self->conv.dcols, &lprev->errors[s * lprev->nnodes]);
+    }
+}
+
+/* Layer_feedBack_conv_nhwc(self)
+   Computes the conv gradients of an NHWC Layer for each sample:
+   u_weights += dnet * cols, and dcols = dnet^T * weights
+   followed by col2im. The weights must be permuted and cols
+   filled by the forward pass, and dnets by Layer_feedBack_conv().
+*/
+static void Layer_feedBack_conv_nhwc(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int ksize = self->conv.kernsize * self->conv.kernsize;
+    int ldepth = lprev->depth;
+    int nk = ldepth * ksize;
+    int npixels = self->width * self->height;
+    int lnhwc = (Layer_isNHWC(lprev) || ldepth == 1);
+    int nhwc = Layer_isNHWC(self);
+    int rj = nhwc? self->depth : 1;
+    int rz = nhwc? 1 : npixels;
+    const nn_real* wp = self->conv.nhwc;
+    nn_real* dwp = &self->conv.nhwc[self->nweights];
+    nn_real* e = &self->conv.nhwc[2 * self->nweights + lprev->nnodes];
+
+    for (int i = 0; i < self->nweights; i++) {
+        dwp[i] = 0;
+    }
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* dnets = &self->dnets[s * self->nnodes];
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            nn_real t = 0;
+            for (int j = 0; j < npixels; j++) {
+                t += dnets[j * rj + z1 * rz];
+            }
+            self->u_biases[z1] += t;
+        }
+
+        /* dW = dnet (depth x npixels) * cols (npixels x nk) */
+        const nn_real* cols = (self->conv.ncols == 0)?
+            Layer_nhwc_inputs(self, s) :
+            &self->conv.cols[s * self->conv.ncols];
+        gemm(self->depth, nk, npixels,
+             dnets, rz, rj,
+             cols, nk, 1,
+             dwp, nk, 1);
+
+        /* The input layer has no use for its errors. */
+        if (lprev->ltype == LAYER_INPUT) continue;
+
+        /* dX = dnet^T (npixels x depth) * W (depth x nk) */
+        nn_real* errors = &lprev->errors[s * lprev->nnodes];
+        nn_real* dst = lnhwc? errors : e;
+        if (!lnhwc) {
+            for (int i = 0; i < lprev->nnodes; i++) {
+                e[i] = 0;
+            }
+        }
+        if (self->conv.ncols == 0) {
+            gemm(npixels, nk, self->depth,
+                 dnets, rj, rz,
+                 wp, nk, 1,
+                 dst, nk, 1);
+        } else {
+            for (int j = 0; j < self->conv.ncols; j++) {
+                self->conv.dcols[j] = 0;
+            }
+            gemm(npixels, nk, self->depth,
+                 dnets, rj, rz,
+                 wp, nk, 1,
+                 self->conv.dcols, nk, 1);
+            Layer_nhwc_col2im(self, self->conv.dcols, dst);
+        }
+        if (!lnhwc) {
+            nhwc_from(ldepth, lprev->width * lprev->height, e, errors);
+        }
+    }
+
+    /* Permute the updates back. */
+    for (int z1 = 0; z1 < self->depth; z1++) {
+        nn_real* dw = &self->u_weights[z1 * nk];
+        for (int z0 = 0; z0 < ldepth; z0++) {
+            for (int k = 0; k < ksize; k++) {
+                dw[z0 * ksize + k] += dwp[z1 * nk + k * ldepth + z0];
+            }
+        }
+    }
+    /* The weights are about to change. */
+    self->conv.nhwcw = 0;
+}
+
+/* Layer_feedBack_conv_winograd(self)
+   Computes the conv gradients with the adjoint of the Winograd
+   forward pass. dnets must be filled by Layer_feedBack_conv().
+*/
+static void Layer_feedBack_conv_winograd(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int ldepth = lprev->depth;
+    int lwidth = lprev->width;
+    int lheight = lprev->height;
+    int tw = (self->width+1)/2;
+    int ntiles = tw * ((self->height+1)/2);
+    int npixels = self->width * self->height;
+    int padding = self->conv.padding;
+    nn_real* U = self->conv.wino;
+    nn_real* dU = &U[16 * self->depth * ldepth];
+    nn_real* V = &dU[16 * self->depth * ldepth];
+    nn_real* dM = &V[16 * ldepth * WINO_NC];
+
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* dnets = &self->dnets[s * self->nnodes];
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            nn_real t = 0;
+            for (int j = 0; j < npixels; j++) {
+                t += dnets[z1 * npixels + j];
+            }
+            self->u_biases[z1] += t;
+        }
+    }
+    for (int i = 0; i < 16 * self->depth * ldepth; i++) {
+        dU[i] = 0;
+    }
+
+    for (int j0 = 0; j0 < self->nbatch * ntiles; j0 += WINO_NC) {
+        int n = self->nbatch * ntiles - j0;
+        if (WINO_NC < n) { n = WINO_NC; }
+        Layer_wino_inputs(self, j0, n, V);
+
+        /* dM = A dY A^T */
+        for (int j = 0; j < n; j++) {
+            int s = (j0+j) / ntiles;
+            int t = (j0+j) % ntiles;
+            int y1 = (t / tw) * 2;
+            int x1 = (t % tw) * 2;
+            const nn_real* src = &self->dnets[s * self->nnodes + y1 * self->width + x1];
+            for (int z1 = 0; z1 < self->depth; z1++) {
+                nn_real y[4], a[8], m[16];
+                for (int dy = 0; dy < 2; dy++) {
+                    for (int dx = 0; dx < 2; dx++) {
+                        y[dy*2+dx] = (y1+dy < self->height && x1+dx < self->width)?
+                            src[dy * self->width + dx] : 0;
+                    }
+                }
+                for (int r = 0; r < 2; r++) {
+                    wino_at(&y[r*2], 1, &a[r*4], 1);
+                }
+                for (int c = 0; c < 4; c++) {
+                    wino_at(&a[c], 4, &m[c], 4);
+                }
+                for (int e = 0; e < 16; e++) {
+                    dM[(z1 * n + j) * 16 + e] = m[e];
+                }
+                src += npixels;
+            }
+        }
+
+        /* dU[e] += dM[e] * V[e]^T */
+        for (int e = 0; e < 16; e++) {
+            gemm(self->depth, ldepth, n,
+                 &dM[e], 16 * n, 16,
+                 &V[e], 16, 16 * n,
+                 &dU[e * self->depth * ldepth], ldepth, 1);
+        }
+
+        /* The input layer has no use for its errors. */
+        if (lprev->ltype == LAYER_INPUT) continue;
+
+        /* dV[e] = U[e]^T * dM[e], replacing V. */
+        nn_real* dV = V;
+        for (int i = 0; i < 16 * ldepth * n; i++) {
+            dV[i] = 0;
+        }
+        for (int e = 0; e < 16; e++) {
+            gemm(ldepth, n, self->depth,
+                 &U[e * self->depth * ldepth], 1, ldepth,
+                 &dM[e], 16 * n, 16,
+                 &dV[e], 16 * n, 16);
+        }
+
+        /* dX += B dV B^T */
+        for (int j = 0; j < n; j++) {
+            int s = (j0+j) / ntiles;
+            int t = (j0+j) % ntiles;
+            int y0 = (t / tw) * 2 - padding;
+            int x0 = (t % tw) * 2 - padding;
+            nn_real* dst = &lprev->errors[s * lprev->nnodes];
+            for (int z0 = 0; z0 < ldepth; z0++) {
+                nn_real v[16], b[16], d[16];
+                for (int e = 0; e < 16; e++) {
+                    v[e] = dV[(z0 * n + j) * 16 + e];
+                }
+                for (int r = 0; r < 4; r++) {
+                    wino_bt(&v[r*4], 1, &b[r*4], 1);
+                }
+                for (int c = 0; c < 4; c++) {
+                    wino_bt(&b[c], 4, &d[c], 4);
+                }
+                for (int dy = 0; dy < 4; dy++) {
+                    int y = y0+dy;
+                    if (y < 0 || lheight <= y) continue;
+                    for (int dx = 0; dx < 4; dx++) {
+                        int x = x0+dx;
+                        if (0 <= x && x < lwidth) {
+                            dst[y * lwidth + x] += d[dy*4+dx];
+                        }
+                    }
+                }
+                dst += lwidth * lheight;
+            }
+        }
+    }
+
+    /* dW += G^T dU G */
+    for (int z1 = 0; z1 < self->depth; z1++) {
+        for (int z0 = 0; z0 < ldepth; z0++) {
+            nn_real* dw = &self->u_weights[(z1 * ldepth + z0) * 9];
+            nn_real u[16], t[12], g[9];
+            for (int e = 0; e < 16; e++) {
+                u[e] = dU[(e * self->depth + z1) * ldepth + z0];
+            }
+            for (int r = 0; r < 4; r++) {
+                wino_gt(&u[r*4], 1, &t[r*3], 1);
+            }
+            for (int c = 0; c < 3; c++) {
+                wino_gt(&t[c], 3, &g[c], 3);
+            }
+            for (int k = 0; k < 9; k++) {
+                dw[k] += g[k];
+            }
+        }
+    }
+}
+
+/* Layer_feedBack_conv_sparse(self)
+   Computes the conv gradients only at the nonzero dnets. The
+   active pixels of each output channel are compacted first, and
+   the window of each one is clipped to the input once, so the
+   inner loops have no checks.
+*/
+static void Layer_feedBack_conv_sparse(Layer* self)
+{
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->conv.kernsize;
+    int stride = self->conv.stride;
+    int padding = self->conv.padding;
+    int npixels = self->width * self->height;
+    int lwidth = lprev->width;
+    int lsize = lwidth * lprev->height;
+    int nk = lprev->depth * kernsize * kernsize;
+    int* active = self->active;
+
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lprev->nnodes];
+        nn_real* errors = &lprev->errors[s * lprev->nnodes];
+        int backprop = (lprev->ltype != LAYER_INPUT);
+        for (int z1 = 0; z1 < self->depth; z1++) {
+            const nn_real* dnets = &self->dnets[s * self->nnodes + z1 * npixels];
+            int nactive = 0;
+            for (int j = 0; j < npixels; j++) {
+                if (dnets[j] != 0) {
+                    active[nactive++] = j;
+                }
+            }
+            const nn_real* w = &self->weights[z1 * nk];
+            nn_real* uw = &self->u_weights[z1 * nk];
+            nn_real t = 0;
+            for (int k = 0; k < nactive; k++) {
+                int j = active[k];
+                nn_real dnet = dnets[j];
+                int y0 = stride * (j / self->width) - padding;
+                int x0 = stride * (j % self->width) - padding;
+                /* Clip the window to the input. */
+                int dya = (y0 < 0)? -y0 : 0;
+                int dyb = (lprev->height < y0+kernsize)? lprev->height-y0 : kernsize;
+                int dxa = (x0 < 0)? -x0 : 0;
+                int dxb = (lwidth < x0+kernsize)? lwidth-x0 : kernsize;
+                for (int z0 = 0; z0 < lprev->depth; z0++) {
+                    int q0 = z0 * kernsize * kernsize;
+                    int p0 = z0 * lsize + y0 * lwidth + x0;
+                    for (int dy = dya; dy < dyb; dy++) {
+                        int q = q0 + dy * kernsize;
+                        int p = p0 + dy * lwidth;
+                        for (int dx = dxa; dx < dxb; dx++) {
+                            uw[q+dx] += dnet * inputs[p+dx];
+                        }
+                        if (!backprop) continue;
+                        for (int dx = dxa; dx < dxb; dx++) {
+                            errors[p+dx] += w[q+dx] * dnet;
+                        }
+                    }
+                }
+                t += dnet;
+            }
+            self->u_biases[z1] += t;
+        }
+    }
+}
+
+/* Layer_feedBack_conv(self)
+   Performs backpropagation.
+*/
+static void Layer_feedBack_conv(Layer* self)
+{
+    assert (self->ltype == LAYER_CONV);
+    assert (self->lprev != NULL);
+    Layer* lprev = self->lprev;
+
+    /* Clear errors. */
+    for (int j = 0; j < self->nbatch * lprev->nnodes; j++) {
+        lprev->errors[j] = 0;
+    }
+
+    /* Compute the dnets and their density. */
+    int n = self->nbatch * self->nnodes;
+    int nactive = 0;
+    for (int i = 0; i < n; i++) {
+        nn_real dnet = self->errors[i] * self->gradients[i];
+        self->dnets[i] = dnet;
+        nactive += (dnet != 0);
+    }
+    self->conv.nactive += nactive;
+    self->conv.ndnets += n;
+    if (self->conv.layout == CONV_NHWC) {
+        Layer_feedBack_conv_nhwc(self);
+    } else if (nactive < CONV_SPARSE_DENSITY * n) {
+        Layer_feedBack_conv_sparse(self);
+    } else {
+        switch (self->conv.algo) {
+        case CONV_GEMM:
+            Layer_feedBack_conv_gemm(self);
+            break;
+        case CONV_WINOGRAD:
+            Layer_feedBack_conv_winograd(self);
+            break;
+        default:
+            Layer_feedBack_conv_direct(self);
+            break;
+        }
+    }
+    /* The weights are about to change. */
+    self->conv.winow = 0;
+
+#if DEBUG_LAYER
+    fprintf(stderr, "Layer_feedBack_conv(Layer%d):\n", self->lid);
+    for (int i = 0; i < self->nnodes; i++) {
+        nn_real dnet = self->errors[i] * self->gradients[i];
+        fprintf(stderr, "  dnet=%.4f, dw=[", dnet);
+        for (int j = 0; j < lprev->nnodes; j++) {
+            nn_real dw = dnet * lprev->outputs[j];
+            fprintf(stderr, " %.4f", dw);
+        }
+        fprintf(stderr, "]\n");
+    }
+#endif
+}
+
+/* Layer_feedForw_pool(self)
+   Performs feed forward updates. Max pooling records the
+   input index of each output for backprop.
+*/
+static void Layer_feedForw_pool(Layer* self)
+{
+    assert (self->ltype == LAYER_POOL);
+    assert (self->lprev != NULL);
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->pool.kernsize;
+    int lsize = lprev->width * lprev->height;
+    int* argmax = self->pool.argmax;
+    int i = 0;
+    for (int s = 0; s < self->nbatch; s++) {
+        const nn_real* inputs = &lprev->outputs[s * lprev->nnodes];
+        for (int z = 0; z < self->depth; z++) {
+            const nn_real* src = &inputs[z * lsize];
+            for (int y1 = 0; y1 < self->height; y1++) {
+                int y0 = self->pool.stride * y1 - self->pool.padding;
+                int ya = (y0 < 0)? 0 : y0;
+                int yb = (lprev->height < y0+kernsize)? lprev->height : y0+kernsize;
+                for (int x1 = 0; x1 < self->width; x1++) {
+                    int x0 = self->pool.stride * x1 - self->pool.padding;
+                    int xa = (x0 < 0)? 0 : x0;
+                    int xb = (lprev->width < x0+kernsize)? lprev->width : x0+kernsize;
+                    /* Window: [xa,xb) x [ya,yb) */
+                    if (self->pool.ptype == POOL_MAX) {
+                        int p = ya * lprev->width + xa;
+                        for (int y = ya; y < yb; y++) {
+                            for (int x = xa; x < xb; x++) {
+                                int q = y * lprev->width + x;
+                                if (src[p] < src[q]) { p = q; }
+                            }
+                        }
+                        self->outputs[i] = src[p];
+                        if (argmax != NULL) {
+                            argmax[i] = z * lsize + p;
+                        }
+                    } else {
+                        nn_real t = 0;
+                        for (int y = ya; y < yb; y++) {
+                            for (int x = xa; x < xb; x++) {
+                                t += src[y * lprev->width + x];
+                            }
+                        }
+                        self->outputs[i] = t / ((yb-ya) * (xb-xa));
+                    }
+                    i++;
+                }
+            }
+        }
+    }
+    assert (i == self->nbatch * self->nnodes);
+
+#if DEBUG_LAYER
+    fprintf(stderr, "Layer_feedForw_pool(Layer%d):\n", self->lid);
+    fprintf(stderr, "  outputs = [");
+    for (int i = 0; i < self->nnodes; i++) {
+        fprintf(stderr, " %.4f", self->outputs[i]);
+    }
+    fprintf(stderr, "]\n");
+#endif
+}
+
+/* Layer_feedBack_pool(self)
+   Performs backpropagation. The errors go to the max input
+   of each window, or are spread over the whole window.
+*/
+static void Layer_feedBack_pool(Layer* self)
+{
+    assert (self->ltype == LAYER_POOL);
+    assert (self->lprev != NULL);
+    Layer* lprev = self->lprev;
+
+    /* The input layer has no use for its errors. */
+    if (lprev->ltype == LAYER_INPUT) return;
+
+    /* Clear errors. */
+    for (int j = 0; j < self->nbatch * lprev->nnodes; j++) {
+        lprev->errors[j] = 0;
+    }
+
+    if (self->pool.ptype == POOL_MAX) {
+        const int* argmax = self->pool.argmax;
+        for (int s = 0; s < self->nbatch; s++) {
+            nn_real* errors = &lprev->errors[s * lprev->nnodes];
+            for (int i = s * self->nnodes; i < (s+1) * self->nnodes; i++) {
+                errors[argmax[i]] += self->errors[i];
+            }
+        }
+        return;
+    }
+
+    int kernsize = self->pool.kernsize;
+    int lsize = lprev->width * lprev->height;
+    int i = 0;
+    for (int s = 0; s < self->nbatch; s++) {
+        nn_real* errors = &lprev->errors[s * lprev->nnodes];
+        for (int z = 0; z < self->depth; z++) {
+            nn_real* dst = &errors[z * lsize];
+            for (int y1 = 0; y1 < self->height; y1++) {
+                int y0 = self->pool.stride * y1 - self->pool.padding;
+                int ya = (y0 < 0)? 0 : y0;
+                int yb = (lprev->height < y0+kernsize)? lprev->height : y0+kernsize;
+                for (int x1 = 0; x1 < self->width; x1++) {
+                    int x0 = self->pool.stride * x1 - self->pool.padding;
+                    int xa = (x0 < 0)? 0 : x0;
+                    int xb = (lprev->width < x0+kernsize)? lprev->width : x0+kernsize;
+                    nn_real e = self->errors[i++] / ((yb-ya) * (xb-xa));
+                    for (int y = ya; y < yb; y++) {
+                        for (int x = xa; x < xb; x++) {
+                            dst[y * lprev->width + x] += e;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Layer_feedForw_dwconv(self)
+   Performs feed forward updates. Each kernel tap is added
+   to the output rows at once.
+*/
+static void Layer_feedForw_dwconv(Layer* self)
+{
+    assert (self->ltype == LAYER_DWCONV);
+    assert (self->lprev != NULL);
+    Layer* lprev = self->lprev;
+
+    int kernsize = self->dwconv.kernsize;
+    int stride = self->dwconv.stride;
+    int padding = self->dwconv.padding;
+    int npixels = self->width * self->height;
+    int lsize = lprev->width * lprev->height;
+    for (int s = 0; s < self->nbatch; s++) {
+        for (int z = 0; z < self->depth; z++) {
+            const nn_real* src = &lprev->outputs[s * lprev->nnodes + z * lsize];
+            const nn_real* w = &self->weights[z * kernsize * kernsize];
+            nn_real* out = &self->outputs[s * self->nnodes + z * npixels];
+            for (int j = 0; j < npixels; j++) {
+                out[j] = self->biases[z];
+            }
+            for (int dy = 0; dy < kernsize; dy++) {
+                /* [ya,yb): rows where y = stride*y1 + dy-padding is inside. */
+                int ya, yb;
+                conv_range(lprev->height, self->height, stride, dy-padding, &ya, &yb);
+                for (int dx = 0; dx < kernsize; dx++) {
+                    int xa, xb;
+                    conv_range(lprev->width, self->width, stride, dx-padding, &xa, &xb);
+                    if (xb <= xa) continue;
+                    nn_real wk = w[dy * kernsize + dx];
+                    for (int y1 = ya; y1 < yb; y1++) {
+                        const nn_real* row = &src[(stride*y1 + dy-padding) * lprev->width];
+                        nn_real* orow = &out[y1 * self->width];
+                        if (stride == 1) {
+                            simd_axpy(xb-xa, wk, &row[xa + dx-padding], &orow[xa]);
+                        } else {
+                            for (int x1 = xa; x1 < xb; x1++) {
+                                orow[x1] += wk * row[stride*x1 + dx-padding];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* Apply the activation function. */
+    if (self->inference) {
+        for (int i = 0; i < self->nbatch * self->nnodes; i++) {
+            self->outputs[i] = relu(self->outputs[i]);
+        }
+    } else {
+        for (int i = 0; i < self->nbatch * self->nnodes; i++) {
+            nn_real v = relu(self->outputs[i]);
+            self->outputs[i] = v;
+            self->gradients[i] = relu_g(v);
+        }
+    }
+
+#if DEBUG_LAYER
+    fprintf(stderr, "Layer_feedForw_dwconv(Layer%d):\n", self->lid);
+    fprintf(stderr, "  outputs = [");
+    for (int i = 0; i < self->nnodes; i++) {
+        fprintf(stderr, " %.4f", self->outputs[i]);
+    }
+    fprintf(stderr, "]\n");
+#endif
+}
+
+/* Layer_feedBack_dwconv(self)
+   Performs backpropagation.
+*/
+static void Layer_feedBack_dwconv(Layer* self)
+{
+    assert (self->ltype == LAYER_DWCONV);
+    assert (self->lprev != NULL);
+    Layer* lprev = self->lprev;
+
+    /* Clear errors. */
+    for (int j = 0; j < self->nbatch * lprev->nnodes; j++) {
+        lprev->errors[j] = 0;
+    }
+    for (int i = 0; i < self->nbatch * self->nnodes; i++) {
+        self->dnets[i] = self->errors[i] * self->gradients[i];
+    }
+
+    int kernsize = self->dwconv.kernsize;
+    int stride = self->dwconv.stride;
+    int padding = self->dwconv.padding;
+    int npixels = self->width * self->height;
+    int lsize = lprev->width * lprev->height;
+    /* The input layer has no use for its errors. */
+    int backprop = (lprev->ltype != LAYER_INPUT);
+    for (int s = 0; s < self->nbatch; s++) {
+        for (int z = 0; z < self->depth; z++) {
+            const nn_real* src = &lprev->outputs[s * lprev->nnodes + z * lsize];
+            nn_real* errors = &lprev->errors[s * lprev->nnodes + z * lsize];
+            const nn_real* dnets = &self->dnets[s * self->nnodes + z * npixels];
+            const nn_real* w = &self->weights[z * kernsize * kernsize];
+            nn_real* dw = &self->u_weights[z * kernsize * kernsize];
+            nn_real t = 0;
+            for (int j = 0; j < npixels; j++) {
+                t += dnets[j];
+            }
+            self->u_biases[z] += t;
+            for (int dy = 0; dy < kernsize; dy++) {
+                int ya, yb;
+                conv_range(lprev->height, self->height, stride, dy-padding, &ya, &yb);
+                for (int dx = 0; dx < kernsize; dx++) {
+                    int xa, xb;
+                    conv_range(lprev->width, self->width, stride, dx-padding, &xa, &xb);
+                    if (xb <= xa) continue;
+                    nn_real wk = w[dy * kernsize + dx];
+                    nn_real g = 0;
+                    for (int y1 = ya; y1 < yb; y1++) {
+                        int p = (stride*y1 + dy-padding) * lprev->width + dx-padding;
+                        const nn_real* drow = &dnets[y1 * self->width];
+                        if (stride == 1) {
+                            g += simd_dot(xb-xa, &src[p+xa], &drow[xa]);
+                            if (backprop) {
+                                simd_axpy(xb-xa, wk, &drow[xa], &errors[p+xa]);
+                            }
+                        } else {
+                            for (int x1 = xa; x1 < xb; x1++) {
+                                g += drow[x1] * src[p + stride*x1];
+                                if (backprop) {
+                                    errors[p + stride*x1] += wk * drow[x1];
+                                }
+                            }
+                        }
+                    }
+                    dw[dy * kernsize + dx] += g;
+                }
+            }
+        }
+    }
+}
+
+/* Layer_checkConv(self)
+   Compares the current outputs with the direct algorithm.
+*/
+double Layer_checkConv(Layer* self)
+{
+    assert (self != NULL);
+    assert (self->ltype == LAYER_CONV);
+
+    int n = self->nbatch * self->nnodes;
+    nn_real* outputs = (nn_real*)calloc(n, sizeof(nn_real));
+    memcpy(outputs, self->outputs, n * sizeof(nn_real));
+    /* The direct algorithm works in (depth, y, x) order. */
+    Layer* lprev = self->lprev;
+    nn_real* inputs = lprev->outputs;
+    if (Layer_isNHWC(lprev)) {
+        lprev->outputs = (nn_real*)calloc(
+            self->nbatch * lprev->nnodes, sizeof(nn_real));
+        for (int s = 0; s < self->nbatch; s++) {
+            nhwc_from(lprev->depth, lprev->width * lprev->height,
+                      &inputs[s * lprev->nnodes],
+                      &lprev->outputs[s * lprev->nnodes]);
+        }
+    }
+    Layer_feedForw_conv_direct(self);
+    int npixels = self->width * self->height;
+    int nhwc = Layer_isNHWC(self);
+    double err = 0;
+    for (int i = 0; i < n; i++) {
+        double v = relu(self->outputs[i]);
+        int j = i;
+        if (nhwc) {
+            int k = i % self->nnodes;
+            j = i - k + (k % npixels) * self->depth + k / npixels;
+        }
+        double d = fabs(outputs[j] - v) / ((1 < fabs(v))? fabs(v) : 1);
+        if (err < d) { err = d; }
+    }
+    memcpy(self->outputs, outputs, n * sizeof(nn_real));
+    free(outputs);
+    if (lprev->outputs != inputs) {
+        free(lprev->outputs);
+        lprev->outputs = inputs;
+    }
+    return err;
+}
+
+/* Layer_setInputsBatch(self, values, nbatch)
+   Sets the input values of nbatch samples.
 */
-void Layer_setInputs(Layer* self, const double* values)
+void Layer_setInputsBatch(Layer* self, const nn_real* values, int nbatch)
 {
     assert (self != NULL);
     assert (self->ltype == LAYER_INPUT);
     assert (self->lprev == NULL);
+    assert (0 < nbatch);
 
 #if DEBUG_LAYER
     fprintf(stderr, "Layer_setInputs(Layer%d): values = [", self->lid);
@@ -445,8 +2519,10 @@ void Layer_setInputs(Layer* self, const double* values)
     fprintf(stderr, "]\n");
 #endif
 
+    Layer_reserve(self, nbatch);
+
     /* Set the values as the outputs. */
-    for (int i = 0; i < self->nnodes; i++) {
+    for (int i = 0; i < nbatch * self->nnodes; i++) {
         self->outputs[i] = values[i];
     }
 
@@ -460,6 +2536,12 @@ void Layer_setInputs(Layer* self, const double* values)
         case LAYER_CONV:
             Layer_feedForw_conv(layer);
             break;
+        case LAYER_POOL:
+            Layer_feedForw_pool(layer);
+            break;
+        case LAYER_DWCONV:
+            Layer_feedForw_dwconv(layer);
+            break;
         default:
             break;
         }
@@ -467,13 +2549,30 @@ void Layer_setInputs(Layer* self, const double* values)
     }
 }
 
+/* Layer_setInputs(self, values)
+   Sets the input values.
+*/
+void Layer_setInputs(Layer* self, const nn_real* values)
+{
+    Layer_setInputsBatch(self, values, 1);
+}
+
 /* Layer_getOutputs(self, outputs)
    Gets the output values.
 */
-void Layer_getOutputs(const Layer* self, double* outputs)
+void Layer_getOutputs(const Layer* self, nn_real* outputs)
 {
     assert (self != NULL);
-    for (int i = 0; i < self->nnodes; i++) {
+    if (Layer_isNHWC(self)) {
+        /* Back to (depth, y, x). */
+        for (int s = 0; s < self->nbatch; s++) {
+            nhwc_from(self->depth, self->width * self->height,
+                      &self->outputs[s * self->nnodes],
+                      &outputs[s * self->nnodes]);
+        }
+        return;
+    }
+    for (int i = 0; i < self->nbatch * self->nnodes; i++) {
         outputs[i] = self->outputs[i];
     }
 }
@@ -484,23 +2583,26 @@ void Layer_getOutputs(const Layer* self, double* outputs)
 double Layer_getErrorTotal(const Layer* self)
 {
     assert (self != NULL);
+    assert (!self->inference);
     double total = 0;
-    for (int i = 0; i < self->nnodes; i++) {
+    for (int i = 0; i < self->nbatch * self->nnodes; i++) {
         double e = self->errors[i];
         total += e*e;
     }
     return (total / self->nnodes);
 }
 
-/* Layer_learnOutputs(self, values)
-   Learns the output values.
+/* Layer_learnOutputsBatch(self, values, nbatch)
+   Learns the output values of nbatch samples.
 */
-void Layer_learnOutputs(Layer* self, const double* values)
+void Layer_learnOutputsBatch(Layer* self, const nn_real* values, int nbatch)
 {
     assert (self != NULL);
     assert (self->ltype != LAYER_INPUT);
     assert (self->lprev != NULL);
-    for (int i = 0; i < self->nnodes; i++) {
+    assert (!self->inference);
+    assert (nbatch == self->nbatch);
+    for (int i = 0; i < nbatch * self->nnodes; i++) {
         self->errors[i] = (self->outputs[i] - values[i]);
     }
 
@@ -522,6 +2624,12 @@ void Layer_learnOutputs(Layer* self, const double* values)
         case LAYER_CONV:
             Layer_feedBack_conv(layer);
             break;
+        case LAYER_POOL:
+            Layer_feedBack_pool(layer);
+            break;
+        case LAYER_DWCONV:
+            Layer_feedBack_dwconv(layer);
+            break;
         default:
             break;
         }
@@ -529,21 +2637,87 @@ void Layer_learnOutputs(Layer* self, const double* values)
     }
 }
 
+/* Layer_learnOutputs(self, values)
+   Learns the output values.
+*/
+void Layer_learnOutputs(Layer* self, const nn_real* values)
+{
+    Layer_learnOutputsBatch(self, values, 1);
+}
+
 /* Layer_update(self, rate)
    Updates the weights.
 */
 void Layer_update(Layer* self, double rate)
 {
+    assert (!self->inference);
+    Arena* arena = self->arena;
+    if (arena != NULL && arena->params != NULL && self->lnext == NULL) {
+        /* All the Layers at once. */
+        simd_sgd(arena->nparams, rate, arena->params, arena->updates);
+        return;
+    }
+    simd_sgd(self->nbiases, rate, self->biases, self->u_biases);
+    simd_sgd(self->nweights, rate, self->weights, self->u_weights);
+    if (self->lprev != NULL) {
+        Layer_update(self->lprev, rate);
+    }
+}
+
+/* Layer_updateSparse(self, rate)
+   Updates the weights, only touching the ones with nonzero updates.
+   This keeps the writes to shared weights to a minimum when
+   several threads update them without locks (Hogwild).
+*/
+void Layer_updateSparse(Layer* self, double rate)
+{
+    assert (!self->inference);
     for (int i = 0; i < self->nbiases; i++) {
-        self->biases[i] -= rate * self->u_biases[i];
-        self->u_biases[i] = 0;
+        if (self->u_biases[i] != 0) {
+            self->biases[i] -= rate * self->u_biases[i];
+            self->u_biases[i] = 0;
+        }
     }
     for (int i = 0; i < self->nweights; i++) {
-        self->weights[i] -= rate * self->u_weights[i];
-        self->u_weights[i] = 0;
+        if (self->u_weights[i] != 0) {
+            self->weights[i] -= rate * self->u_weights[i];
+            self->u_weights[i] = 0;
+        }
     }
     if (self->lprev != NULL) {
-        Layer_update(self->lprev, rate);
+        Layer_updateSparse(self->lprev, rate);
+    }
+}
+
+/* Layer_gatherUpdates(self, other)
+   Adds the weight/bias updates of other to self and clears them.
+   other must have the same shape as self (e.g. a replica).
+*/
+void Layer_gatherUpdates(Layer* self, Layer* other)
+{
+    assert (!self->inference && !other->inference);
+    assert (self->nbiases == other->nbiases);
+    assert (self->nweights == other->nweights);
+    Arena* arena = self->arena;
+    if (arena != NULL && other->arena != NULL && self->lnext == NULL) {
+        /* All the Layers at once. */
+        assert (arena->nparams == other->arena->nparams);
+        for (size_t i = 0; i < arena->nparams; i++) {
+            arena->updates[i] += other->arena->updates[i];
+            other->arena->updates[i] = 0;
+        }
+        return;
+    }
+    for (int i = 0; i < self->nbiases; i++) {
+        self->u_biases[i] += other->u_biases[i];
+        other->u_biases[i] = 0;
+    }
+    for (int i = 0; i < self->nweights; i++) {
+        self->u_weights[i] += other->u_weights[i];
+        other->u_weights[i] = 0;
+    }
+    if (self->lprev != NULL) {
+        Layer_gatherUpdates(self->lprev, other->lprev);
     }
 }
 
@@ -566,6 +2740,7 @@ Layer* Layer_create_full(Layer* lprev, int nnodes, double std)
         lprev, LAYER_FULL, nnodes, 1, 1,
         nnodes, nnodes * lprev->nnodes);
     assert (self != NULL);
+    self->active = (int*)calloc(lprev->nnodes, sizeof(int));
 
     for (int i = 0; i < self->nweights; i++) {
         self->weights[i] = std * nrnd();
@@ -577,6 +2752,65 @@ Layer* Layer_create_full(Layer* lprev, int nnodes, double std)
     return self;
 }
 
+/* Layer_conv_nactive(self)
+   Returns the size of the index scratch of a conv Layer: the
+   active pixels of one channel, or the triples of one sample
+   (at most ceil(K/S)^2 kernel taps hit each input pixel).
+*/
+static int Layer_conv_nactive(const Layer* self)
+{
+    int ntaps = (self->conv.kernsize + self->conv.stride-1) / self->conv.stride;
+    int n = 3 * self->lprev->nnodes * ntaps * ntaps;
+    int npixels = self->width * self->height;
+    return (n < npixels)? npixels : n;
+}
+
+/* Layer_create_replica(lprev, src)
+   Creates a Layer that has the same shape as src and shares
+   its weights/biases. Its outputs and updates are its own.
+*/
+Layer* Layer_create_replica(Layer* lprev, Layer* src)
+{
+    assert (src != NULL);
+    assert ((lprev == NULL) == (src->lprev == NULL));
+    Layer* self = Layer_create(
+        lprev, src->ltype, src->depth, src->width, src->height,
+        src->nbiases, src->nweights);
+    assert (self != NULL);
+
+    free(self->biases);
+    free(self->weights);
+    self->biases = src->biases;
+    self->weights = src->weights;
+    self->shared = 1;
+
+    if (self->ltype == LAYER_CONV) {
+        self->conv = src->conv;
+        self->conv.cols = (nn_real*)calloc(self->conv.ncols, sizeof(nn_real));
+        self->conv.dcols = (nn_real*)calloc(self->conv.ncols, sizeof(nn_real));
+        self->conv.wino = (self->conv.nwino == 0)? NULL :
+            (nn_real*)calloc(self->conv.nwino, sizeof(nn_real));
+        self->conv.nactive = 0;
+        self->conv.ndnets = 0;
+        self->conv.winow = 0;
+        self->conv.nhwcw = 0;
+        if (self->conv.nhwc != NULL) {
+            self->conv.nhwc = (nn_real*)calloc(
+                2 * self->nweights + 2 * lprev->nnodes, sizeof(nn_real));
+        }
+        self->active = (int*)calloc(Layer_conv_nactive(self), sizeof(int));
+    } else if (self->ltype == LAYER_FULL) {
+        self->active = (int*)calloc(lprev->nnodes, sizeof(int));
+    } else if (self->ltype == LAYER_POOL) {
+        self->pool = src->pool;
+        self->pool.argmax = (int*)calloc(self->nnodes, sizeof(int));
+    } else if (self->ltype == LAYER_DWCONV) {
+        self->dwconv = src->dwconv;
+    }
+
+    return self;
+}
+
 /* Layer_create_conv(lprev, depth, width, height, kernsize, padding, stride, std)
    Creates a convolutional Layer.
 */
@@ -597,6 +2831,65 @@ Layer* Layer_create_conv(
     self->conv.kernsize = kernsize;
     self->conv.padding = padding;
     self->conv.stride = stride;
+    self->conv.algo = CONV_GEMM;
+    self->conv.spec = conv_findSpec(kernsize, stride, padding);
+    if (kernsize == 1 && stride == 1 && padding == 0) {
+        /* The inputs are the columns. */
+        self->conv.ncols = 0;
+    } else {
+        self->conv.ncols = lprev->depth * kernsize * kernsize * width * height;
+    }
+    self->conv.nwino = Layer_wino_size(lprev, depth, kernsize, stride);
+    if (self->conv.nwino != 0) {
+        self->conv.wino = (nn_real*)calloc(self->conv.nwino, sizeof(nn_real));
+        if (WINO_MINDEPTH <= lprev->depth) {
+            self->conv.algo = CONV_WINOGRAD;
+        }
+    }
+    self->conv.cols = (nn_real*)calloc(self->conv.ncols, sizeof(nn_real));
+    self->conv.dcols = (nn_real*)calloc(self->conv.ncols, sizeof(nn_real));
+    self->active = (int*)calloc(Layer_conv_nactive(self), sizeof(int));
+
+    for (int i = 0; i < self->nweights; i++) {
+        self->weights[i] = std * nrnd();
+    }
+
+#if DEBUG_LAYER
+    Layer_dump(self, stderr);
+#endif
+    return self;
+}
+
+/* Layer_create_pwconv(lprev, depth, std)
+   Creates a pointwise (1x1) convolutional Layer.
+*/
+Layer* Layer_create_pwconv(Layer* lprev, int depth, double std)
+{
+    assert (lprev != NULL);
+    return Layer_create_conv(
+        lprev, depth, lprev->width, lprev->height, 1, 0, 1, std);
+}
+
+/* Layer_create_dwconv(lprev, width, height, kernsize, padding, stride, std)
+   Creates a depthwise convolutional Layer.
+*/
+Layer* Layer_create_dwconv(
+    Layer* lprev, int width, int height,
+    int kernsize, int padding, int stride, double std)
+{
+    assert (lprev != NULL);
+    assert ((kernsize % 2) == 1);
+    assert ((width-1) * stride + kernsize <= lprev->width + padding*2);
+    assert ((height-1) * stride + kernsize <= lprev->height + padding*2);
+
+    Layer* self = Layer_create(
+        lprev, LAYER_DWCONV, lprev->depth, width, height,
+        lprev->depth, lprev->depth * kernsize * kernsize);
+    assert (self != NULL);
+
+    self->dwconv.kernsize = kernsize;
+    self->dwconv.padding = padding;
+    self->dwconv.stride = stride;
 
     for (int i = 0; i < self->nweights; i++) {
         self->weights[i] = std * nrnd();
@@ -607,3 +2900,35 @@ Layer* Layer_create_conv(
 #endif
     return self;
 }
+
+/* Layer_create_pool(lprev, ptype, width, height, kernsize, padding, stride)
+   Creates a pooling Layer.
+*/
+Layer* Layer_create_pool(
+    Layer* lprev, PoolType ptype, int width, int height,
+    int kernsize, int padding, int stride)
+{
+    assert (lprev != NULL);
+    assert (0 < kernsize && 0 < stride);
+    assert (padding < kernsize);
+    assert ((width-1) * stride + kernsize <= lprev->width + padding*2);
+    assert ((height-1) * stride + kernsize <= lprev->height + padding*2);
+    /* Every window must have an input inside. */
+    assert ((width-1) * stride - padding < lprev->width);
+    assert ((height-1) * stride - padding < lprev->height);
+
+    Layer* self = Layer_create(
+        lprev, LAYER_POOL, lprev->depth, width, height, 0, 0);
+    assert (self != NULL);
+
+    self->pool.ptype = ptype;
+    self->pool.kernsize = kernsize;
+    self->pool.padding = padding;
+    self->pool.stride = stride;
+    self->pool.argmax = (int*)calloc(self->nnodes, sizeof(int));
+
+#if DEBUG_LAYER
+    Layer_dump(self, stderr);
+#endif
+    return self;
+}
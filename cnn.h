@@ -4,14 +4,100 @@
 */
 
 
+/*  nn_real
+    Element type of all the Layer buffers.
+    Compile with -DNN_FLOAT for single precision.
+    Compile with -DNN_FAST_MATH to use the polynomial exp/tanh of
+    simd.h instead of libm in the activations.
+ */
+#ifdef NN_FLOAT
+typedef float nn_real;
+#else
+typedef double nn_real;
+#endif
+
+
 /*  LayerType
  */
 typedef enum _LayerType {
     LAYER_INPUT = 0,
     LAYER_FULL,
-    LAYER_CONV
+    LAYER_CONV,
+    LAYER_POOL,
+    LAYER_DWCONV
 } LayerType;
 
+/*  PoolType
+ */
+typedef enum _PoolType {
+    POOL_MAX = 0,               /* Maximum */
+    POOL_AVG                    /* Average (of the inputs inside) */
+} PoolType;
+
+
+/*  ConvAlgo
+ */
+typedef enum _ConvAlgo {
+    CONV_DIRECT = 0,            /* Reference loop */
+    CONV_GEMM,                  /* im2col + GEMM */
+    CONV_WINOGRAD               /* Winograd F(2x2,3x3), 3x3 stride 1 only */
+} ConvAlgo;
+
+/*  ConvLayout
+    Order of the activations of a conv Layer.
+ */
+typedef enum _ConvLayout {
+    CONV_NCHW = 0,              /* (depth, y, x) */
+    CONV_NHWC                   /* (y, x, depth), GEMM only */
+} ConvLayout;
+
+/*  CONV_TOLERANCE
+    Largest difference allowed between the outputs of an algorithm
+    and the direct one, relative to max(1, |output|) (Layer_checkConv).
+ */
+#ifdef NN_FLOAT
+#define CONV_TOLERANCE 1e-4
+#else
+#define CONV_TOLERANCE 1e-10
+#endif
+
+/*  CONV_SPARSE_DENSITY
+    Backprop of a conv Layer only visits the nonzero dnets when
+    their share in the batch is below this.
+ */
+#define CONV_SPARSE_DENSITY 0.08
+
+/*  FULL_SPARSE_DENSITY, CONV_SPARSE_INPUT_DENSITY
+    Full/conv Layers only visit the nonzero inputs in forward
+    when their share in the batch is below these. In training,
+    the zero inputs of a full Layer must also make up for one
+    pass over the input size (to pay for transposing W).
+ */
+#define FULL_SPARSE_DENSITY 0.15
+#define CONV_SPARSE_INPUT_DENSITY 0.05
+
+
+struct _Layer;
+struct _ConvSpec;
+
+/*  Arena
+    Contiguous storage for all the Layers of a network.
+    Every block is 64-byte aligned, and so is every buffer in it.
+ */
+typedef struct _Arena {
+
+    struct _Layer* linput;      /* First Layer */
+
+    size_t nparams;             /* Num. of parameters (padded) */
+    nn_real* params;            /* Biases and weights of all the Layers */
+    nn_real* updates;           /* Their updates, laid out like params */
+
+    int maxbatch;               /* Capacity of the sample buffers */
+    size_t nacts;               /* Num. of activations (padded) */
+    nn_real* acts;              /* Per-sample buffers of all the Layers */
+
+} Arena;
+
 
 /*  Layer
  */
@@ -24,22 +110,36 @@ typedef struct _Layer {
     int depth, width, height;   /* Shape */
 
     int nnodes;                 /* Num. of Nodes */
-    double* outputs;            /* Node Outputs */
-    double* gradients;          /* Node Gradients */
-    double* errors;             /* Node Errors */
+    int nbatch;                 /* Num. of Samples in the batch */
+    int maxbatch;               /* Capacity of the sample buffers */
+    /* per-sample buffers: (nbatch x nnodes) */
+    nn_real* outputs;           /* Node Outputs */
+    nn_real* gradients;         /* Node Gradients */
+    nn_real* errors;            /* Node Errors */
+    nn_real* dnets;             /* Node Deltas (errors * gradients) */
 
     int nbiases;                /* Num. of Biases */
-    double* biases;             /* Biases (trained) */
-    double* u_biases;           /* Bias updates */
+    nn_real* biases;            /* Biases (trained) */
+    nn_real* u_biases;          /* Bias updates */
 
     int nweights;               /* Num. of Weights */
-    double* weights;            /* Weights (trained) */
-    double* u_weights;          /* Weight updates */
+    nn_real* weights;           /* Weights (trained) */
+    nn_real* u_weights;         /* Weight updates */
+
+    int shared;                 /* Weights/biases are not owned (replica/file) */
+    Arena* arena;               /* Arena holding the buffers (or NULL) */
+    int inference;              /* No training buffers (outputs only) */
+
+    /* Sparse paths */
+    int* active;                /* Index scratch of the sparse paths */
+    size_t nzinputs;            /* Num. of nonzero inputs seen in forward */
+    size_t ninputs;             /* Num. of inputs seen in forward */
 
     LayerType ltype;            /* Layer type */
     union {
         /* Full */
         struct {
+            nn_real* wt;        /* Transposed weights (sparse forward) */
         } full;
 
         /* Conv */
@@ -47,7 +147,36 @@ typedef struct _Layer {
             int kernsize;       /* kernel size (>0) */
             int padding;        /* padding size */
             int stride;         /* stride (>0) */
+            ConvAlgo algo;      /* algorithm */
+            ConvLayout layout;  /* layout */
+            const struct _ConvSpec* spec; /* kernels specialized for the shape */
+            int ncols;          /* im2col size per sample (0: 1x1, the inputs as is) */
+            nn_real* cols;      /* im2col buffer (nbatch x ncols) */
+            nn_real* dcols;     /* im2col gradient buffer */
+            int nwino;          /* Winograd scratch size (0: not applicable) */
+            nn_real* wino;      /* Winograd scratch (transformed weights) */
+            int winow;          /* wino holds the current transformed weights */
+            nn_real* nhwc;      /* NHWC scratch (weights, updates, 2 samples) */
+            int nhwcw;          /* nhwc holds the current weights */
+            size_t nactive;     /* Num. of nonzero dnets seen in backprop */
+            size_t ndnets;      /* Num. of dnets seen in backprop */
         } conv;
+
+        /* Pool */
+        struct {
+            PoolType ptype;     /* pool type */
+            int kernsize;       /* window size (>0) */
+            int padding;        /* padding size */
+            int stride;         /* stride (>0) */
+            int* argmax;        /* Input index of each max (nbatch x nnodes) */
+        } pool;
+
+        /* Depthwise conv */
+        struct {
+            int kernsize;       /* kernel size (>0) */
+            int padding;        /* padding size */
+            int stride;         /* stride (>0) */
+        } dwconv;
     };
 
 } Layer;
@@ -71,6 +200,84 @@ Layer* Layer_create_conv(
     Layer* lprev, int depth, int width, int height,
     int kernsize, int padding, int stride, double std);
 
+/* Layer_create_pwconv(lprev, depth, std)
+   Creates a pointwise (1x1) convolutional Layer. Its GEMM
+   runs on the inputs as they are without im2col.
+*/
+Layer* Layer_create_pwconv(Layer* lprev, int depth, double std);
+
+/* Layer_create_dwconv(lprev, width, height, kernsize, padding, stride, std)
+   Creates a depthwise convolutional Layer: each channel of lprev
+   has its own kernel. Followed by Layer_create_pwconv(), this is
+   a separable convolution.
+*/
+Layer* Layer_create_dwconv(
+    Layer* lprev, int width, int height,
+    int kernsize, int padding, int stride, double std);
+
+/* Layer_create_pool(lprev, ptype, width, height, kernsize, padding, stride)
+   Creates a pooling Layer with the depth of lprev.
+   The padding is not counted in the windows.
+*/
+Layer* Layer_create_pool(
+    Layer* lprev, PoolType ptype, int width, int height,
+    int kernsize, int padding, int stride);
+
+/* Layer_create_replica(lprev, src)
+   Creates a Layer that shares the weights/biases of src.
+*/
+Layer* Layer_create_replica(Layer* lprev, Layer* src);
+
+/* Arena_create(linput)
+   Moves the buffers of all the Layers starting from linput into
+   an Arena: one block for the parameters, one for the updates and
+   one for the per-sample buffers. Call it after the network is built.
+   For replicas, the parameters stay shared and only the other
+   blocks are allocated.
+*/
+Arena* Arena_create(struct _Layer* linput);
+
+/* Arena_destroy(self)
+   Releases the memory. Call it after the Layers are destroyed.
+*/
+void Arena_destroy(Arena* self);
+
+/* Layer_setInference(linput)
+   Converts the Layers starting from linput for inference only.
+   Releases the gradients, errors, dnets, updates and im2col
+   gradients, so the Layers can no longer learn.
+*/
+void Layer_setInference(Layer* linput);
+
+/* Layer_setConvAlgo(self, algo)
+   Selects the algorithm of a convolutional Layer.
+   CONV_WINOGRAD requires a 3x3 kernel with stride 1; such Layers
+   use it by default when the input is deep enough.
+   The transformed weights are kept until the next backward pass;
+   call it again after changing the weights in any other way.
+*/
+void Layer_setConvAlgo(Layer* self, ConvAlgo algo);
+
+/* Layer_setConvLayout(self, layout)
+   Selects the activation layout of a convolutional Layer.
+   A CONV_NHWC Layer lowers its inputs in (y, x, depth) order,
+   so that the channel reduction is unit-stride, and uses
+   CONV_GEMM. Its outputs stay in NHWC when the next Layer is
+   also NHWC; at the other boundaries (input, full, pool...)
+   the activations are converted from/to (depth, y, x).
+   The weights are permuted at the first forward pass after
+   each backward pass; call it again after changing them in
+   any other way.
+*/
+void Layer_setConvLayout(Layer* self, ConvLayout layout);
+
+/* Layer_checkConv(self)
+   Recomputes the current outputs of a convolutional Layer with
+   the direct algorithm and returns the largest difference,
+   relative to max(1, |output|). Compare it with CONV_TOLERANCE.
+*/
+double Layer_checkConv(Layer* self);
+
 /* Layer_destroy(self)
    Releases the memory.
 */
@@ -84,24 +291,46 @@ void Layer_dump(const Layer* self, FILE* fp);
 /* Layer_setInputs(self, values)
    Sets the input values.
 */
-void Layer_setInputs(Layer* self, const double* values);
+void Layer_setInputs(Layer* self, const nn_real* values);
+
+/* Layer_setInputsBatch(self, values, nbatch)
+   Sets the input values of nbatch samples.
+   values is a (nbatch x nnodes) matrix.
+*/
+void Layer_setInputsBatch(Layer* self, const nn_real* values, int nbatch);
 
 /* Layer_getOutputs(self, outputs)
-   Gets the output values.
+   Gets the output values (nbatch x nnodes).
 */
-void Layer_getOutputs(const Layer* self, double* outputs);
+void Layer_getOutputs(const Layer* self, nn_real* outputs);
 
 /* Layer_getErrorTotal(self)
-   Gets the error total.
+   Gets the error total, summed over the samples.
 */
 double Layer_getErrorTotal(const Layer* self);
 
 /* Layer_learnOutputs(self, values)
    Learns the output values.
 */
-void Layer_learnOutputs(Layer* self, const double* values);
+void Layer_learnOutputs(Layer* self, const nn_real* values);
+
+/* Layer_learnOutputsBatch(self, values, nbatch)
+   Learns the output values of nbatch samples.
+   values is a (nbatch x nnodes) matrix.
+*/
+void Layer_learnOutputsBatch(Layer* self, const nn_real* values, int nbatch);
 
 /* Layer_update(self, rate)
    Updates the weights.
 */
 void Layer_update(Layer* self, double rate);
+
+/* Layer_updateSparse(self, rate)
+   Updates the weights that have nonzero updates.
+*/
+void Layer_updateSparse(Layer* self, double rate);
+
+/* Layer_gatherUpdates(self, other)
+   Adds the weight/bias updates of other to self and clears them.
+*/
+void Layer_gatherUpdates(Layer* self, Layer* other);
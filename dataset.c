@@ -0,0 +1,228 @@
+/*
+  dataset.c
+  Preprocessed dataset cache files.
+
+  The Samples are stored already normalized in nn_real, so that
+  training copies them as they are. Like the model files, the
+  arrays are aligned to pages and the file is used mapped.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cnn.h"
+#include "dataset.h"
+
+#define DEBUG_DATASET 0
+
+
+/* dataset_align(offset): rounds offset up to DATASET_ALIGN. */
+static uint64_t dataset_align(uint64_t offset)
+{
+    return (offset + DATASET_ALIGN-1) / DATASET_ALIGN * DATASET_ALIGN;
+}
+
+/* dataset_pad(fp, pos, offset)
+   Writes zeros from pos up to offset.
+*/
+static int dataset_pad(FILE* fp, uint64_t pos, uint64_t offset)
+{
+    assert (pos <= offset);
+    for (; pos < offset; pos++) {
+        if (fputc(0, fp) == EOF) return -1;
+    }
+    return 0;
+}
+
+/* Dataset_save(path, nsamples, ninputs, nlabels, get, ctx)
+   Writes the Samples to a file.
+*/
+int Dataset_save(
+    const char* path, int nsamples, int ninputs, int nlabels,
+    DatasetGet get, void* ctx)
+{
+    assert (0 < nsamples);
+    assert (0 < ninputs);
+    assert (0 <= nlabels);
+    assert (get != NULL);
+
+    DatasetHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+    header.version = DATASET_VERSION;
+    header.endian = DATASET_ENDIAN;
+    header.realsize = sizeof(nn_real);
+    header.align = DATASET_ALIGN;
+    header.nsamples = nsamples;
+    header.ninputs = ninputs;
+    header.nlabels = nlabels;
+    uint64_t offset = sizeof(header);
+    header.inputs = dataset_align(offset);
+    offset = header.inputs + (uint64_t)nsamples * ninputs * sizeof(nn_real);
+    if (0 < nlabels) {
+        header.targets = dataset_align(offset);
+        offset = header.targets + (uint64_t)nsamples * nlabels * sizeof(nn_real);
+    }
+    header.labels = dataset_align(offset);
+
+    /* Write to a temporary file so that readers never see a partial one. */
+    size_t n = strlen(path);
+    char* tmp = (char*)calloc(n+5, sizeof(char));
+    uint32_t* labels = (uint32_t*)calloc(nsamples, sizeof(uint32_t));
+    nn_real* x = (nn_real*)calloc(ninputs, sizeof(nn_real));
+    FILE* fp = NULL;
+    if (tmp != NULL) {
+        memcpy(tmp, path, n);
+        memcpy(tmp+n, ".tmp", 5);
+        fp = fopen(tmp, "wb");
+    }
+    if (fp == NULL || labels == NULL || x == NULL) {
+        if (fp != NULL) {
+            fclose(fp);
+            unlink(tmp);
+        }
+        free(tmp);
+        free(labels);
+        free(x);
+        return -1;
+    }
+    int error = 0;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) error = -1;
+    uint64_t pos = sizeof(header);
+    if (error == 0 && dataset_pad(fp, pos, header.inputs) != 0) error = -1;
+    for (int i = 0; i < nsamples && error == 0; i++) {
+        labels[i] = get(ctx, i, x);
+        if (fwrite(x, sizeof(nn_real), ninputs, fp) != ninputs) error = -1;
+    }
+    free(x);
+    pos = header.inputs + (uint64_t)nsamples * ninputs * sizeof(nn_real);
+    if (0 < nlabels) {
+        if (error == 0 && dataset_pad(fp, pos, header.targets) != 0) error = -1;
+        nn_real* y = (nn_real*)calloc(nlabels, sizeof(nn_real));
+        for (int i = 0; i < nsamples && error == 0; i++) {
+            assert (labels[i] < nlabels);
+            for (int j = 0; j < nlabels; j++) {
+                y[j] = (j == labels[i])? 1 : 0;
+            }
+            if (fwrite(y, sizeof(nn_real), nlabels, fp) != nlabels) error = -1;
+        }
+        free(y);
+        pos = header.targets + (uint64_t)nsamples * nlabels * sizeof(nn_real);
+    }
+    if (error == 0 && dataset_pad(fp, pos, header.labels) != 0) error = -1;
+    if (error == 0 && fwrite(labels, sizeof(uint32_t), nsamples, fp) !=
+        nsamples) error = -1;
+    if (fclose(fp) != 0) error = -1;
+    if (error == 0 && rename(tmp, path) != 0) error = -1;
+    if (error != 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    free(labels);
+
+#if DEBUG_DATASET
+    fprintf(stderr, "Dataset_save: %s: nsamples=%d, ninputs=%d, nlabels=%d\n",
+            path, nsamples, ninputs, nlabels);
+#endif
+    return error;
+}
+
+/* Dataset_checkArray(self, offset, n)
+   Returns 1 if n bytes at offset are inside the file.
+*/
+static int Dataset_checkArray(const Dataset* self, uint64_t offset, uint64_t n)
+{
+    if (offset % DATASET_ALIGN != 0) return 0;
+    if (self->size < offset) return 0;
+    return (n <= self->size - offset);
+}
+
+/* Dataset_load(path)
+   Maps a file.
+*/
+Dataset* Dataset_load(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(DatasetHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    Dataset* self = (Dataset*)calloc(1, sizeof(Dataset));
+    if (self == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    self->map = map;
+    self->size = st.st_size;
+
+    /* Check the header and the arrays. */
+    const DatasetHeader* header = (const DatasetHeader*)map;
+    uint64_t nsamples = header->nsamples;
+    if (memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DATASET_VERSION ||
+        header->endian != DATASET_ENDIAN ||
+        header->realsize != sizeof(nn_real) ||
+        header->align != DATASET_ALIGN ||
+        nsamples < 1 || header->ninputs < 1 ||
+        !Dataset_checkArray(self, header->inputs,
+                            nsamples * header->ninputs * sizeof(nn_real)) ||
+        (0 < header->nlabels &&
+         !Dataset_checkArray(self, header->targets,
+                             nsamples * header->nlabels * sizeof(nn_real))) ||
+        !Dataset_checkArray(self, header->labels,
+                            nsamples * sizeof(uint32_t))) {
+        Dataset_destroy(self);
+        return NULL;
+    }
+    self->nsamples = header->nsamples;
+    self->ninputs = header->ninputs;
+    self->nlabels = header->nlabels;
+    self->inputs = (const nn_real*)((char*)map + header->inputs);
+    if (0 < header->nlabels) {
+        self->targets = (const nn_real*)((char*)map + header->targets);
+    }
+    self->labels = (const uint32_t*)((char*)map + header->labels);
+
+#if DEBUG_DATASET
+    fprintf(stderr, "Dataset_load: %s: nsamples=%d, ninputs=%d, nlabels=%d\n",
+            path, self->nsamples, self->ninputs, self->nlabels);
+#endif
+    return self;
+}
+
+/* Dataset_isNewer(path, src)
+   Returns 1 if the file path exists and is newer than src.
+*/
+int Dataset_isNewer(const char* path, const char* src)
+{
+    struct stat st0, st1;
+    if (stat(path, &st0) != 0) return 0;
+    if (stat(src, &st1) != 0) return 0;
+    if (st0.st_mtim.tv_sec != st1.st_mtim.tv_sec) {
+        return (st0.st_mtim.tv_sec > st1.st_mtim.tv_sec);
+    }
+    return (st0.st_mtim.tv_nsec > st1.st_mtim.tv_nsec);
+}
+
+/* Dataset_destroy(self)
+   Unmaps the file.
+*/
+void Dataset_destroy(Dataset* self)
+{
+    assert (self != NULL);
+    if (self->map != NULL) {
+        munmap(self->map, self->size);
+    }
+    free(self);
+}
@@ -0,0 +1,83 @@
+/*
+  dataset.h
+  Preprocessed dataset cache files.
+  Requires cnn.h.
+
+  File layout (native byte order):
+    DatasetHeader
+    inputs (nsamples x ninputs nn_reals)
+    targets (nsamples x nlabels nn_reals, one-hot; if nlabels > 0)
+    labels (nsamples uint32s)
+  each array at a DATASET_ALIGN boundary.
+*/
+
+#include <stdint.h>
+
+#define DATASET_MAGIC "NN1D"
+#define DATASET_VERSION 1
+#define DATASET_ENDIAN 0x01020304
+#define DATASET_ALIGN 4096
+
+
+/*  DatasetHeader
+ */
+typedef struct _DatasetHeader {
+    char magic[4];              /* DATASET_MAGIC */
+    uint32_t version;           /* DATASET_VERSION */
+    uint32_t endian;            /* DATASET_ENDIAN */
+    uint32_t realsize;          /* sizeof(nn_real) */
+    uint32_t align;             /* DATASET_ALIGN */
+    uint32_t nsamples;          /* Num. of Samples */
+    uint32_t ninputs;           /* Num. of inputs per Sample */
+    uint32_t nlabels;           /* Num. of one-hot targets (0: labels only) */
+    uint64_t inputs;            /* File offset of the inputs */
+    uint64_t targets;           /* File offset of the targets */
+    uint64_t labels;            /* File offset of the labels */
+} DatasetHeader;
+
+
+/*  Dataset
+ */
+typedef struct _Dataset {
+    int nsamples;               /* Num. of Samples */
+    int ninputs;                /* Num. of inputs per Sample */
+    int nlabels;                /* Num. of one-hot targets (or 0) */
+    const nn_real* inputs;      /* Inputs (nsamples x ninputs) */
+    const nn_real* targets;     /* One-hot targets (nsamples x nlabels) */
+    const uint32_t* labels;     /* Label of each Sample */
+    void* map;                  /* Mapped file */
+    size_t size;                /* Size of the mapped file */
+} Dataset;
+
+/* DatasetGet(ctx, i, x)
+   Stores the inputs of the i-th Sample into x
+   and returns its label.
+*/
+typedef uint32_t (*DatasetGet)(void* ctx, int i, nn_real* x);
+
+/* Dataset_save(path, nsamples, ninputs, nlabels, get, ctx)
+   Writes nsamples Samples obtained from get() to a file, one at
+   a time. If nlabels > 0, the one-hot targets are also written.
+   The file is replaced only when complete. Returns 0 on success.
+*/
+int Dataset_save(
+    const char* path, int nsamples, int ninputs, int nlabels,
+    DatasetGet get, void* ctx);
+
+/* Dataset_load(path)
+   Maps a file. The arrays point into the (shared, read-only)
+   mapping: batches of consecutive Samples can be passed to
+   Layer_setInputsBatch() as they are.
+   Returns NULL on failure (or if nn_real differs).
+*/
+Dataset* Dataset_load(const char* path);
+
+/* Dataset_isNewer(path, src)
+   Returns 1 if the file path exists and is newer than src.
+*/
+int Dataset_isNewer(const char* path, const char* src);
+
+/* Dataset_destroy(self)
+   Unmaps the file.
+*/
+void Dataset_destroy(Dataset* self);
@@ -0,0 +1,103 @@
+/*
+  gemm.c
+  Blocked matrix multiplication.
+
+  The operands are split into blocks that fit in the cache
+  (MC x KC for A, KC x NC for B). Each block is packed into
+  a contiguous buffer, and the product is computed by a
+  micro kernel that keeps an (MR x NR) tile of C in registers.
+  The micro kernel and NR come from simd.c.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include "cnn.h"
+#include "gemm.h"
+#include "simd.h"
+
+#define GEMM_MC 64
+#define GEMM_KC 128
+#define GEMM_NC 256
+#define GEMM_MR SIMD_MR
+
+
+/* gemm_packA(mc, kc, a, rsa, csa, pa)
+   Packs an (mc x kc) block of A into MR-row panels.
+*/
+static void gemm_packA(
+    int mc, int kc, const nn_real* a, int rsa, int csa, nn_real* pa)
+{
+    for (int i = 0; i < mc; i += GEMM_MR) {
+        int mr = (mc-i < GEMM_MR)? (mc-i) : GEMM_MR;
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < mr; r++) {
+                *pa++ = a[(i+r)*rsa + p*csa];
+            }
+            for (int r = mr; r < GEMM_MR; r++) {
+                *pa++ = 0;
+            }
+        }
+    }
+}
+
+/* gemm_packB(kc, nc, nr, b, rsb, csb, pb)
+   Packs a (kc x nc) block of B into nr-column panels.
+*/
+static void gemm_packB(
+    int kc, int nc, int nr, const nn_real* b, int rsb, int csb, nn_real* pb)
+{
+    for (int j = 0; j < nc; j += nr) {
+        int n = (nc-j < nr)? (nc-j) : nr;
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < n; r++) {
+                *pb++ = b[p*rsb + (j+r)*csb];
+            }
+            for (int r = n; r < nr; r++) {
+                *pb++ = 0;
+            }
+        }
+    }
+}
+
+/* gemm(m, n, k, a, rsa, csa, b, rsb, csb, c, rsc, csc)
+   Computes C += A * B.
+*/
+void gemm(
+    int m, int n, int k,
+    const nn_real* a, int rsa, int csa,
+    const nn_real* b, int rsb, int csb,
+    nn_real* c, int rsc, int csc)
+{
+    assert (0 <= m && 0 <= n && 0 <= k);
+    nn_real pa[GEMM_MC * GEMM_KC];
+    nn_real pb[GEMM_KC * GEMM_NC];
+    nn_real tile[GEMM_MR * SIMD_MAXNR];
+    int nr = simd_nr;
+    assert ((GEMM_NC % nr) == 0);
+
+    for (int jc = 0; jc < n; jc += GEMM_NC) {
+        int nc = (n-jc < GEMM_NC)? (n-jc) : GEMM_NC;
+        for (int pc = 0; pc < k; pc += GEMM_KC) {
+            int kc = (k-pc < GEMM_KC)? (k-pc) : GEMM_KC;
+            gemm_packB(kc, nc, nr, &b[pc*rsb + jc*csb], rsb, csb, pb);
+            for (int ic = 0; ic < m; ic += GEMM_MC) {
+                int mc = (m-ic < GEMM_MC)? (m-ic) : GEMM_MC;
+                gemm_packA(mc, kc, &a[ic*rsa + pc*csa], rsa, csa, pa);
+                /* Run the micro kernel over the block. */
+                for (int jr = 0; jr < nc; jr += nr) {
+                    int nj = (nc-jr < nr)? (nc-jr) : nr;
+                    for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                        int ni = (mc-ir < GEMM_MR)? (mc-ir) : GEMM_MR;
+                        simd_kernel(kc, &pa[ir*kc], &pb[jr*kc], tile);
+                        nn_real* cp = &c[(ic+ir)*rsc + (jc+jr)*csc];
+                        for (int i = 0; i < ni; i++) {
+                            for (int j = 0; j < nj; j++) {
+                                cp[i*rsc + j*csc] += tile[i*nr + j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,20 @@
+/*
+  gemm.h
+  Blocked matrix multiplication.
+  Operates on nn_real (cnn.h).
+*/
+
+
+/* gemm(m, n, k, a, rsa, csa, b, rsb, csb, c, rsc, csc)
+   Computes C += A * B, where A is (m x k) and B is (k x n).
+   Elements are addressed by strides so that transposed operands
+   need no copy:
+     A(i,p) = a[i*rsa + p*csa]
+     B(p,j) = b[p*rsb + j*csb]
+     C(i,j) = c[i*rsc + j*csc]
+*/
+void gemm(
+    int m, int n, int k,
+    const nn_real* a, int rsa, int csa,
+    const nn_real* b, int rsb, int csb,
+    nn_real* c, int rsc, int csc);
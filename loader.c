@@ -0,0 +1,239 @@
+/*
+  loader.c
+  Prefetching minibatches with background threads.
+
+  Every loader thread owns a ring of minibatch slots that only it
+  fills and only the consumer empties (single producer, single
+  consumer). The k-th loader fetches the minibatches k, k+n,
+  k+2n, ... and the consumer visits the rings in turn, so the
+  order only depends on the seq numbers. The slots are handed
+  over with two semaphores per ring, which are atomic counters
+  that only enter the kernel when one side has to sleep.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "cnn.h"
+#include "loader.h"
+
+#define DEBUG_LOADER 0
+
+
+/*  LoaderRing
+ */
+typedef struct _LoaderRing {
+
+    Loader* loader;
+    int id;                     /* Loader id */
+    pthread_t thread;           /* Loader thread */
+    nn_real* x;                 /* Inputs (nslots x nbatch x nx) */
+    nn_real* y;                 /* Targets (nslots x nbatch x ny) */
+    sem_t filled;               /* Num. of filled slots */
+    sem_t freed;                /* Num. of free slots */
+
+    /* Written by the loader only. */
+    atomic_long nfulls;
+    atomic_long fetching;       /* in nsec */
+
+} LoaderRing;
+
+/*  Loader
+ */
+struct _Loader {
+
+    LoaderFetch fetch;
+    void* ctx;
+    int nthreads;               /* Num. of loader threads */
+    int nslots;                 /* Num. of slots per ring */
+    int nbatch;                 /* Num. of samples per minibatch */
+    int nx, ny;                 /* Num. of inputs/targets per sample */
+    long total;                 /* Num. of minibatches to fetch */
+    LoaderRing* rings;          /* Ring of each thread */
+    atomic_int quit;
+
+    /* Consumer */
+    long seq;                   /* Current minibatch */
+    int busy;                   /* Current minibatch is in use */
+    long nstalls;
+    double stalled;
+};
+
+/* loader_time(): monotonic time in nsec. */
+static long loader_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* sem_take(sem): waits on sem (retrying on signals). */
+static void sem_take(sem_t* sem)
+{
+    while (sem_wait(sem) != 0);
+}
+
+/* Loader_worker(arg)
+   Loader thread main loop.
+*/
+static void* Loader_worker(void* arg)
+{
+    LoaderRing* ring = (LoaderRing*)arg;
+    Loader* self = ring->loader;
+    size_t nx = (size_t)self->nbatch * self->nx;
+    size_t ny = (size_t)self->nbatch * self->ny;
+
+    int slot = 0;
+    for (long seq = ring->id; seq < self->total; seq += self->nthreads) {
+        if (sem_trywait(&ring->freed) != 0) {
+            /* The consumer is behind. */
+            atomic_fetch_add(&ring->nfulls, 1);
+            sem_take(&ring->freed);
+        }
+        if (atomic_load(&self->quit)) break;
+        long t0 = loader_time();
+        self->fetch(self->ctx, ring->id, seq,
+                    &ring->x[slot * nx], &ring->y[slot * ny], self->nbatch);
+        atomic_fetch_add(&ring->fetching, loader_time() - t0);
+        sem_post(&ring->filled);
+        slot = (slot+1) % self->nslots;
+    }
+    return NULL;
+}
+
+/* Loader_create(fetch, ctx, nthreads, nslots, nbatch, nx, ny, total)
+   Starts the loader threads.
+*/
+Loader* Loader_create(
+    LoaderFetch fetch, void* ctx, int nthreads, int nslots,
+    int nbatch, int nx, int ny, long total)
+{
+    assert (fetch != NULL);
+    assert (0 < nthreads);
+    assert (0 < nslots);
+    assert (0 < nbatch);
+    assert (0 < nx);
+    assert (0 < ny);
+    assert (0 <= total);
+
+    Loader* self = (Loader*)calloc(1, sizeof(Loader));
+    if (self == NULL) return NULL;
+    self->fetch = fetch;
+    self->ctx = ctx;
+    self->nthreads = nthreads;
+    self->nslots = nslots;
+    self->nbatch = nbatch;
+    self->nx = nx;
+    self->ny = ny;
+    self->total = total;
+    atomic_init(&self->quit, 0);
+    self->rings = (LoaderRing*)calloc(nthreads, sizeof(LoaderRing));
+
+    for (int id = 0; id < nthreads; id++) {
+        LoaderRing* ring = &self->rings[id];
+        ring->loader = self;
+        ring->id = id;
+        ring->x = (nn_real*)calloc((size_t)nslots * nbatch * nx, sizeof(nn_real));
+        ring->y = (nn_real*)calloc((size_t)nslots * nbatch * ny, sizeof(nn_real));
+        assert (ring->x != NULL && ring->y != NULL);
+        sem_init(&ring->filled, 0, 0);
+        sem_init(&ring->freed, 0, nslots);
+        atomic_init(&ring->nfulls, 0);
+        atomic_init(&ring->fetching, 0);
+    }
+    for (int id = 0; id < nthreads; id++) {
+        LoaderRing* ring = &self->rings[id];
+        pthread_create(&ring->thread, NULL, Loader_worker, ring);
+    }
+
+#if DEBUG_LOADER
+    fprintf(stderr, "Loader_create: nthreads=%d, nslots=%d, nbatch=%d, total=%ld\n",
+            nthreads, nslots, nbatch, total);
+#endif
+    return self;
+}
+
+/* Loader_destroy(self)
+   Stops the threads and releases the rings.
+*/
+void Loader_destroy(Loader* self)
+{
+    assert (self != NULL);
+
+    /* Wake up the loaders waiting for a free slot. */
+    atomic_store(&self->quit, 1);
+    for (int id = 0; id < self->nthreads; id++) {
+        sem_post(&self->rings[id].freed);
+    }
+    for (int id = 0; id < self->nthreads; id++) {
+        LoaderRing* ring = &self->rings[id];
+        pthread_join(ring->thread, NULL);
+        sem_destroy(&ring->filled);
+        sem_destroy(&ring->freed);
+        free(ring->x);
+        free(ring->y);
+    }
+    free(self->rings);
+    free(self);
+}
+
+/* Loader_next(self, x, y)
+   Waits for the next minibatch.
+*/
+void Loader_next(Loader* self, const nn_real** x, const nn_real** y)
+{
+    assert (self != NULL);
+    assert (!self->busy);
+    assert (self->seq < self->total);
+
+    LoaderRing* ring = &self->rings[self->seq % self->nthreads];
+    if (sem_trywait(&ring->filled) != 0) {
+        /* Stall: the loader is behind. */
+        long t0 = loader_time();
+        sem_take(&ring->filled);
+        self->nstalls++;
+        self->stalled += (loader_time() - t0) * 1e-9;
+    }
+    int slot = (self->seq / self->nthreads) % self->nslots;
+    *x = &ring->x[(size_t)slot * self->nbatch * self->nx];
+    *y = &ring->y[(size_t)slot * self->nbatch * self->ny];
+    self->busy = 1;
+}
+
+/* Loader_release(self)
+   Returns the current minibatch to its loader.
+*/
+void Loader_release(Loader* self)
+{
+    assert (self != NULL);
+    assert (self->busy);
+
+    LoaderRing* ring = &self->rings[self->seq % self->nthreads];
+    sem_post(&ring->freed);
+    self->busy = 0;
+    self->seq++;
+}
+
+/* Loader_getStats(self, stats)
+   Gets the counters.
+*/
+void Loader_getStats(Loader* self, LoaderStats* stats)
+{
+    assert (self != NULL);
+    assert (stats != NULL);
+
+    stats->nbatches = self->seq;
+    stats->nstalls = self->nstalls;
+    stats->stalled = self->stalled;
+    stats->nfulls = 0;
+    stats->fetching = 0;
+    for (int id = 0; id < self->nthreads; id++) {
+        LoaderRing* ring = &self->rings[id];
+        stats->nfulls += atomic_load(&ring->nfulls);
+        stats->fetching += atomic_load(&ring->fetching) * 1e-9;
+    }
+}
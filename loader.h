@@ -0,0 +1,59 @@
+/*
+  loader.h
+  Prefetching minibatches with background threads.
+  Requires cnn.h.
+*/
+
+
+/* LoaderFetch(ctx, id, seq, x, y, nbatch)
+   Fills x and y with the seq-th minibatch (nbatch samples)
+   for loader thread id. Called from several threads at once.
+*/
+typedef void (*LoaderFetch)(
+    void* ctx, int id, long seq, nn_real* x, nn_real* y, int nbatch);
+
+
+/*  LoaderStats
+ */
+typedef struct _LoaderStats {
+    long nbatches;              /* Num. of minibatches consumed */
+    long nstalls;               /* Num. of times the consumer found no minibatch */
+    double stalled;             /* Time the consumer waited (sec) */
+    long nfulls;                /* Num. of times a loader found no free slot */
+    double fetching;            /* Time spent in fetch (sec, all loaders) */
+} LoaderStats;
+
+/*  Loader
+ */
+typedef struct _Loader Loader;
+
+/* Loader_create(fetch, ctx, nthreads, nslots, nbatch, nx, ny, total)
+   Starts nthreads loader threads that fill rings of nslots
+   minibatches each, until total minibatches are fetched.
+   x is (nbatch x nx) and y is (nbatch x ny).
+*/
+Loader* Loader_create(
+    LoaderFetch fetch, void* ctx, int nthreads, int nslots,
+    int nbatch, int nx, int ny, long total);
+
+/* Loader_destroy(self)
+   Stops the threads and releases the rings.
+*/
+void Loader_destroy(Loader* self);
+
+/* Loader_next(self, x, y)
+   Waits for the next minibatch and sets x and y to it.
+   Minibatches come in order of seq. They stay valid until
+   Loader_release() is called.
+*/
+void Loader_next(Loader* self, const nn_real** x, const nn_real** y);
+
+/* Loader_release(self)
+   Returns the current minibatch to its loader.
+*/
+void Loader_release(Loader* self);
+
+/* Loader_getStats(self, stats)
+   Gets the counters.
+*/
+void Loader_getStats(Loader* self, LoaderStats* stats);
@@ -2,7 +2,30 @@
   mnist.c
 
   Usage:
-  $ ./mnist train-images train-labels test-images test-labels
+  $ ./mnist [options] train-images train-labels test-images test-labels
+
+  Options:
+  -c conv     convolution algorithm (direct, gemm, winograd)
+  -f layout   conv activation layout (nchw, nhwc; nhwc uses gemm)
+  -b batch    minibatch size (default: 32)
+  -s isa      force the SIMD kernels (scalar, sse2, avx2, avx512)
+  -t threads  num. of training threads (default: 1)
+  -m mode     training mode (sync, hogwild)
+  -p loaders  num. of prefetching threads (default: 0, sync mode only)
+  -x order    sample order (perm, block; default: perm)
+  -a kinds    augment the training samples (shift, rotate, elastic,
+              noise or all; comma separated) in the loaders (sync mode
+              only; starts one loader if -p is not given)
+  -e epochs   epochs to augment, e.g. 0-3,6,8- (default: all)
+  -u optim    optimizer (sgd, momentum, nesterov, adam; sync mode only)
+  -r rate     learning rate (default: 0.1 for sgd, 0.01 for momentum
+              and nesterov, 0.001 for adam)
+  -w steps    learning rate warmup steps (default: 0, sync mode only)
+  -o model    save the trained model
+  -l model    load a model instead of training
+  -d dir      cache the normalized samples in dir (train.fNN, test.fNN);
+              converted again when older than the IDX files
+  -q          also test the int8 quantized network
 */
 
 #include <assert.h>
@@ -11,7 +34,21 @@
 #include <stdint.h>
 #include <endian.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cnn.h"
+#include "augment.h"
+#include "dataset.h"
+#include "loader.h"
+#include "model.h"
+#include "optim.h"
+#include "qnn.h"
+#include "shuffle.h"
+#include "simd.h"
+#include "train.h"
 
 
 /*  IdxFile
@@ -20,63 +57,13 @@ typedef struct _IdxFile
 {
     int ndims;
     uint32_t* dims;
-    uint8_t* data;
+    const uint8_t* data;
+    void* map;                  /* Mapped file */
+    size_t size;                /* Size of the mapped file */
 } IdxFile;
 
 #define DEBUG_IDXFILE 0
 
-/* IdxFile_read(fp)
-   Reads all the data from given fp.
-*/
-IdxFile* IdxFile_read(FILE* fp)
-{
-    /* Read the file header. */
-    struct {
-        uint16_t magic;
-        uint8_t type;
-        uint8_t ndims;
-        /* big endian */
-    } header;
-    if (fread(&header, sizeof(header), 1, fp) != 1) return NULL;
-#if DEBUG_IDXFILE
-    fprintf(stderr, "IdxFile_read: magic=%x, type=%x, ndims=%u\n",
-            header.magic, header.type, header.ndims);
-#endif
-    if (header.magic != 0) return NULL;
-    if (header.type != 0x08) return NULL;
-    if (header.ndims < 1) return NULL;
-
-    /* Read the dimensions. */
-    IdxFile* self = (IdxFile*)calloc(1, sizeof(IdxFile));
-    if (self == NULL) return NULL;
-    self->ndims = header.ndims;
-    self->dims = (uint32_t*)calloc(self->ndims, sizeof(uint32_t));
-    if (self->dims == NULL) return NULL;
-    
-    if (fread(self->dims, sizeof(uint32_t), self->ndims, fp) == self->ndims) {
-        uint32_t nbytes = sizeof(uint8_t);
-        for (int i = 0; i < self->ndims; i++) {
-            /* Fix the byte order. */
-            uint32_t size = be32toh(self->dims[i]);
-#if DEBUG_IDXFILE
-            fprintf(stderr, "IdxFile_read: size[%d]=%u\n", i, size);
-#endif
-            nbytes *= size;
-            self->dims[i] = size;
-        }
-        /* Read the data. */
-        self->data = (uint8_t*) malloc(nbytes);
-        if (self->data != NULL) {
-            fread(self->data, sizeof(uint8_t), nbytes, fp);
-#if DEBUG_IDXFILE
-            fprintf(stderr, "IdxFile_read: read: %lu bytes\n", n);
-#endif
-        }
-    }
-
-    return self;
-}
-
 /* IdxFile_destroy(self)
    Release the memory.
 */
@@ -87,13 +74,71 @@ void IdxFile_destroy(IdxFile* self)
         free(self->dims);
         self->dims = NULL;
     }
-    if (self->data != NULL) {
-        free(self->data);
-        self->data = NULL;
+    if (self->map != NULL) {
+        munmap(self->map, self->size);
     }
     free(self);
 }
 
+/* IdxFile_open(path)
+   Maps a file and checks its header against the file size.
+   The data is read from the (shared) page cache as needed.
+*/
+IdxFile* IdxFile_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 4) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    IdxFile* self = (IdxFile*)calloc(1, sizeof(IdxFile));
+    if (self == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    self->map = map;
+    self->size = st.st_size;
+
+    /* Check the header: magic (0), type (0x08), ndims. */
+    const uint8_t* header = (const uint8_t*)map;
+    size_t offset = 4 + 4 * (size_t)header[3];
+    if (header[0] != 0 || header[1] != 0 || header[2] != 0x08 ||
+        header[3] < 1 || self->size < offset) {
+        IdxFile_destroy(self);
+        return NULL;
+    }
+    self->ndims = header[3];
+    self->dims = (uint32_t*)calloc(self->ndims, sizeof(uint32_t));
+    if (self->dims == NULL) {
+        IdxFile_destroy(self);
+        return NULL;
+    }
+    /* The data must fit in the rest of the file. */
+    uint64_t nbytes = 1;
+    for (int i = 0; i < self->ndims; i++) {
+        uint32_t size;
+        memcpy(&size, &header[4 + 4*i], sizeof(size));
+        self->dims[i] = be32toh(size);
+        nbytes *= self->dims[i];
+        if (self->size - offset < nbytes) {
+            IdxFile_destroy(self);
+            return NULL;
+        }
+    }
+    self->data = &header[offset];
+#if DEBUG_IDXFILE
+    fprintf(stderr, "IdxFile_open: %s: ndims=%d, nbytes=%lu\n",
+            path, self->ndims, (unsigned long)nbytes);
+#endif
+    return self;
+}
+
 /* IdxFile_get1(self, i)
    Get the i-th record of the Idx1 file. (uint8_t)
  */
@@ -105,175 +150,737 @@ uint8_t IdxFile_get1(IdxFile* self, int i)
     return self->data[i];
 }
 
-/* IdxFile_get3(self, i, out)
-   Get the i-th record of the Idx3 file. (matrix of uint8_t)
+/* IdxFile_record(self, i)
+   Returns the i-th record without copying.
  */
-void IdxFile_get3(IdxFile* self, int i, uint8_t* out)
+const uint8_t* IdxFile_record(const IdxFile* self, int i)
 {
     assert (self != NULL);
-    assert (self->ndims == 3);
     assert (i < self->dims[0]);
-    size_t n = self->dims[1] * self->dims[2];
-    memcpy(out, &self->data[i*n], n);
+    size_t n = 1;
+    for (int k = 1; k < self->ndims; k++) {
+        n *= self->dims[k];
+    }
+    return &self->data[i*n];
+}
+
+
+/* parse_epochs(spec, epochs)
+   Parses a comma separated list of epochs (e) or ranges (e0-e1,
+   e0-) into bits. Returns 0 on success.
+*/
+static int parse_epochs(const char* spec, uint64_t* epochs)
+{
+    *epochs = 0;
+    while (*spec != '\0') {
+        char* end;
+        long e0 = strtol(spec, &end, 10);
+        if (end == spec || e0 < 0 || 63 < e0) return -1;
+        long e1 = e0;
+        if (*end == '-') {
+            spec = end+1;
+            e1 = strtol(spec, &end, 10);
+            if (end == spec) { e1 = 63; }
+            if (e1 < e0 || 63 < e1) return -1;
+        }
+        for (long e = e0; e <= e1; e++) {
+            *epochs |= (uint64_t)1 << e;
+        }
+        if (*end == ',') { end++; }
+        else if (*end != '\0') return -1;
+        spec = end;
+    }
+    return 0;
+}
+
+/* gettime(): monotonic time in seconds. */
+static double gettime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*  SamplerThread
+ */
+typedef struct _SamplerThread
+{
+    Shuffler* shuffler;         /* Sample order */
+    long cursor;                /* Position */
+    nn_real* work;              /* Augment work buffer */
+    long naugmented;            /* Num. of samples augmented */
+    double augtime;             /* Time spent augmenting (sec) */
+} SamplerThread;
+
+/*  Sampler
+ */
+typedef struct _Sampler
+{
+    IdxFile* images;
+    IdxFile* labels;
+    Dataset* cache;             /* Normalized samples (or NULL) */
+    int size;                   /* Num. of samples */
+    int nthreads;               /* Num. of fetching threads */
+    SamplerThread* threads;     /* State of each thread */
+    const Augment* augment;     /* Distortions (or NULL) */
+    uint64_t augepochs;         /* Epochs to augment (bit e, e < 64) */
+} Sampler;
+
+/* Sampler_load(ctx, i, x)
+   Stores the normalized i-th image into x and returns its label.
+   (DatasetGet)
+*/
+static uint32_t Sampler_load(void* ctx, int i, nn_real* x)
+{
+    Sampler* self = (Sampler*)ctx;
+    if (self->cache != NULL) {
+        memcpy(x, &self->cache->inputs[i * 28*28], 28*28 * sizeof(nn_real));
+        return self->cache->labels[i];
+    }
+    const uint8_t* img = IdxFile_record(self->images, i);
+    for (int j = 0; j < 28*28; j++) {
+        x[j] = img[j]/(nn_real)255;
+    }
+    return IdxFile_get1(self->labels, i);
+}
+
+/* Sampler_open(self, images, labels, cache)
+   Opens the IDX files. If cache is given, the samples are read
+   from it instead, after converting them when it is older than
+   the IDX files. Returns 0 on success.
+*/
+static int Sampler_open(
+    Sampler* self, const char* images, const char* labels, const char* cache)
+{
+    memset(self, 0, sizeof(Sampler));
+    if (cache != NULL &&
+        Dataset_isNewer(cache, images) && Dataset_isNewer(cache, labels)) {
+        self->cache = Dataset_load(cache);
+        if (self->cache != NULL &&
+            self->cache->ninputs == 28*28 && self->cache->nlabels == 10) {
+            self->size = self->cache->nsamples;
+            return 0;
+        }
+        if (self->cache != NULL) {
+            Dataset_destroy(self->cache);
+            self->cache = NULL;
+        }
+    }
+    self->images = IdxFile_open(images);
+    self->labels = IdxFile_open(labels);
+    if (self->images == NULL || self->images->ndims != 3 ||
+        self->labels == NULL || self->labels->ndims != 1 ||
+        self->images->dims[0] != self->labels->dims[0] ||
+        self->images->dims[1] * self->images->dims[2] != 28*28) return -1;
+    self->size = self->images->dims[0];
+
+    if (cache != NULL) {
+        fprintf(stderr, "converting: %s\n", cache);
+        if (Dataset_save(cache, self->size, 28*28, 10, Sampler_load, self) != 0) {
+            /* Go on with the IDX files. */
+            fprintf(stderr, "%s: cannot save\n", cache);
+            return 0;
+        }
+        self->cache = Dataset_load(cache);
+        if (self->cache != NULL) {
+            IdxFile_destroy(self->images);
+            IdxFile_destroy(self->labels);
+            self->images = NULL;
+            self->labels = NULL;
+        }
+    }
+    return 0;
+}
+
+/* Sampler_close(self)
+   Releases the files.
+*/
+static void Sampler_close(Sampler* self)
+{
+    if (self->images != NULL) {
+        IdxFile_destroy(self->images);
+    }
+    if (self->labels != NULL) {
+        IdxFile_destroy(self->labels);
+    }
+    if (self->cache != NULL) {
+        Dataset_destroy(self->cache);
+    }
+    for (int id = 0; id < self->nthreads; id++) {
+        Shuffler_destroy(self->threads[id].shuffler);
+        free(self->threads[id].work);
+    }
+    free(self->threads);
+    memset(self, 0, sizeof(Sampler));
+}
+
+/* Sampler_shuffle(self, nthreads, mode, blocksize, seeds)
+   Sets up the sample order of each thread.
+   The threads with the same seed share one sequence.
+*/
+static void Sampler_shuffle(
+    Sampler* self, int nthreads, ShuffleMode mode, int blocksize,
+    const uint64_t* seeds)
+{
+    assert (self->threads == NULL);
+    self->nthreads = nthreads;
+    self->threads = (SamplerThread*)calloc(nthreads, sizeof(SamplerThread));
+    for (int id = 0; id < nthreads; id++) {
+        self->threads[id].shuffler = Shuffler_create(
+            self->size, mode, blocksize, seeds[id]);
+    }
+}
+
+/* Sampler_setAugment(self, augment, epochs)
+   Distorts the training samples of the given epochs.
+*/
+static void Sampler_setAugment(
+    Sampler* self, const Augment* augment, uint64_t epochs)
+{
+    assert (self->threads != NULL);
+    self->augment = augment;
+    self->augepochs = epochs;
+    for (int id = 0; id < self->nthreads; id++) {
+        self->threads[id].work = (nn_real*)calloc(
+            Augment_getWorkSize(augment), sizeof(nn_real));
+    }
+}
+
+/* Sampler_pick(self, index, x, y)
+   Stores the index-th sample into x and y.
+*/
+static void Sampler_pick(Sampler* self, int index, nn_real* x, nn_real* y)
+{
+    if (self->cache != NULL) {
+        /* Already converted. */
+        memcpy(x, &self->cache->inputs[index * 28*28], 28*28 * sizeof(nn_real));
+        memcpy(y, &self->cache->targets[index * 10], 10 * sizeof(nn_real));
+        return;
+    }
+    int label = Sampler_load(self, index, x);
+    for (int j = 0; j < 10; j++) {
+        y[j] = (j == label)? 1 : 0;
+    }
+}
+
+/* Sampler_next(self, id, i, x, y)
+   Stores the i-th sample in the sequence of thread id into x and y,
+   distorted if its epoch is to be augmented.
+*/
+static void Sampler_next(Sampler* self, int id, long i, nn_real* x, nn_real* y)
+{
+    SamplerThread* thread = &self->threads[id];
+    Sampler_pick(self, Shuffler_get(thread->shuffler, i), x, y);
+    long epoch = i / self->size;
+    if (self->augment != NULL && epoch < 64 &&
+        ((self->augepochs >> epoch) & 1)) {
+        /* The distortion only depends on the position. */
+        double t0 = gettime();
+        Augment_apply(self->augment, thread->shuffler->seed ^ ~(uint64_t)i,
+                      x, thread->work);
+        thread->augtime += gettime() - t0;
+        thread->naugmented++;
+    }
+}
+
+/* Sampler_fetch(ctx, id, x, y, nbatch)
+   Picks the next nbatch samples of thread id.
+   (TrainerFetch)
+*/
+static void Sampler_fetch(
+    void* ctx, int id, nn_real* x, nn_real* y, int nbatch)
+{
+    Sampler* self = (Sampler*)ctx;
+    for (int k = 0; k < nbatch; k++) {
+        Sampler_next(self, id, self->threads[id].cursor++,
+                     &x[k*28*28], &y[k*10]);
+    }
+}
+
+/* Sampler_fetchBatch(ctx, id, seq, x, y, nbatch)
+   Picks the seq-th minibatch for loader id.
+   (LoaderFetch)
+*/
+static void Sampler_fetchBatch(
+    void* ctx, int id, long seq, nn_real* x, nn_real* y, int nbatch)
+{
+    Sampler* self = (Sampler*)ctx;
+    for (int k = 0; k < nbatch; k++) {
+        Sampler_next(self, id, seq * nbatch + k, &x[k*28*28], &y[k*10]);
+    }
+}
+
+
+/* test(linput, loutput, qnet, data, batch_size)
+   Returns the number of correctly classified images.
+   Uses qnet if given.
+*/
+static int test(
+    Layer* linput, Layer* loutput, QNet* qnet,
+    Sampler* data, int batch_size)
+{
+    nn_real* x = (nn_real*)calloc(batch_size * 28*28, sizeof(nn_real));
+    nn_real* y = (nn_real*)calloc(batch_size * 10, sizeof(nn_real));
+    int* labels = (int*)calloc(batch_size, sizeof(int));
+    int ntests = data->size;
+    int ncorrect = 0;
+    for (int i = 0; i < ntests; i += batch_size) {
+        int n = (ntests-i < batch_size)? (ntests-i) : batch_size;
+        const nn_real* inputs = x;
+        if (data->cache != NULL) {
+            /* Consecutive samples are used as they are. */
+            inputs = &data->cache->inputs[i * 28*28];
+            for (int k = 0; k < n; k++) {
+                labels[k] = data->cache->labels[i+k];
+            }
+        } else {
+            for (int k = 0; k < n; k++) {
+                labels[k] = Sampler_load(data, i+k, &x[k*28*28]);
+            }
+        }
+        if (qnet != NULL) {
+            QNet_setInputsBatch(qnet, inputs, n);
+            QNet_getOutputs(qnet, y);
+        } else {
+            Layer_setInputsBatch(linput, inputs, n);
+            Layer_getOutputs(loutput, y);
+        }
+        for (int k = 0; k < n; k++) {
+            int label = labels[k];
+            /* Pick the most probable label. */
+            int mj = -1;
+            for (int j = 0; j < 10; j++) {
+                if (mj < 0 || y[k*10+mj] < y[k*10+j]) {
+                    mj = j;
+                }
+            }
+            if (mj == label) {
+                ncorrect++;
+            }
+        }
+        if ((i % 1000) < batch_size) {
+            fprintf(stderr, "i=%d\n", i);
+        }
+    }
+    free(x);
+    free(y);
+    free(labels);
+    return ncorrect;
 }
 
 
 /* main */
 int main(int argc, char* argv[])
 {
-    /* argv[1] = train images */
-    /* argv[2] = train labels */
-    /* argv[3] = test images */
-    /* argv[4] = test labels */
+    int algo = -1;
+    ConvLayout layout = CONV_NCHW;
+    int batch_size = 32;
+    int nthreads = 1;
+    int hogwild = 0;
+    int nloaders = 0;
+    ShuffleMode order = SHUFFLE_FULL;
+    const char* augkinds = NULL;
+    uint64_t augepochs = ~(uint64_t)0;
+    const char* model_out = NULL;
+    const char* model_in = NULL;
+    const char* cache_dir = NULL;
+    int quantized = 0;
+    OptimType otype = OPTIM_SGD;
+    double rate = 0;
+    int warmup = 0;
+    int c;
+    while ((c = getopt(argc, argv, "c:f:b:s:t:m:p:x:a:e:u:r:w:o:l:d:q")) != -1) {
+        switch (c) {
+        case 'c':
+            if (strcmp(optarg, "direct") == 0) {
+                algo = CONV_DIRECT;
+            } else if (strcmp(optarg, "gemm") == 0) {
+                algo = CONV_GEMM;
+            } else if (strcmp(optarg, "winograd") == 0) {
+                algo = CONV_WINOGRAD;
+            } else {
+                return 100;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "nchw") == 0) {
+                layout = CONV_NCHW;
+            } else if (strcmp(optarg, "nhwc") == 0) {
+                layout = CONV_NHWC;
+            } else {
+                return 100;
+            }
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size <= 0) return 100;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads <= 0) return 100;
+            break;
+        case 'm':
+            if (strcmp(optarg, "sync") == 0) {
+                hogwild = 0;
+            } else if (strcmp(optarg, "hogwild") == 0) {
+                hogwild = 1;
+            } else {
+                return 100;
+            }
+            break;
+        case 'p':
+            nloaders = atoi(optarg);
+            if (nloaders < 0) return 100;
+            break;
+        case 'x':
+            if (strcmp(optarg, "perm") == 0) {
+                order = SHUFFLE_FULL;
+            } else if (strcmp(optarg, "block") == 0) {
+                order = SHUFFLE_BLOCK;
+            } else {
+                return 100;
+            }
+            break;
+        case 'a':
+            augkinds = optarg;
+            break;
+        case 'e':
+            if (parse_epochs(optarg, &augepochs) != 0) return 100;
+            break;
+        case 'u':
+            if (strcmp(optarg, "sgd") == 0) {
+                otype = OPTIM_SGD;
+            } else if (strcmp(optarg, "momentum") == 0) {
+                otype = OPTIM_MOMENTUM;
+            } else if (strcmp(optarg, "nesterov") == 0) {
+                otype = OPTIM_NESTEROV;
+            } else if (strcmp(optarg, "adam") == 0) {
+                otype = OPTIM_ADAM;
+            } else {
+                return 100;
+            }
+            break;
+        case 'r':
+            rate = atof(optarg);
+            if (rate <= 0) return 100;
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            if (warmup < 0) return 100;
+            break;
+        case 'o':
+            model_out = optarg;
+            break;
+        case 'l':
+            model_in = optarg;
+            break;
+        case 'd':
+            cache_dir = optarg;
+            break;
+        case 'q':
+            quantized = 1;
+            break;
+        case 's':
+            {
+                SimdLevel level = SIMD_SCALAR;
+                while (strcmp(optarg, simd_name(level)) != 0) {
+                    if (level == SIMD_AVX512) return 100;
+                    level++;
+                }
+                if (!simd_setLevel(level)) {
+                    fprintf(stderr, "%s: not supported\n", optarg);
+                    return 100;
+                }
+            }
+            break;
+        default:
+            return 100;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    /* argv[0] = train images */
+    /* argv[1] = train labels */
+    /* argv[2] = test images */
+    /* argv[3] = test labels */
     if (argc < 4) return 100;
+    /* Hogwild only runs plain SGD at a fixed rate, fetching
+       the samples itself. */
+    if (hogwild && otype != OPTIM_SGD) {
+        fprintf(stderr, "-u: sync mode only\n");
+        return 100;
+    }
+    if (hogwild && warmup != 0) {
+        fprintf(stderr, "-w: sync mode only\n");
+        return 100;
+    }
+    if (hogwild && nloaders != 0) {
+        fprintf(stderr, "-p: sync mode only\n");
+        return 100;
+    }
+    if (augkinds != NULL) {
+        /* Keep the augmentation off the training threads. */
+        if (hogwild) {
+            fprintf(stderr, "-a: sync mode only\n");
+            return 100;
+        }
+        if (nloaders == 0) { nloaders = 1; }
+    }
+    char cache_train[1024], cache_test[1024];
+    if (cache_dir != NULL) {
+        /* One cache per nn_real type. */
+        snprintf(cache_train, sizeof(cache_train), "%s/train.f%zu",
+                 cache_dir, 8*sizeof(nn_real));
+        snprintf(cache_test, sizeof(cache_test), "%s/test.f%zu",
+                 cache_dir, 8*sizeof(nn_real));
+    }
+    fprintf(stderr, "simd=%s\n", simd_name(simd_getLevel()));
 
     /* Use a fixed random seed for debugging. */
     srand(0);
-    /* Initialize layers. */
-    /* Input layer - 1x28x28. */
-    Layer* linput = Layer_create_input(1, 28, 28);
-    /* Conv1 layer - 16x14x14, 3x3 conv, padding=1, stride=2. */
-    /* (14-1)*2+3 < 28+1*2 */
-    Layer* lconv1 = Layer_create_conv(linput, 16, 14, 14, 3, 1, 2, 0.1);
-    /* Conv2 layer - 32x7x7, 3x3 conv, padding=1, stride=2. */
-    /* (7-1)*2+3 < 14+1*2 */
-    Layer* lconv2 = Layer_create_conv(lconv1, 32, 7, 7, 3, 1, 2, 0.1);
-    /* FC1 layer - 200 nodes. */
-    Layer* lfull1 = Layer_create_full(lconv2, 200, 0.1);
-    /* FC2 layer - 200 nodes. */
-    Layer* lfull2 = Layer_create_full(lfull1, 200, 0.1);
-    /* Output layer - 10 nodes. */
-    Layer* loutput = Layer_create_full(lfull2, 10, 0.1);
-
-    /* Read the training images & labels. */
-    IdxFile* images_train = NULL;
-    {
-        FILE* fp = fopen(argv[1], "rb");
-        if (fp == NULL) return 111;
-        images_train = IdxFile_read(fp);
-        if (images_train == NULL) return 111;
-        fclose(fp);
-    }
-    IdxFile* labels_train = NULL;
-    {
-        FILE* fp = fopen(argv[2], "rb");
-        if (fp == NULL) return 111;
-        labels_train = IdxFile_read(fp);
-        if (labels_train == NULL) return 111;
-        fclose(fp);
-    }
-
-    fprintf(stderr, "training...\n");
-    double rate = 0.1;
-    double etotal = 0;
-    int nepoch = 10;
-    int batch_size = 32;
-    int train_size = images_train->dims[0];
-    for (int i = 0; i < nepoch * train_size; i++) {
-        /* Pick a random sample from the training data */
-        uint8_t img[28*28];
-        double x[28*28];
-        double y[10];
-        int index = rand() % train_size;
-        IdxFile_get3(images_train, index, img);
-        for (int j = 0; j < 28*28; j++) {
-            x[j] = img[j]/255.0;
+    Model* model = NULL;
+    Layer* linput = NULL;
+    Layer* loutput = NULL;
+    if (model_in != NULL) {
+        /* Load the layers. */
+        model = Model_load(model_in);
+        if (model == NULL) {
+            fprintf(stderr, "%s: cannot load\n", model_in);
+            return 111;
         }
-        Layer_setInputs(linput, x);
-        Layer_getOutputs(loutput, y);
-        int label = IdxFile_get1(labels_train, index);
-#if 0
-        fprintf(stderr, "label=%u, y=[", label);
-        for (int j = 0; j < 10; j++) {
-            fprintf(stderr, " %.3f", y[j]);
+        linput = model->linput;
+        loutput = model->loutput;
+    } else {
+        /* Initialize layers. */
+        /* Input layer - 1x28x28. */
+        linput = Layer_create_input(1, 28, 28);
+        /* Conv1 layer - 16x14x14, 3x3 conv, padding=1, stride=2. */
+        /* (14-1)*2+3 < 28+1*2 */
+        Layer* lconv1 = Layer_create_conv(linput, 16, 14, 14, 3, 1, 2, 0.1);
+        /* Conv2 layer - 32x7x7, 3x3 conv, padding=1, stride=2. */
+        /* (7-1)*2+3 < 14+1*2 */
+        Layer* lconv2 = Layer_create_conv(lconv1, 32, 7, 7, 3, 1, 2, 0.1);
+        /* FC1 layer - 200 nodes. */
+        Layer* lfull1 = Layer_create_full(lconv2, 200, 0.1);
+        /* FC2 layer - 200 nodes. */
+        Layer* lfull2 = Layer_create_full(lfull1, 200, 0.1);
+        /* Output layer - 10 nodes. */
+        loutput = Layer_create_full(lfull2, 10, 0.1);
+    }
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        if (layer->ltype != LAYER_CONV || algo < 0) continue;
+        /* Winograd only applies to 3x3 kernels with stride 1. */
+        if (algo != CONV_WINOGRAD || layer->conv.nwino != 0) {
+            Layer_setConvAlgo(layer, algo);
         }
-        fprintf(stderr, "]\n");
-#endif
-        for (int j = 0; j < 10; j++) {
-            y[j] = (j == label)? 1 : 0;
+    }
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        if (layer->ltype != LAYER_CONV) continue;
+        Layer_setConvLayout(layer, layout);
+    }
+    /* Put all the buffers in one place. */
+    Arena* arena = Arena_create(linput);
+    fprintf(stderr, "arena: params=%zu, acts=%zu\n",
+            arena->nparams, arena->nacts);
+
+    nn_real* x = (nn_real*)calloc(batch_size * 28*28, sizeof(nn_real));
+    nn_real* y = (nn_real*)calloc(batch_size * 10, sizeof(nn_real));
+    if (model == NULL) {
+        /* Read the training images & labels. */
+        Sampler sampler;
+        if (Sampler_open(&sampler, argv[0], argv[1],
+                         (cache_dir != NULL)? cache_train : NULL) != 0) return 111;
+
+        fprintf(stderr, "training...\n");
+        Trainer* trainer = Trainer_create(linput, nthreads);
+        /* Hogwild threads go through their own sequences, while
+           the loaders share one. */
+        int nseeds = (nthreads < nloaders)? nloaders : nthreads;
+        uint64_t* seeds = (uint64_t*)calloc(nseeds, sizeof(uint64_t));
+        for (int id = 0; id < nseeds; id++) {
+            seeds[id] = hogwild? id : 0;
         }
-        Layer_learnOutputs(loutput, y);
-        etotal += Layer_getErrorTotal(loutput);
-        if ((i % batch_size) == 0) {
-            /* Minibatch: update the network for every n samples. */
-            Layer_update(loutput, rate/batch_size);
+        Sampler_shuffle(&sampler, nseeds, order, 256, seeds);
+        free(seeds);
+        Augment* augment = NULL;
+        if (augkinds != NULL) {
+            /* shift: 2 pixels, rotate: 10 degrees, elastic: alpha=34,
+               sigma=4 (Simard et al.), noise: stddev 0.05. */
+            int all = (strstr(augkinds, "all") != NULL);
+            augment = Augment_create(
+                28, 28,
+                (all || strstr(augkinds, "shift") != NULL)? 2 : 0,
+                (all || strstr(augkinds, "rotate") != NULL)? 10 : 0,
+                (all || strstr(augkinds, "elastic") != NULL)? 34 : 0, 4,
+                (all || strstr(augkinds, "noise") != NULL)? 0.05 : 0);
+            Sampler_setAugment(&sampler, augment, augepochs);
         }
-        if ((i % 1000) == 0) {
-            fprintf(stderr, "i=%d, error=%.4f\n", i, etotal/1000);
-            etotal = 0;
+        if (rate == 0) {
+            rate = (otype == OPTIM_ADAM)? 0.001 :
+                (otype == OPTIM_SGD)? 0.1 : 0.01;
+        }
+        Optimizer* optim = Optimizer_create(linput, otype, rate);
+        optim->warmup = warmup;
+        double etotal = 0;
+        int nepoch = 10;
+        int train_size = sampler.size;
+        double t0 = gettime();
+        if (hogwild) {
+            /* Hogwild: the threads update the weights on their own. */
+            for (int i = 0; i < nepoch * train_size; i += train_size) {
+                etotal = Trainer_learnHogwild(
+                    trainer, Sampler_fetch, &sampler, train_size, batch_size, rate);
+                fprintf(stderr, "i=%d, error=%.4f\n", i, etotal/train_size);
+            }
+        } else {
+            /* Prefetch the minibatches in the background. */
+            long nbatches = (nepoch * train_size + batch_size-1) / batch_size;
+            Loader* loader = NULL;
+            if (0 < nloaders) {
+                loader = Loader_create(
+                    Sampler_fetchBatch, &sampler, nloaders, 4,
+                    batch_size, 28*28, 10, nbatches);
+            }
+            for (int i = 0; i < nepoch * train_size; i += batch_size) {
+                /* Take the next samples of the epoch. */
+                if (loader != NULL) {
+                    const nn_real* bx;
+                    const nn_real* by;
+                    Loader_next(loader, &bx, &by);
+                    etotal += Trainer_learnBatch(trainer, bx, by, batch_size);
+                    Loader_release(loader);
+                } else {
+                    Sampler_fetch(&sampler, 0, x, y, batch_size);
+                    etotal += Trainer_learnBatch(trainer, x, y, batch_size);
+                }
+                /* Minibatch: update the network for every n samples. */
+                Optimizer_update(optim, batch_size);
+                if ((i % 1000) < batch_size) {
+                    fprintf(stderr, "i=%d, error=%.4f\n", i, etotal/1000);
+                    etotal = 0;
+                }
+            }
+            if (loader != NULL) {
+                LoaderStats stats;
+                Loader_getStats(loader, &stats);
+                fprintf(stderr, "loader: batches=%ld, stalls=%ld (%.1f%%), "
+                        "stalled=%.3f sec, fulls=%ld, fetch=%.1f usec/batch\n",
+                        stats.nbatches, stats.nstalls,
+                        100.0 * stats.nstalls / stats.nbatches, stats.stalled,
+                        stats.nfulls, 1e6 * stats.fetching / stats.nbatches);
+                Loader_destroy(loader);
+            }
+        }
+        double t1 = gettime();
+        fprintf(stderr, "trained: %.2f sec, %.1f samples/sec\n",
+                t1-t0, nepoch * train_size / (t1-t0));
+        for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+            if (layer->ninputs == 0) continue;
+            fprintf(stderr, "sparsity(Layer%d): inputs=%.1f%%", layer->lid,
+                    100.0 - 100.0 * layer->nzinputs / layer->ninputs);
+            if (layer->ltype == LAYER_CONV && layer->conv.ndnets != 0) {
+                fprintf(stderr, ", backprop=%.1f%%",
+                        100.0 - 100.0 * layer->conv.nactive / layer->conv.ndnets);
+            }
+            fprintf(stderr, "\n");
         }
-    }
 
-    IdxFile_destroy(images_train);
-    IdxFile_destroy(labels_train);
+        if (augment != NULL) {
+            long naugmented = 0;
+            double augtime = 0;
+            for (int id = 0; id < sampler.nthreads; id++) {
+                naugmented += sampler.threads[id].naugmented;
+                augtime += sampler.threads[id].augtime;
+            }
+            fprintf(stderr, "augment: samples=%ld, %.1f usec/sample\n",
+                    naugmented, 1e6 * augtime / naugmented);
+            Augment_destroy(augment);
+        }
 
-    /* Training finished. */
+        Trainer_destroy(trainer);
+        Optimizer_destroy(optim);
+        Sampler_close(&sampler);
 
-    //Layer_dump(linput, stdout);
-    //Layer_dump(lconv1, stdout);
-    //Layer_dump(lconv2, stdout);
-    //Layer_dump(lfull1, stdout);
-    //Layer_dump(lfull2, stdout);
-    //Layer_dump(loutput, stdout);
+        /* Training finished. */
+        if (model_out != NULL && Model_save(linput, model_out) != 0) {
+            fprintf(stderr, "%s: cannot save\n", model_out);
+        }
+    }
+
+    //for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+    //    Layer_dump(layer, stdout);
+    //}
 
     /* Read the test images & labels. */
     
-    IdxFile* images_test = NULL;
-    {
-        FILE* fp = fopen(argv[3], "rb");
-        if (fp == NULL) return 111;
-        images_test = IdxFile_read(fp);
-        if (images_test == NULL) return 111;
-        fclose(fp);
-    }
-    IdxFile* labels_test = NULL;
-    {
-        FILE* fp = fopen(argv[4], "rb");
-        if (fp == NULL) return 111;
-        labels_test = IdxFile_read(fp);
-        if (labels_test == NULL) return 111;
-        fclose(fp);
-    }
+    Sampler data_test;
+    if (Sampler_open(&data_test, argv[2], argv[3],
+                     (cache_dir != NULL)? cache_test : NULL) != 0) return 111;
+
+    /* Drop the training state. */
+    Layer_setInference(linput);
+    fprintf(stderr, "inference: params=%zu, acts=%zu\n",
+            arena->nparams, arena->nacts);
 
     fprintf(stderr, "testing...\n");
-    int ntests = images_test->dims[0];
-    int ncorrect = 0;
-    for (int i = 0; i < ntests; i++) {
-        uint8_t img[28*28];
-        double x[28*28];
-        double y[10];
-        IdxFile_get3(images_test, i, img);
-        for (int j = 0; j < 28*28; j++) {
-            x[j] = img[j]/255.0;
-        }
-        Layer_setInputs(linput, x);
-        Layer_getOutputs(loutput, y);
-        int label = IdxFile_get1(labels_test, i);
-        /* Pick the most probable label. */
-        int mj = -1;
-        for (int j = 0; j < 10; j++) {
-            if (mj < 0 || y[mj] < y[j]) {
-                mj = j;
-            }
-        }
-        if (mj == label) {
-            ncorrect++;
-        }
-        if ((i % 1000) == 0) {
-            fprintf(stderr, "i=%d\n", i);
+    int ntests = data_test.size;
+    double t0 = gettime();
+    int ncorrect = test(
+        linput, loutput, NULL, &data_test, batch_size);
+    double t1 = gettime();
+    fprintf(stderr, "ntests=%d, ncorrect=%d (%.2f%%), %.3f sec\n",
+            ntests, ncorrect, 100.0 * ncorrect / ntests, t1-t0);
+    /* Check the conv outputs of the last batch. */
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        if (layer->ltype != LAYER_CONV) continue;
+        double err = Layer_checkConv(layer);
+        fprintf(stderr, "conv(Layer%d): algo=%d, error=%.3g%s\n",
+                layer->lid, layer->conv.algo, err,
+                (err <= CONV_TOLERANCE)? "" : " (over tolerance)");
+    }
+
+    if (quantized) {
+        /* Calibrate with the first training images. */
+        Sampler data_train;
+        if (Sampler_open(&data_train, argv[0], argv[1],
+                         (cache_dir != NULL)? cache_train : NULL) != 0) return 111;
+        int ncalib = data_train.size;
+        if (1000 < ncalib) { ncalib = 1000; }
+        nn_real* xc = (nn_real*)calloc(ncalib * 28*28, sizeof(nn_real));
+        for (int i = 0; i < ncalib; i++) {
+            Sampler_load(&data_train, i, &xc[i*28*28]);
         }
+        QNet* qnet = QNet_create(linput, xc, ncalib);
+        free(xc);
+        Sampler_close(&data_train);
+
+        fprintf(stderr, "testing int8...\n");
+        double t2 = gettime();
+        int qcorrect = test(
+            linput, loutput, qnet, &data_test, batch_size);
+        double t3 = gettime();
+        fprintf(stderr, "int8: ncorrect=%d (%.2f%%), drop=%.2f%%, %.3f sec (%.1fx)\n",
+                qcorrect, 100.0 * qcorrect / ntests,
+                100.0 * (ncorrect - qcorrect) / ntests, t3-t2, (t1-t0) / (t3-t2));
+        QNet_destroy(qnet);
     }
-    fprintf(stderr, "ntests=%d, ncorrect=%d\n", ntests, ncorrect);
 
-    IdxFile_destroy(images_test);
-    IdxFile_destroy(labels_test);
+    Sampler_close(&data_test);
+    free(x);
+    free(y);
 
-    Layer_destroy(linput);
-    Layer_destroy(lconv1);
-    Layer_destroy(lconv2);
-    Layer_destroy(lfull1);
-    Layer_destroy(lfull2);
-    Layer_destroy(loutput);
+    if (model != NULL) {
+        Model_destroy(model);
+    } else {
+        Layer* layer = linput;
+        while (layer != NULL) {
+            Layer* lnext = layer->lnext;
+            Layer_destroy(layer);
+            layer = lnext;
+        }
+    }
+    Arena_destroy(arena);
 
     return 0;
 }
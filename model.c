@@ -0,0 +1,286 @@
+/*
+  model.c
+  Binary model files.
+
+  The arrays are aligned to pages so that a file can be mapped
+  and used as is. Processes that load the same file share its
+  pages in the page cache.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cnn.h"
+#include "model.h"
+
+#define DEBUG_MODEL 0
+
+
+/* model_align(offset): rounds offset up to MODEL_ALIGN. */
+static uint64_t model_align(uint64_t offset)
+{
+    return (offset + MODEL_ALIGN-1) / MODEL_ALIGN * MODEL_ALIGN;
+}
+
+/* model_pad(fp, pos, offset)
+   Writes zeros from pos up to offset.
+*/
+static int model_pad(FILE* fp, uint64_t pos, uint64_t offset)
+{
+    assert (pos <= offset);
+    for (; pos < offset; pos++) {
+        if (fputc(0, fp) == EOF) return -1;
+    }
+    return 0;
+}
+
+/* Model_save(linput, path)
+   Writes the Layers starting from linput to a file.
+*/
+int Model_save(const Layer* linput, const char* path)
+{
+    assert (linput != NULL);
+    assert (linput->lprev == NULL);
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.endian = MODEL_ENDIAN;
+    header.realsize = sizeof(nn_real);
+    header.align = MODEL_ALIGN;
+    for (const Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        header.nlayers++;
+    }
+
+    /* Lay out the arrays. */
+    ModelLayer* mls = (ModelLayer*)calloc(header.nlayers, sizeof(ModelLayer));
+    if (mls == NULL) return -1;
+    uint64_t offset = sizeof(header) + header.nlayers * sizeof(ModelLayer);
+    int i = 0;
+    for (const Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        ModelLayer* ml = &mls[i++];
+        ml->ltype = layer->ltype;
+        ml->depth = layer->depth;
+        ml->width = layer->width;
+        ml->height = layer->height;
+        if (layer->ltype == LAYER_CONV) {
+            ml->kernsize = layer->conv.kernsize;
+            ml->padding = layer->conv.padding;
+            ml->stride = layer->conv.stride;
+        } else if (layer->ltype == LAYER_POOL) {
+            ml->kernsize = layer->pool.kernsize;
+            ml->padding = layer->pool.padding;
+            ml->stride = layer->pool.stride;
+            ml->ptype = layer->pool.ptype;
+        } else if (layer->ltype == LAYER_DWCONV) {
+            ml->kernsize = layer->dwconv.kernsize;
+            ml->padding = layer->dwconv.padding;
+            ml->stride = layer->dwconv.stride;
+        }
+        ml->nbiases = layer->nbiases;
+        ml->nweights = layer->nweights;
+        offset = model_align(offset);
+        ml->biases = offset;
+        offset += layer->nbiases * sizeof(nn_real);
+        offset = model_align(offset);
+        ml->weights = offset;
+        offset += layer->nweights * sizeof(nn_real);
+    }
+
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        free(mls);
+        return -1;
+    }
+    int error = 0;
+    uint64_t pos = 0;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) error = -1;
+    if (fwrite(mls, sizeof(ModelLayer), header.nlayers, fp) !=
+        header.nlayers) error = -1;
+    pos = sizeof(header) + header.nlayers * sizeof(ModelLayer);
+    i = 0;
+    for (const Layer* layer = linput;
+         layer != NULL && error == 0; layer = layer->lnext) {
+        ModelLayer* ml = &mls[i++];
+        if (model_pad(fp, pos, ml->biases) != 0) error = -1;
+        if (fwrite(layer->biases, sizeof(nn_real), layer->nbiases, fp) !=
+            layer->nbiases) error = -1;
+        pos = ml->biases + layer->nbiases * sizeof(nn_real);
+        if (model_pad(fp, pos, ml->weights) != 0) error = -1;
+        if (fwrite(layer->weights, sizeof(nn_real), layer->nweights, fp) !=
+            layer->nweights) error = -1;
+        pos = ml->weights + layer->nweights * sizeof(nn_real);
+    }
+    if (fclose(fp) != 0) error = -1;
+    free(mls);
+
+#if DEBUG_MODEL
+    fprintf(stderr, "Model_save: %s: nlayers=%u, size=%lu\n",
+            path, header.nlayers, (unsigned long)pos);
+#endif
+    return error;
+}
+
+/* Model_checkArray(self, offset, n)
+   Returns 1 if n nn_reals at offset are inside the file.
+*/
+static int Model_checkArray(const Model* self, uint64_t offset, uint64_t n)
+{
+    if (offset % sizeof(nn_real) != 0) return 0;
+    if (self->size < offset) return 0;
+    return (n <= (self->size - offset) / sizeof(nn_real));
+}
+
+/* Model_load(path)
+   Maps a file and creates its Layers.
+*/
+Model* Model_load(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(ModelHeader)) {
+        close(fd);
+        return NULL;
+    }
+    /* Private and writable: pages are shared until they are trained. */
+    void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    Model* self = (Model*)calloc(1, sizeof(Model));
+    if (self == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    self->map = map;
+    self->size = st.st_size;
+
+    /* Check the header. */
+    const ModelHeader* header = (const ModelHeader*)map;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MODEL_VERSION ||
+        header->endian != MODEL_ENDIAN ||
+        header->realsize != sizeof(nn_real) ||
+        header->nlayers < 1 ||
+        (self->size - sizeof(ModelHeader)) / sizeof(ModelLayer) <
+        header->nlayers) {
+        Model_destroy(self);
+        return NULL;
+    }
+    const ModelLayer* mls = (const ModelLayer*)(header+1);
+
+    /* Create the Layers. */
+    for (int i = 0; i < header->nlayers; i++) {
+        const ModelLayer* ml = &mls[i];
+        Layer* lprev = self->loutput;
+        Layer* layer = NULL;
+        if (!Model_checkArray(self, ml->biases, ml->nbiases) ||
+            !Model_checkArray(self, ml->weights, ml->nweights)) break;
+        if (ml->depth < 1 || ml->width < 1 || ml->height < 1) break;
+        switch (ml->ltype) {
+        case LAYER_INPUT:
+            if (lprev != NULL) break;
+            layer = Layer_create_input(ml->depth, ml->width, ml->height);
+            break;
+        case LAYER_FULL:
+            if (lprev == NULL) break;
+            if (ml->width != 1 || ml->height != 1) break;
+            layer = Layer_create_full(lprev, ml->depth, 0);
+            break;
+        case LAYER_CONV:
+            if (lprev == NULL) break;
+            if (ml->kernsize < 1 || (ml->kernsize % 2) != 1 ||
+                ml->stride < 1) break;
+            if ((ml->width-1) * ml->stride + ml->kernsize >
+                lprev->width + ml->padding*2) break;
+            if ((ml->height-1) * ml->stride + ml->kernsize >
+                lprev->height + ml->padding*2) break;
+            layer = Layer_create_conv(
+                lprev, ml->depth, ml->width, ml->height,
+                ml->kernsize, ml->padding, ml->stride, 0);
+            break;
+        case LAYER_DWCONV:
+            if (lprev == NULL) break;
+            if (ml->depth != lprev->depth) break;
+            if (ml->kernsize < 1 || (ml->kernsize % 2) != 1 ||
+                ml->stride < 1) break;
+            if ((ml->width-1) * ml->stride + ml->kernsize >
+                lprev->width + ml->padding*2) break;
+            if ((ml->height-1) * ml->stride + ml->kernsize >
+                lprev->height + ml->padding*2) break;
+            layer = Layer_create_dwconv(
+                lprev, ml->width, ml->height,
+                ml->kernsize, ml->padding, ml->stride, 0);
+            break;
+        case LAYER_POOL:
+            if (lprev == NULL) break;
+            if (ml->depth != lprev->depth) break;
+            if (ml->ptype != POOL_MAX && ml->ptype != POOL_AVG) break;
+            if (ml->kernsize < 1 || ml->stride < 1 ||
+                ml->kernsize <= ml->padding) break;
+            if ((ml->width-1) * ml->stride + ml->kernsize >
+                lprev->width + ml->padding*2) break;
+            if ((ml->height-1) * ml->stride + ml->kernsize >
+                lprev->height + ml->padding*2) break;
+            if ((int)((ml->width-1) * ml->stride) - (int)ml->padding >=
+                lprev->width) break;
+            if ((int)((ml->height-1) * ml->stride) - (int)ml->padding >=
+                lprev->height) break;
+            layer = Layer_create_pool(
+                lprev, ml->ptype, ml->width, ml->height,
+                ml->kernsize, ml->padding, ml->stride);
+            break;
+        }
+        if (layer == NULL) break;
+        if (self->linput == NULL) {
+            self->linput = layer;
+        }
+        self->loutput = layer;
+        if (layer->nbiases != ml->nbiases ||
+            layer->nweights != ml->nweights) break;
+
+        /* Point the weights/biases into the file. */
+        free(layer->biases);
+        free(layer->weights);
+        layer->biases = (nn_real*)((char*)map + ml->biases);
+        layer->weights = (nn_real*)((char*)map + ml->weights);
+        layer->shared = 1;
+        if (i == header->nlayers-1) {
+#if DEBUG_MODEL
+            fprintf(stderr, "Model_load: %s: nlayers=%u, size=%lu\n",
+                    path, header->nlayers, (unsigned long)self->size);
+#endif
+            return self;
+        }
+    }
+
+    /* Broken file. */
+    Model_destroy(self);
+    return NULL;
+}
+
+/* Model_destroy(self)
+   Destroys the Layers and unmaps the file.
+*/
+void Model_destroy(Model* self)
+{
+    assert (self != NULL);
+    Layer* layer = self->linput;
+    while (layer != NULL) {
+        Layer* lnext = layer->lnext;
+        Layer_destroy(layer);
+        layer = lnext;
+    }
+    if (self->map != NULL) {
+        munmap(self->map, self->size);
+    }
+    free(self);
+}
@@ -0,0 +1,72 @@
+/*
+  model.h
+  Binary model files.
+  Requires cnn.h.
+
+  File layout (native byte order):
+    ModelHeader
+    ModelLayer x nlayers
+    biases/weights of each Layer, each at a MODEL_ALIGN boundary.
+*/
+
+#include <stdint.h>
+
+#define MODEL_MAGIC "NN1M"
+#define MODEL_VERSION 1
+#define MODEL_ENDIAN 0x01020304
+#define MODEL_ALIGN 4096
+
+
+/*  ModelHeader
+ */
+typedef struct _ModelHeader {
+    char magic[4];              /* MODEL_MAGIC */
+    uint32_t version;           /* MODEL_VERSION */
+    uint32_t endian;            /* MODEL_ENDIAN */
+    uint32_t realsize;          /* sizeof(nn_real) */
+    uint32_t align;             /* MODEL_ALIGN */
+    uint32_t nlayers;           /* Num. of Layers */
+    uint32_t reserved[2];
+} ModelHeader;
+
+/*  ModelLayer
+ */
+typedef struct _ModelLayer {
+    uint32_t ltype;             /* LayerType */
+    uint32_t depth, width, height;
+    uint32_t kernsize, padding, stride;
+    uint32_t ptype;             /* PoolType (pool only) */
+    uint64_t nbiases;           /* Num. of Biases */
+    uint64_t nweights;          /* Num. of Weights */
+    uint64_t biases;            /* File offset of the Biases */
+    uint64_t weights;           /* File offset of the Weights */
+} ModelLayer;
+
+
+/*  Model
+ */
+typedef struct _Model {
+    Layer* linput;              /* First Layer */
+    Layer* loutput;             /* Last Layer */
+    void* map;                  /* Mapped file */
+    size_t size;                /* Size of the mapped file */
+} Model;
+
+/* Model_save(linput, path)
+   Writes the Layers starting from linput to a file.
+   Returns 0 on success.
+*/
+int Model_save(const Layer* linput, const char* path);
+
+/* Model_load(path)
+   Maps a file and creates its Layers.
+   The weights/biases point into the (private) mapping,
+   so nothing is copied until they are modified.
+   Returns NULL on failure.
+*/
+Model* Model_load(const char* path);
+
+/* Model_destroy(self)
+   Destroys the Layers and unmaps the file.
+*/
+void Model_destroy(Model* self);
@@ -0,0 +1,173 @@
+/*
+  optim.c
+  Optimizers (momentum, Nesterov, Adam) with rate schedules.
+
+  Each step is one sweep over every parameter buffer that applies
+  the gradient, updates the optimizer state and clears the updates.
+  With an Arena, all the Layers form a single buffer.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "cnn.h"
+#include "optim.h"
+#include "simd.h"
+
+#define DEBUG_OPTIM 0
+
+
+/* Optimizer_addSeg(self, n, params, updates)
+   Adds a segment (if not empty).
+*/
+static void Optimizer_addSeg(
+    Optimizer* self, size_t n, nn_real* params, nn_real* updates)
+{
+    if (n == 0) return;
+    OptimSeg* seg = &self->segs[self->nsegs++];
+    seg->n = n;
+    seg->params = params;
+    seg->updates = updates;
+}
+
+/* Optimizer_create(linput, otype, rate)
+   Creates an Optimizer for the Layers starting from linput.
+*/
+Optimizer* Optimizer_create(Layer* linput, OptimType otype, double rate)
+{
+    assert (linput != NULL);
+    assert (linput->lprev == NULL);
+    assert (!linput->inference);
+
+    Optimizer* self = (Optimizer*)calloc(1, sizeof(Optimizer));
+    if (self == NULL) return NULL;
+    self->otype = otype;
+    self->rate = rate;
+    self->momentum = 0.9;
+    self->beta2 = 0.999;
+    self->eps = 1e-8;
+    self->decay = 1.0;
+
+    /* Find the parameter buffers. */
+    int nlayers = 0;
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        nlayers++;
+    }
+    self->segs = (OptimSeg*)calloc(2*nlayers, sizeof(OptimSeg));
+    Arena* arena = linput->arena;
+    if (arena != NULL && arena->params != NULL) {
+        /* All the Layers at once (padding included). */
+        Optimizer_addSeg(self, arena->nparams, arena->params, arena->updates);
+    } else {
+        for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+            Optimizer_addSeg(
+                self, layer->nbiases, layer->biases, layer->u_biases);
+            Optimizer_addSeg(
+                self, layer->nweights, layer->weights, layer->u_weights);
+        }
+    }
+
+    /* Allocate the state. */
+    int nstate = 0;
+    switch (otype) {
+    case OPTIM_MOMENTUM:
+    case OPTIM_NESTEROV:
+        nstate = 1;             /* velocity */
+        break;
+    case OPTIM_ADAM:
+        nstate = 2;             /* 1st and 2nd moments */
+        break;
+    default:
+        break;
+    }
+    size_t n = 0;
+    for (int i = 0; i < self->nsegs; i++) {
+        n += self->segs[i].n;
+    }
+    if (nstate != 0) {
+        self->state = (nn_real*)calloc(nstate * n, sizeof(nn_real));
+        nn_real* p = self->state;
+        for (int i = 0; i < self->nsegs; i++) {
+            self->segs[i].state = p;
+            p += nstate * self->segs[i].n;
+        }
+    }
+
+#if DEBUG_OPTIM
+    fprintf(stderr, "Optimizer_create: otype=%d, nsegs=%d, nparams=%zu\n",
+            otype, self->nsegs, n);
+#endif
+    return self;
+}
+
+/* Optimizer_destroy(self)
+   Releases the memory.
+*/
+void Optimizer_destroy(Optimizer* self)
+{
+    assert (self != NULL);
+    free(self->segs);
+    free(self->state);
+    free(self);
+}
+
+/* Optimizer_getRate(self)
+   Returns the learning rate of the next step.
+*/
+double Optimizer_getRate(const Optimizer* self)
+{
+    assert (self != NULL);
+    double rate = self->rate;
+    if (self->nsteps < self->warmup) {
+        rate *= (double)(self->nsteps+1) / self->warmup;
+    }
+    if (0 < self->decaysteps) {
+        rate *= pow(self->decay, self->nsteps / self->decaysteps);
+    }
+    return rate;
+}
+
+/* Optimizer_update(self, nbatch)
+   Updates the weights and clears the updates.
+*/
+void Optimizer_update(Optimizer* self, int nbatch)
+{
+    assert (self != NULL);
+    assert (0 < nbatch);
+
+    double rate = Optimizer_getRate(self);
+    double s = 1.0 / nbatch;
+    self->nsteps++;
+    switch (self->otype) {
+    case OPTIM_MOMENTUM:
+    case OPTIM_NESTEROV:
+        for (int i = 0; i < self->nsegs; i++) {
+            OptimSeg* seg = &self->segs[i];
+            simd_momentum(seg->n, rate, s, self->momentum,
+                          (self->otype == OPTIM_NESTEROV),
+                          seg->params, seg->updates, seg->state);
+        }
+        break;
+    case OPTIM_ADAM:
+        {
+            /* Fold the bias correction into the step size. */
+            int t = self->nsteps;
+            double a = rate * sqrt(1 - pow(self->beta2, t)) /
+                (1 - pow(self->momentum, t));
+            for (int i = 0; i < self->nsegs; i++) {
+                OptimSeg* seg = &self->segs[i];
+                simd_adam(seg->n, a, s, self->momentum, self->beta2, self->eps,
+                          seg->params, seg->updates,
+                          seg->state, seg->state + seg->n);
+            }
+        }
+        break;
+    default:
+        for (int i = 0; i < self->nsegs; i++) {
+            OptimSeg* seg = &self->segs[i];
+            simd_sgd(seg->n, rate * s, seg->params, seg->updates);
+        }
+        break;
+    }
+}
@@ -0,0 +1,72 @@
+/*
+  optim.h
+  Optimizers (momentum, Nesterov, Adam) with rate schedules.
+  Requires cnn.h.
+*/
+
+
+/*  OptimType
+ */
+typedef enum _OptimType {
+    OPTIM_SGD = 0,
+    OPTIM_MOMENTUM,
+    OPTIM_NESTEROV,
+    OPTIM_ADAM
+} OptimType;
+
+/*  OptimSeg
+    A parameter buffer and its updates.
+ */
+typedef struct _OptimSeg {
+    size_t n;                   /* Num. of parameters */
+    nn_real* params;            /* Parameters */
+    nn_real* updates;           /* Their updates (summed gradients) */
+    nn_real* state;             /* Optimizer state (nstate x n) */
+} OptimSeg;
+
+/*  Optimizer
+ */
+typedef struct _Optimizer {
+
+    OptimType otype;            /* Optimizer type */
+    double rate;                /* Base learning rate */
+    double momentum;            /* Momentum (Adam: beta1) */
+    double beta2;               /* Adam: decay of the 2nd moment */
+    double eps;                 /* Adam: epsilon */
+
+    /* Schedule */
+    int warmup;                 /* Num. of steps to ramp up the rate */
+    int decaysteps;             /* Num. of steps per decay (0: none) */
+    double decay;               /* Rate multiplier per decaysteps */
+    int nsteps;                 /* Num. of steps done */
+
+    int nsegs;                  /* Num. of segments */
+    OptimSeg* segs;             /* Segments */
+    nn_real* state;             /* State of all the segments */
+
+} Optimizer;
+
+/* Optimizer_create(linput, otype, rate)
+   Creates an Optimizer for the Layers starting from linput.
+   The other settings have default values (momentum=0.9,
+   beta2=0.999, eps=1e-8, no warmup, no decay) and can be
+   changed before the first step. Call it after Arena_create().
+*/
+Optimizer* Optimizer_create(Layer* linput, OptimType otype, double rate);
+
+/* Optimizer_destroy(self)
+   Releases the memory.
+*/
+void Optimizer_destroy(Optimizer* self);
+
+/* Optimizer_getRate(self)
+   Returns the learning rate of the next step:
+     rate * min(1, (nsteps+1)/warmup) * decay^(nsteps/decaysteps)
+*/
+double Optimizer_getRate(const Optimizer* self);
+
+/* Optimizer_update(self, nbatch)
+   Updates the weights with the updates summed over nbatch
+   samples, and clears the updates.
+*/
+void Optimizer_update(Optimizer* self, int nbatch);
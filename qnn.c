@@ -0,0 +1,542 @@
+/*
+  qnn.c
+  Quantized (int8) inference.
+
+  Weights are int8 with one scale per output channel. Activations
+  are stored as uint8 with a zero point of 128 and one scale per
+  Layer (symmetric, calibrated from the largest magnitude seen on
+  sample inputs). The products are accumulated in int32 by the
+  simd_gemm8 kernel, which also removes the zero point (with the
+  row sums of the weights) and rescales the sums to real values
+  to apply the biases. Only the activation function is computed
+  on real values before quantizing them again.
+
+  Unlike the Layers, the activations are laid out in (y, x, depth)
+  order, so that each kernel row of the im2col buffer is a single
+  contiguous copy. The weights are reordered to match.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cnn.h"
+#include "qnn.h"
+#include "simd.h"
+
+#define DEBUG_QNN 0
+#define QNN_ZERO 128
+#define QNN_CALIB_BATCH 32
+
+
+/*  Misc. functions
+ */
+
+/* quantize(x): rounds x to [-127, +127] and adds the zero point. */
+static inline uint8_t quantize(float x)
+{
+    if (x < -127) { x = -127; }
+    if (127 < x) { x = 127; }
+    /* x + 128.5 > 0, so truncating rounds half up. */
+    return (uint8_t)(int)(x + (QNN_ZERO + 0.5f));
+}
+
+/* qscale(amax): scale that maps [-amax, +amax] to [-127, +127]. */
+static inline float qscale(double amax)
+{
+    return (0 < amax)? (float)(amax / 127) : 1.0f/127;
+}
+
+/* roundup(n, k): rounds n up to a multiple of k. */
+static inline int roundup(int n, int k)
+{
+    return (n + k-1) / k * k;
+}
+
+
+/*  QNet
+ */
+
+/* QNet_reserve(self, nbatch)
+   Grows the sample buffers to hold nbatch samples.
+*/
+static void QNet_reserve(QNet* self, int nbatch)
+{
+    if (self->maxbatch < nbatch) {
+        for (int l = 0; l < self->nlayers; l++) {
+            QLayer* layer = &self->layers[l];
+            free(layer->outputs);
+            layer->outputs = (uint8_t*)calloc(
+                nbatch * layer->ldo, sizeof(uint8_t));
+            if (layer->ltype == LAYER_FULL) {
+                free(layer->nets);
+                layer->nets = (float*)calloc(
+                    nbatch * layer->depth, sizeof(float));
+            }
+        }
+        QLayer* loutput = &self->layers[self->nlayers-1];
+        free(self->outputs);
+        self->outputs = (float*)calloc(nbatch * loutput->nnodes, sizeof(float));
+        self->maxbatch = nbatch;
+    }
+    self->nbatch = nbatch;
+}
+
+/* QLayer_init(self, src)
+   Quantizes the weights of src.
+*/
+static void QLayer_init(QLayer* self, const Layer* src)
+{
+    self->ltype = src->ltype;
+    self->depth = src->depth;
+    self->width = src->width;
+    self->height = src->height;
+    self->nnodes = src->nnodes;
+    self->ldo = roundup(src->nnodes, 64);
+    if (src->ltype == LAYER_INPUT) return;
+    const Layer* lprev = src->lprev;
+    if (src->ltype == LAYER_POOL) {
+        /* No weights: the codes are pooled as they are. */
+        self->ptype = src->pool.ptype;
+        self->kernsize = src->pool.kernsize;
+        self->padding = src->pool.padding;
+        self->stride = src->pool.stride;
+        return;
+    }
+    if (src->ltype == LAYER_DWCONV) {
+        /* One kernel per channel, stored in (tap, depth) order. */
+        int ksize = src->dwconv.kernsize * src->dwconv.kernsize;
+        int npixels = src->width * src->height;
+        self->ncols = ksize;
+        self->kernsize = src->dwconv.kernsize;
+        self->padding = src->dwconv.padding;
+        self->stride = src->dwconv.stride;
+        self->weights = (int8_t*)calloc(ksize * src->depth, sizeof(int8_t));
+        self->wscales = (float*)calloc(src->depth, sizeof(float));
+        self->rscales = (float*)calloc(src->depth, sizeof(float));
+        self->biases = (float*)calloc(src->depth, sizeof(float));
+        self->nets = (float*)calloc(npixels * src->depth, sizeof(float));
+        for (int i = 0; i < src->depth; i++) {
+            const nn_real* w = &src->weights[i * ksize];
+            double amax = 0;
+            for (int k = 0; k < ksize; k++) {
+                double a = fabs(w[k]);
+                if (amax < a) { amax = a; }
+            }
+            float scale = qscale(amax);
+            for (int k = 0; k < ksize; k++) {
+                self->weights[k * src->depth + i] =
+                    (int8_t)(quantize(w[k] / scale) - QNN_ZERO);
+            }
+            self->wscales[i] = scale;
+            self->biases[i] = src->biases[i];
+        }
+        return;
+    }
+
+    /* Both full and conv weights are (depth x ncols). */
+    self->ncols = src->nweights / src->depth;
+    self->kc = roundup(self->ncols, 4);
+    /* The per-row arrays are padded to whole panels. */
+    int nrows = roundup(src->depth, SIMD_MR8);
+    self->weights = (int8_t*)calloc(nrows * self->kc, sizeof(int8_t));
+    self->zeros = (int32_t*)calloc(nrows, sizeof(int32_t));
+    self->wscales = (float*)calloc(nrows, sizeof(float));
+    self->rscales = (float*)calloc(nrows, sizeof(float));
+    self->biases = (float*)calloc(nrows, sizeof(float));
+    for (int i = 0; i < src->depth; i++) {
+        const nn_real* w = &src->weights[i * self->ncols];
+        double amax = 0;
+        for (int k = 0; k < self->ncols; k++) {
+            double a = fabs(w[k]);
+            if (amax < a) { amax = a; }
+        }
+        float scale = qscale(amax);
+        /* Pack the rows by panels of SIMD_MR8. */
+        int8_t* panel = &self->weights[i / SIMD_MR8 * SIMD_MR8 * self->kc];
+        int r = i % SIMD_MR8;
+        for (int j = 0; j < self->ncols; j++) {
+            int8_t q = (int8_t)(quantize(w[j] / scale) - QNN_ZERO);
+            /* Reorder the inputs from (depth, y, x) to (y, x, depth). */
+            int k;
+            if (src->ltype == LAYER_CONV) {
+                int ksize = src->conv.kernsize * src->conv.kernsize;
+                k = (j % ksize) * lprev->depth + j / ksize;
+            } else {
+                int npixels = lprev->width * lprev->height;
+                k = (j % npixels) * lprev->depth + j / npixels;
+            }
+            panel[(k/4 * SIMD_MR8 + r) * 4 + k%4] = q;
+            self->zeros[i] += QNN_ZERO * q;
+        }
+        self->wscales[i] = scale;
+    }
+    for (int i = 0; i < src->nbiases; i++) {
+        self->biases[i] = src->biases[i];
+    }
+
+    if (src->ltype == LAYER_CONV) {
+        int npixels = src->width * src->height;
+        self->kernsize = src->conv.kernsize;
+        self->padding = src->conv.padding;
+        self->stride = src->conv.stride;
+        self->cols = (uint8_t*)calloc(npixels * self->kc, sizeof(uint8_t));
+        self->nets = (float*)calloc(npixels * src->depth, sizeof(float));
+    }
+}
+
+/* QNet_create(linput, x, nsamples)
+   Quantizes the Layers starting from linput.
+*/
+QNet* QNet_create(Layer* linput, const nn_real* x, int nsamples)
+{
+    assert (linput != NULL);
+    assert (linput->lprev == NULL);
+    assert (0 < nsamples);
+
+    QNet* self = (QNet*)calloc(1, sizeof(QNet));
+    if (self == NULL) return NULL;
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        self->nlayers++;
+    }
+    self->layers = (QLayer*)calloc(self->nlayers, sizeof(QLayer));
+    double* amaxs = (double*)calloc(self->nlayers, sizeof(double));
+
+    int l = 0;
+    Layer* loutput = NULL;
+    for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+        QLayer_init(&self->layers[l++], layer);
+        loutput = layer;
+    }
+    assert (loutput->ltype == LAYER_FULL);
+
+    /* Calibrate the activations with real outputs. */
+    for (int i = 0; i < nsamples; i += QNN_CALIB_BATCH) {
+        int n = (nsamples-i < QNN_CALIB_BATCH)? (nsamples-i) : QNN_CALIB_BATCH;
+        Layer_setInputsBatch(linput, &x[i * linput->nnodes], n);
+        l = 0;
+        for (Layer* layer = linput; layer != NULL; layer = layer->lnext) {
+            for (int j = 0; j < n * layer->nnodes; j++) {
+                double a = fabs(layer->outputs[j]);
+                if (amaxs[l] < a) { amaxs[l] = a; }
+            }
+            l++;
+        }
+    }
+    for (l = 0; l < self->nlayers; l++) {
+        /* Pooling keeps the scale of its inputs. */
+        self->layers[l].scale = (self->layers[l].ltype == LAYER_POOL)?
+            self->layers[l-1].scale : qscale(amaxs[l]);
+#if DEBUG_QNN
+        fprintf(stderr, "QNet_create: layer%d: amax=%.4f\n", l, amaxs[l]);
+#endif
+    }
+    for (l = 1; l < self->nlayers; l++) {
+        QLayer* layer = &self->layers[l];
+        if (layer->ltype == LAYER_POOL) continue;
+        for (int i = 0; i < layer->depth; i++) {
+            layer->rscales[i] = self->layers[l-1].scale * layer->wscales[i];
+        }
+    }
+    free(amaxs);
+
+    QNet_reserve(self, 1);
+    return self;
+}
+
+/* QNet_destroy(self)
+   Releases the memory.
+*/
+void QNet_destroy(QNet* self)
+{
+    assert (self != NULL);
+    for (int l = 0; l < self->nlayers; l++) {
+        QLayer* layer = &self->layers[l];
+        free(layer->outputs);
+        free(layer->weights);
+        free(layer->zeros);
+        free(layer->wscales);
+        free(layer->rscales);
+        free(layer->biases);
+        free(layer->nets);
+        free(layer->cols);
+    }
+    free(self->layers);
+    free(self->outputs);
+    free(self);
+}
+
+/* QLayer_matmul(self, b, ldb, n)
+   Computes the real net inputs for n columns of quantized inputs
+   (b + j*ldb): nets[j*depth + i].
+*/
+static void QLayer_matmul(QLayer* self, const uint8_t* b, int ldb, int n)
+{
+    float c[SIMD_NR8 * SIMD_MR8];
+    const uint8_t* bs[SIMD_NR8];
+    for (int j0 = 0; j0 < n; j0 += SIMD_NR8) {
+        /* Repeat the last column to fill the tile. */
+        for (int t = 0; t < SIMD_NR8; t++) {
+            int j = (j0+t < n)? (j0+t) : (n-1);
+            bs[t] = &b[j * ldb];
+        }
+        int nt = (n-j0 < SIMD_NR8)? (n-j0) : SIMD_NR8;
+        for (int i0 = 0; i0 < self->depth; i0 += SIMD_MR8) {
+            simd_gemm8(self->kc, &self->weights[i0 * self->kc], bs,
+                       &self->zeros[i0], &self->rscales[i0],
+                       &self->biases[i0], c);
+            int mt = (self->depth-i0 < SIMD_MR8)? (self->depth-i0) : SIMD_MR8;
+            for (int t = 0; t < nt; t++) {
+                memcpy(&self->nets[(j0+t) * self->depth + i0],
+                       &c[t * SIMD_MR8], mt * sizeof(float));
+            }
+        }
+    }
+}
+
+/* QLayer_im2col(self, lprev, src)
+   Lowers the input of one sample into the column buffer.
+   Each row holds the inputs of one pixel in (y, x, depth) order:
+   cols is a (width*height) x kc matrix.
+*/
+static void QLayer_im2col(QLayer* self, const QLayer* lprev, const uint8_t* src)
+{
+    int kernsize = self->kernsize;
+    int depth = lprev->depth;
+    for (int y1 = 0; y1 < self->height; y1++) {
+        int y0 = self->stride * y1 - self->padding;
+        for (int x1 = 0; x1 < self->width; x1++) {
+            int x0 = self->stride * x1 - self->padding;
+            uint8_t* cols = &self->cols[(y1 * self->width + x1) * self->kc];
+            for (int dy = 0; dy < kernsize; dy++) {
+                int y = y0 + dy;
+                if (y < 0 || lprev->height <= y) {
+                    memset(cols, QNN_ZERO, kernsize * depth);
+                    cols += kernsize * depth;
+                    continue;
+                }
+                const uint8_t* row = &src[y * lprev->width * depth];
+                if (0 <= x0 && x0 + kernsize <= lprev->width) {
+                    /* The kernel row is contiguous. */
+                    memcpy(cols, &row[x0 * depth], kernsize * depth);
+                    cols += kernsize * depth;
+                    continue;
+                }
+                for (int dx = 0; dx < kernsize; dx++) {
+                    int x = x0 + dx;
+                    if (0 <= x && x < lprev->width) {
+                        memcpy(cols, &row[x * depth], depth);
+                    } else {
+                        memset(cols, QNN_ZERO, depth);
+                    }
+                    cols += depth;
+                }
+            }
+        }
+    }
+}
+
+/* QLayer_feedForw_conv(self, lprev, nbatch)
+   Performs feed forward updates with ReLU.
+*/
+static void QLayer_feedForw_conv(QLayer* self, const QLayer* lprev, int nbatch)
+{
+    int npixels = self->width * self->height;
+    float inv = 1.0f / self->scale;
+    for (int s = 0; s < nbatch; s++) {
+        QLayer_im2col(self, lprev, &lprev->outputs[s * lprev->ldo]);
+        QLayer_matmul(self, self->cols, self->kc, npixels);
+        /* The outputs are stored in (y, x, depth) order like nets.
+           Clamping at zero applies ReLU. */
+        simd_quant8(npixels * self->depth, self->nets, inv, 0,
+                    &self->outputs[s * self->ldo]);
+    }
+}
+
+/* QLayer_feedForw_dwconv(self, lprev, nbatch)
+   Performs feed forward updates with ReLU.
+*/
+static void QLayer_feedForw_dwconv(QLayer* self, const QLayer* lprev, int nbatch)
+{
+    int kernsize = self->kernsize;
+    int depth = self->depth;
+    int npixels = self->width * self->height;
+    float inv = 1.0f / self->scale;
+    for (int s = 0; s < nbatch; s++) {
+        const uint8_t* src = &lprev->outputs[s * lprev->ldo];
+        for (int y1 = 0; y1 < self->height; y1++) {
+            int y0 = self->stride * y1 - self->padding;
+            for (int x1 = 0; x1 < self->width; x1++) {
+                int x0 = self->stride * x1 - self->padding;
+                float* nets = &self->nets[(y1 * self->width + x1) * depth];
+                for (int z = 0; z < depth; z++) {
+                    nets[z] = 0;
+                }
+                /* The integer sums are exact in float. */
+                for (int dy = 0; dy < kernsize; dy++) {
+                    int y = y0 + dy;
+                    if (y < 0 || lprev->height <= y) continue;
+                    for (int dx = 0; dx < kernsize; dx++) {
+                        int x = x0 + dx;
+                        if (x < 0 || lprev->width <= x) continue;
+                        const uint8_t* in = &src[(y * lprev->width + x) * depth];
+                        const int8_t* w = &self->weights[(dy * kernsize + dx) * depth];
+                        for (int z = 0; z < depth; z++) {
+                            nets[z] += (in[z] - QNN_ZERO) * w[z];
+                        }
+                    }
+                }
+                for (int z = 0; z < depth; z++) {
+                    nets[z] = nets[z] * self->rscales[z] + self->biases[z];
+                }
+            }
+        }
+        simd_quant8(npixels * depth, self->nets, inv, 0,
+                    &self->outputs[s * self->ldo]);
+    }
+}
+
+/* QLayer_feedForw_pool(self, lprev, nbatch)
+   Performs feed forward updates on the codes.
+   The average is rounded to the nearest code.
+*/
+static void QLayer_feedForw_pool(QLayer* self, const QLayer* lprev, int nbatch)
+{
+    int kernsize = self->kernsize;
+    int depth = self->depth;
+    for (int s = 0; s < nbatch; s++) {
+        const uint8_t* src = &lprev->outputs[s * lprev->ldo];
+        uint8_t* outputs = &self->outputs[s * self->ldo];
+        for (int y1 = 0; y1 < self->height; y1++) {
+            int y0 = self->stride * y1 - self->padding;
+            int ya = (y0 < 0)? 0 : y0;
+            int yb = (lprev->height < y0+kernsize)? lprev->height : y0+kernsize;
+            for (int x1 = 0; x1 < self->width; x1++) {
+                int x0 = self->stride * x1 - self->padding;
+                int xa = (x0 < 0)? 0 : x0;
+                int xb = (lprev->width < x0+kernsize)? lprev->width : x0+kernsize;
+                int n = (yb-ya) * (xb-xa);
+                uint8_t* dst = &outputs[(y1 * self->width + x1) * depth];
+                for (int z = 0; z < depth; z++) {
+                    int v = 0;
+                    for (int y = ya; y < yb; y++) {
+                        const uint8_t* row = &src[(y * lprev->width) * depth + z];
+                        for (int x = xa; x < xb; x++) {
+                            int c = row[x * depth];
+                            if (self->ptype == POOL_MAX) {
+                                if (v < c) { v = c; }
+                            } else {
+                                v += c;
+                            }
+                        }
+                    }
+                    dst[z] = (self->ptype == POOL_MAX)? v : (v + n/2) / n;
+                }
+            }
+        }
+    }
+}
+
+/* QLayer_feedForw_full(self, lprev, nbatch, outputs)
+   Performs feed forward updates with Tanh.
+   If outputs is given, stores the real values there (before Softmax)
+   instead of quantizing them.
+*/
+static void QLayer_feedForw_full(
+    QLayer* self, const QLayer* lprev, int nbatch, float* outputs)
+{
+    QLayer_matmul(self, lprev->outputs, lprev->ldo, nbatch);
+    if (outputs != NULL) {
+        for (int i = 0; i < nbatch * self->nnodes; i++) {
+            outputs[i] = self->nets[i];
+        }
+        return;
+    }
+    float inv = 1.0f / self->scale;
+    for (int s = 0; s < nbatch; s++) {
+        float* nets = &self->nets[s * self->nnodes];
+        for (int i = 0; i < self->nnodes; i++) {
+            nets[i] = tanhf(nets[i]);
+        }
+        simd_quant8(self->nnodes, nets, inv, -127,
+                    &self->outputs[s * self->ldo]);
+    }
+}
+
+/* QNet_setInputsBatch(self, values, nbatch)
+   Sets the input values of nbatch samples and runs the network.
+*/
+void QNet_setInputsBatch(QNet* self, const nn_real* values, int nbatch)
+{
+    assert (self != NULL);
+    assert (0 < nbatch);
+    QNet_reserve(self, nbatch);
+
+    QLayer* linput = &self->layers[0];
+    float inv = 1.0f / linput->scale;
+    int npixels = linput->width * linput->height;
+    for (int s = 0; s < nbatch; s++) {
+        const nn_real* x = &values[s * linput->nnodes];
+        uint8_t* outputs = &linput->outputs[s * linput->ldo];
+        for (int z = 0; z < linput->depth; z++) {
+            for (int j = 0; j < npixels; j++) {
+                outputs[j * linput->depth + z] = quantize(x[z * npixels + j] * inv);
+            }
+        }
+    }
+
+    for (int l = 1; l < self->nlayers; l++) {
+        QLayer* layer = &self->layers[l];
+        QLayer* lprev = &self->layers[l-1];
+        switch (layer->ltype) {
+        case LAYER_CONV:
+            QLayer_feedForw_conv(layer, lprev, nbatch);
+            break;
+        case LAYER_POOL:
+            QLayer_feedForw_pool(layer, lprev, nbatch);
+            break;
+        case LAYER_DWCONV:
+            QLayer_feedForw_dwconv(layer, lprev, nbatch);
+            break;
+        case LAYER_FULL:
+            QLayer_feedForw_full(
+                layer, lprev, nbatch,
+                (l == self->nlayers-1)? self->outputs : NULL);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* Last layer - use Softmax. */
+    QLayer* loutput = &self->layers[self->nlayers-1];
+    for (int s = 0; s < nbatch; s++) {
+        float* outputs = &self->outputs[s * loutput->nnodes];
+        float m = outputs[0];
+        for (int i = 1; i < loutput->nnodes; i++) {
+            if (m < outputs[i]) { m = outputs[i]; }
+        }
+        float t = 0;
+        for (int i = 0; i < loutput->nnodes; i++) {
+            outputs[i] = expf(outputs[i] - m);
+            t += outputs[i];
+        }
+        for (int i = 0; i < loutput->nnodes; i++) {
+            outputs[i] /= t;
+        }
+    }
+}
+
+/* QNet_getOutputs(self, outputs)
+   Gets the output values.
+*/
+void QNet_getOutputs(const QNet* self, nn_real* outputs)
+{
+    assert (self != NULL);
+    const QLayer* loutput = &self->layers[self->nlayers-1];
+    for (int i = 0; i < self->nbatch * loutput->nnodes; i++) {
+        outputs[i] = self->outputs[i];
+    }
+}
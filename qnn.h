@@ -0,0 +1,77 @@
+/*
+  qnn.h
+  Quantized (int8) inference.
+  Requires cnn.h.
+*/
+
+#include <stdint.h>
+
+
+/*  QLayer
+ */
+typedef struct _QLayer {
+
+    LayerType ltype;            /* Layer type */
+    int depth, width, height;   /* Shape */
+    int nnodes;                 /* Num. of Nodes */
+
+    float scale;                /* Output scale: real = (uint8 - 128) * scale */
+    int ldo;                    /* Row pitch of outputs (>= nnodes) */
+    uint8_t* outputs;           /* Quantized outputs (nbatch x ldo), (y,x,depth) */
+
+    int ncols;                  /* Num. of inputs per node */
+    int kc;                     /* ncols rounded up to 4 */
+    int8_t* weights;            /* Quantized weights, packed for simd_gemm8 */
+    int32_t* zeros;             /* Zero point of each row (128 * weight sum) */
+    float* wscales;             /* Weight scale of each row */
+    float* rscales;             /* Real scale of each row (input * weight) */
+    float* biases;              /* Biases (real) */
+    float* nets;                /* Real net inputs (ncolumns x depth) */
+
+    /* Conv */
+    int kernsize;               /* kernel size */
+    int padding;                /* padding size */
+    int stride;                 /* stride */
+    uint8_t* cols;              /* im2col buffer (npixels x kc) */
+
+    /* Pool */
+    PoolType ptype;             /* pool type */
+
+} QLayer;
+
+
+/*  QNet
+ */
+typedef struct _QNet {
+
+    int nlayers;                /* Num. of Layers */
+    QLayer* layers;             /* Layers (0: input) */
+    int nbatch;                 /* Num. of Samples in the batch */
+    int maxbatch;               /* Capacity of the sample buffers */
+    float* outputs;             /* Softmax outputs of the last Layer */
+
+} QNet;
+
+/* QNet_create(linput, x, nsamples)
+   Quantizes the Layers starting from linput.
+   Weights are quantized per output channel. The activation scales
+   are calibrated by running the Layers on nsamples inputs x.
+   The last Layer must be a full Layer (softmax).
+*/
+QNet* QNet_create(Layer* linput, const nn_real* x, int nsamples);
+
+/* QNet_destroy(self)
+   Releases the memory.
+*/
+void QNet_destroy(QNet* self);
+
+/* QNet_setInputsBatch(self, values, nbatch)
+   Sets the input values of nbatch samples and runs the network.
+   values is a (nbatch x nnodes) matrix.
+*/
+void QNet_setInputsBatch(QNet* self, const nn_real* values, int nbatch);
+
+/* QNet_getOutputs(self, outputs)
+   Gets the output values (nbatch x nnodes).
+*/
+void QNet_getOutputs(const QNet* self, nn_real* outputs);
@@ -3,12 +3,17 @@
   Recurrent Neural Network in C.
 
   $ cc -o rnn rnn.c -lm
+  $ cc -DNN_FAST_MATH -o rnn rnn.c simd.c -lm
 */
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#ifdef NN_FAST_MATH
+#include "cnn.h"
+#include "simd.h"
+#endif
 
 #define DEBUG_LAYER 0
 
@@ -271,9 +276,14 @@ static void RNNLayer_feedForw(RNNLayer* self)
     }
     assert (kx == self->nxweights);
     assert (kh == self->nhweights);
+/* simd_tanh() takes nn_reals, but rnn.c is always double. */
+#if defined(NN_FAST_MATH) && !defined(NN_FLOAT)
+    simd_tanh(self->nnodes, self->temp, self->outputs);
+#else
     for (int i = 0; i < self->nnodes; i++) {
         self->outputs[i] = tanh(self->temp[i]);
     }
+#endif
 
 #if DEBUG_LAYER
     fprintf(stderr, "RNNLayer_feedForw(Layer%d):\n", self->lid);
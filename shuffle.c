@@ -0,0 +1,143 @@
+/*
+  shuffle.c
+  Per-epoch sample permutations.
+
+  Every epoch visits each sample exactly once (Fisher-Yates with
+  an unbiased bounded random number). The block mode shuffles the
+  order of the blocks and then the samples within each block.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "shuffle.h"
+
+#define DEBUG_SHUFFLE 0
+
+
+/* shuffle_seed(seed, n)
+   Returns a random state derived from seed and n.
+*/
+uint64_t shuffle_seed(uint64_t seed, uint64_t n)
+{
+    uint64_t state = seed ^ (n * 0xd1b54a32d192ed03ULL);
+    shuffle_next(&state);
+    return state;
+}
+
+/* shuffle_next(state)
+   Returns a random 32-bit number (splitmix64).
+*/
+uint32_t shuffle_next(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (uint32_t)((z ^ (z >> 31)) >> 32);
+}
+
+/* shuffle_below(state, n)
+   Returns an unbiased random number in [0, n).
+*/
+uint32_t shuffle_below(uint64_t* state, uint32_t n)
+{
+    assert (0 < n);
+    /* Multiply and reject the few values that would be biased. */
+    uint64_t m = (uint64_t)shuffle_next(state) * n;
+    if ((uint32_t)m < n) {
+        uint32_t t = -n % n;
+        while ((uint32_t)m < t) {
+            m = (uint64_t)shuffle_next(state) * n;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+/* shuffle_perm(state, a, n)
+   Shuffles an array a of n elements.
+*/
+static void shuffle_perm(uint64_t* state, int* a, int n)
+{
+    for (int i = n-1; 0 < i; i--) {
+        int j = shuffle_below(state, i+1);
+        int t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+/* Shuffler_create(size, mode, blocksize, seed)
+   Creates a Shuffler for size samples.
+*/
+Shuffler* Shuffler_create(int size, ShuffleMode mode, int blocksize, uint64_t seed)
+{
+    assert (0 < size);
+    assert (mode == SHUFFLE_FULL || 0 < blocksize);
+
+    Shuffler* self = (Shuffler*)calloc(1, sizeof(Shuffler));
+    if (self == NULL) return NULL;
+    self->mode = mode;
+    self->size = size;
+    self->blocksize = (mode == SHUFFLE_BLOCK)? blocksize : size;
+    self->seed = seed;
+    self->epoch = -1;
+    self->perm = (int*)calloc(size, sizeof(int));
+    int nblocks = (size + self->blocksize-1) / self->blocksize;
+    self->blocks = (int*)calloc(nblocks, sizeof(int));
+
+#if DEBUG_SHUFFLE
+    fprintf(stderr, "Shuffler_create: size=%d, mode=%d, blocksize=%d\n",
+            size, mode, self->blocksize);
+#endif
+    return self;
+}
+
+/* Shuffler_destroy(self)
+   Releases the memory.
+*/
+void Shuffler_destroy(Shuffler* self)
+{
+    assert (self != NULL);
+    free(self->perm);
+    free(self->blocks);
+    free(self);
+}
+
+/* Shuffler_shuffle(self, epoch)
+   Generates the permutation of an epoch.
+*/
+static void Shuffler_shuffle(Shuffler* self, long epoch)
+{
+    uint64_t state = shuffle_seed(self->seed, epoch);
+    int bs = self->blocksize;
+    int nblocks = (self->size + bs-1) / bs;
+    for (int b = 0; b < nblocks; b++) {
+        self->blocks[b] = b;
+    }
+    shuffle_perm(&state, self->blocks, nblocks);
+    int* p = self->perm;
+    for (int b = 0; b < nblocks; b++) {
+        int i0 = self->blocks[b] * bs;
+        int i1 = (i0+bs < self->size)? (i0+bs) : self->size;
+        for (int i = i0; i < i1; i++) {
+            p[i-i0] = i;
+        }
+        shuffle_perm(&state, p, i1-i0);
+        p += i1-i0;
+    }
+    self->epoch = epoch;
+}
+
+/* Shuffler_get(self, i)
+   Returns the i-th sample index of the whole sequence.
+*/
+int Shuffler_get(Shuffler* self, long i)
+{
+    assert (self != NULL);
+    assert (0 <= i);
+    long epoch = i / self->size;
+    if (epoch != self->epoch) {
+        Shuffler_shuffle(self, epoch);
+    }
+    return self->perm[i % self->size];
+}
@@ -0,0 +1,65 @@
+/*
+  shuffle.h
+  Per-epoch sample permutations.
+*/
+
+#include <stdint.h>
+
+
+/* shuffle_seed(seed, n)
+   Returns a random state derived from seed and n.
+*/
+uint64_t shuffle_seed(uint64_t seed, uint64_t n);
+
+/* shuffle_next(state)
+   Returns a random 32-bit number (splitmix64).
+*/
+uint32_t shuffle_next(uint64_t* state);
+
+/* shuffle_below(state, n)
+   Returns an unbiased random number in [0, n).
+*/
+uint32_t shuffle_below(uint64_t* state, uint32_t n);
+
+
+/*  ShuffleMode
+ */
+typedef enum _ShuffleMode {
+    SHUFFLE_FULL = 0,           /* Every sample at random */
+    SHUFFLE_BLOCK               /* Blocks at random, then within each block */
+} ShuffleMode;
+
+/*  Shuffler
+ */
+typedef struct _Shuffler {
+
+    ShuffleMode mode;           /* Shuffle mode */
+    int size;                   /* Num. of samples */
+    int blocksize;              /* Num. of samples per block */
+    uint64_t seed;              /* Random seed */
+    long epoch;                 /* Epoch of perm (-1: none) */
+    int* perm;                  /* Permutation (size) */
+    int* blocks;                /* Block order */
+
+} Shuffler;
+
+/* Shuffler_create(size, mode, blocksize, seed)
+   Creates a Shuffler for size samples. In SHUFFLE_BLOCK mode,
+   the samples are taken in blocks of blocksize consecutive ones,
+   so that reads stay mostly sequential.
+*/
+Shuffler* Shuffler_create(int size, ShuffleMode mode, int blocksize, uint64_t seed);
+
+/* Shuffler_destroy(self)
+   Releases the memory.
+*/
+void Shuffler_destroy(Shuffler* self);
+
+/* Shuffler_get(self, i)
+   Returns the i-th sample index of the whole sequence, i.e. the
+   (i % size)-th of the permutation of epoch (i / size).
+   The permutation of an epoch only depends on the seed, so
+   Shufflers with the same settings agree with each other.
+   Regenerates the permutation when the epoch changes.
+*/
+int Shuffler_get(Shuffler* self, long i);
@@ -0,0 +1,808 @@
+/*
+  simd.c
+  Vectorized kernels with runtime CPU dispatch.
+
+  Each instruction set gets its own copy of simd_impl.h compiled
+  with the matching target options, so the file builds without
+  any -m flags and the best copy is picked with cpuid at startup.
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "cnn.h"
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+
+/*  Scalar kernels
+ */
+
+/* dot_scalar(n, x, y) */
+static nn_real dot_scalar(int n, const nn_real* x, const nn_real* y)
+{
+    nn_real t = 0;
+    for (int i = 0; i < n; i++) {
+        t += x[i] * y[i];
+    }
+    return t;
+}
+
+/* axpy_scalar(n, a, x, y) */
+static void axpy_scalar(int n, nn_real a, const nn_real* x, nn_real* y)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+/* kernel_scalar(kc, pa, pb, tile)
+   4 rows x 8 columns.
+*/
+static void kernel_scalar(
+    int kc, const nn_real* pa, const nn_real* pb, nn_real* tile)
+{
+    nn_real c0[8] = {0}, c1[8] = {0}, c2[8] = {0}, c3[8] = {0};
+    for (int p = 0; p < kc; p++) {
+        nn_real a0 = pa[0], a1 = pa[1], a2 = pa[2], a3 = pa[3];
+        for (int j = 0; j < 8; j++) {
+            nn_real b = pb[j];
+            c0[j] += a0 * b;
+            c1[j] += a1 * b;
+            c2[j] += a2 * b;
+            c3[j] += a3 * b;
+        }
+        pa += 4;
+        pb += 8;
+    }
+    for (int j = 0; j < 8; j++) {
+        tile[j] = c0[j];
+        tile[8+j] = c1[j];
+        tile[16+j] = c2[j];
+        tile[24+j] = c3[j];
+    }
+}
+
+
+/*  Fast exp/tanh
+    exp(x) = 2^n * p(r) with x = n*ln2 + r, |r| <= ln2/2, where p is
+    the Taylor polynomial of exp(r). 2^n is built from the exponent
+    bits: adding FEXP_SHIFT to x*log2(e) rounds it to the integer n,
+    which then sits in the low bits of the sum.
+    tanh(|x|) = (1 - exp(-2|x|)) / (1 + exp(-2|x|)).
+ */
+#ifdef NN_FLOAT
+#define FEXP_MIN -87.0f
+#define FEXP_MAX 88.0f
+#define FEXP_SHIFT 12582912.0f  /* 1.5 * 2^23 */
+#define FEXP_LN2HI 0.693145751953125f
+#define FEXP_LN2LO 1.428606765330187e-06f
+#define FEXP_DEG 7
+#else
+#define FEXP_MIN -708.0
+#define FEXP_MAX 709.0
+#define FEXP_SHIFT 6755399441055744.0  /* 1.5 * 2^52 */
+#define FEXP_LN2HI 6.93147180369123816490e-01
+#define FEXP_LN2LO 1.90821492927058770002e-10
+#define FEXP_DEG 12
+#endif
+#define FEXP_LOG2E 1.44269504088896340736
+
+/* fexp_coefs: 1/k! for k = FEXP_DEG...0 */
+static const nn_real fexp_coefs[] = {
+#ifndef NN_FLOAT
+    2.08767569878680989792e-09, 2.50521083854417187751e-08,
+    2.75573192239858906526e-07, 2.75573192239858906526e-06,
+    2.48015873015873015873e-05,
+#endif
+    1.98412698412698412698e-04, 1.38888888888888888889e-03,
+    8.33333333333333333333e-03, 4.16666666666666666667e-02,
+    1.66666666666666666667e-01, 5.00000000000000000000e-01,
+    1.0, 1.0,
+};
+
+/* fexp(x): scalar version of the vector kernels. */
+static inline nn_real fexp(nn_real x)
+{
+    if (x < FEXP_MIN) { x = FEXP_MIN; }
+    if (FEXP_MAX < x) { x = FEXP_MAX; }
+    nn_real t = x * (nn_real)FEXP_LOG2E + FEXP_SHIFT;
+    nn_real n = t - FEXP_SHIFT;
+    nn_real r = x - n * FEXP_LN2HI;
+    r = r - n * FEXP_LN2LO;
+    nn_real p = fexp_coefs[0];
+    for (int k = 1; k <= FEXP_DEG; k++) {
+        p = p * r + fexp_coefs[k];
+    }
+#ifdef NN_FLOAT
+    uint32_t b = ((int32_t)n + 127) << 23;
+#else
+    uint64_t b = (uint64_t)((int64_t)n + 1023) << 52;
+#endif
+    nn_real e;
+    memcpy(&e, &b, sizeof(e));
+    return p * e;
+}
+
+/* exp_scalar(n, x, y) */
+static void exp_scalar(int n, const nn_real* x, nn_real* y)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] = fexp(x[i]);
+    }
+}
+
+/* tanh_scalar(n, x, y) */
+static void tanh_scalar(int n, const nn_real* x, nn_real* y)
+{
+    for (int i = 0; i < n; i++) {
+        nn_real a = (x[i] < 0)? -x[i] : x[i];
+        nn_real e = fexp(-2*a);
+        nn_real t = (1 - e) / (1 + e);
+        y[i] = (x[i] < 0)? -t : t;
+    }
+}
+
+/* sgd_scalar(n, a, p, u) */
+static void sgd_scalar(int n, nn_real a, nn_real* p, nn_real* u)
+{
+    for (int i = 0; i < n; i++) {
+        p[i] -= a * u[i];
+        u[i] = 0;
+    }
+}
+
+/* momentum_scalar(n, a, s, mu, nesterov, p, u, v) */
+static void momentum_scalar(
+    int n, nn_real a, nn_real s, nn_real mu, int nesterov,
+    nn_real* p, nn_real* u, nn_real* v)
+{
+    for (int i = 0; i < n; i++) {
+        nn_real g = s * u[i];
+        nn_real w = mu * v[i] + g;
+        v[i] = w;
+        p[i] -= a * ((nesterov)? (g + mu * w) : w);
+        u[i] = 0;
+    }
+}
+
+/* adam_scalar(n, a, s, b1, b2, eps, p, u, m, v) */
+static void adam_scalar(
+    int n, nn_real a, nn_real s, nn_real b1, nn_real b2, nn_real eps,
+    nn_real* p, nn_real* u, nn_real* m, nn_real* v)
+{
+    for (int i = 0; i < n; i++) {
+        nn_real g = s * u[i];
+        nn_real m1 = b1 * m[i] + (1 - b1) * g;
+        nn_real v1 = b2 * v[i] + (1 - b2) * g * g;
+        m[i] = m1;
+        v[i] = v1;
+        p[i] -= a * m1 / (sqrt(v1) + eps);
+        u[i] = 0;
+    }
+}
+
+
+/* gemm8_scalar(kc, pa, b, zero, scale, bias, c)
+   16 rows x 8 columns.
+*/
+static void gemm8_scalar(
+    int kc, const int8_t* pa, const uint8_t* const* b,
+    const int32_t* zero, const float* scale, const float* bias, float* c)
+{
+    int32_t t[SIMD_NR8 * SIMD_MR8] = { 0 };
+    for (int k = 0; k < kc; k += 4) {
+        for (int j = 0; j < SIMD_NR8; j++) {
+            const uint8_t* bj = &b[j][k];
+            int32_t* tj = &t[j * SIMD_MR8];
+            for (int r = 0; r < SIMD_MR8; r++) {
+                const int8_t* a = &pa[r * 4];
+                tj[r] += a[0]*bj[0] + a[1]*bj[1] + a[2]*bj[2] + a[3]*bj[3];
+            }
+        }
+        pa += 4 * SIMD_MR8;
+    }
+    for (int j = 0; j < SIMD_NR8; j++) {
+        for (int r = 0; r < SIMD_MR8; r++) {
+            int i = j * SIMD_MR8 + r;
+            c[i] = (t[i] - zero[r]) * scale[r] + bias[r];
+        }
+    }
+}
+
+/* quant8_scalar(n, x, inv, lo, y) */
+static void quant8_scalar(int n, const float* x, float inv, int lo, uint8_t* y)
+{
+    for (int i = 0; i < n; i++) {
+        float v = x[i] * inv;
+        /* Like the vector max/min: NaN goes to lo. */
+        if (!(lo <= v)) { v = lo; }
+        if (127 < v) { v = 127; }
+        /* Half to even, like cvtps2dq. */
+        y[i] = (uint8_t)((int)nearbyintf(v) + 128);
+    }
+}
+
+
+#if SIMD_X86
+
+/* load32(p): loads 4 bytes as an int32. */
+static inline int32_t load32(const uint8_t* p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*  SSE2 kernels
+ */
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#define SIMD_FN(name) name##_sse2
+#ifdef NN_FLOAT
+#define VEC __m128
+#define LANES 4
+#define VZERO() _mm_setzero_ps()
+#define VLOAD(p) _mm_loadu_ps(p)
+#define VSTORE(p, v) _mm_storeu_ps(p, v)
+#define VSET1(x) _mm_set1_ps(x)
+#define VFMA(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define VADD(a, b) _mm_add_ps(a, b)
+#define VSUB(a, b) _mm_sub_ps(a, b)
+#define VMUL(a, b) _mm_mul_ps(a, b)
+#define VDIV(a, b) _mm_div_ps(a, b)
+#define VSQRT(a) _mm_sqrt_ps(a)
+#define VMIN(a, b) _mm_min_ps(a, b)
+#define VMAX(a, b) _mm_max_ps(a, b)
+#define VAND(a, b) _mm_and_ps(a, b)
+#define VANDNOT(a, b) _mm_andnot_ps(a, b)
+#define VXOR(a, b) _mm_xor_ps(a, b)
+#define VPOW2(t) _mm_castsi128_ps(_mm_add_epi32(                        \
+        _mm_slli_epi32(_mm_castps_si128(t), 23), _mm_set1_epi32(127 << 23)))
+#else
+#define VEC __m128d
+#define LANES 2
+#define VZERO() _mm_setzero_pd()
+#define VLOAD(p) _mm_loadu_pd(p)
+#define VSTORE(p, v) _mm_storeu_pd(p, v)
+#define VSET1(x) _mm_set1_pd(x)
+#define VFMA(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+#define VADD(a, b) _mm_add_pd(a, b)
+#define VSUB(a, b) _mm_sub_pd(a, b)
+#define VMUL(a, b) _mm_mul_pd(a, b)
+#define VDIV(a, b) _mm_div_pd(a, b)
+#define VSQRT(a) _mm_sqrt_pd(a)
+#define VMIN(a, b) _mm_min_pd(a, b)
+#define VMAX(a, b) _mm_max_pd(a, b)
+#define VAND(a, b) _mm_and_pd(a, b)
+#define VANDNOT(a, b) _mm_andnot_pd(a, b)
+#define VXOR(a, b) _mm_xor_pd(a, b)
+#define VPOW2(t) _mm_castsi128_pd(_mm_add_epi64(                        \
+        _mm_slli_epi64(_mm_castpd_si128(t), 52), _mm_set1_epi64x(1023LL << 52)))
+#endif
+#define VEND()
+#include "simd_impl.h"
+#undef SIMD_FN
+#undef VEC
+#undef LANES
+#undef VZERO
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VFMA
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VSQRT
+#undef VMIN
+#undef VMAX
+#undef VAND
+#undef VANDNOT
+#undef VXOR
+#undef VPOW2
+#undef VEND
+#pragma GCC pop_options
+
+/*  AVX2 kernels
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define SIMD_FN(name) name##_avx2
+#ifdef NN_FLOAT
+#define VEC __m256
+#define LANES 8
+#define VZERO() _mm256_setzero_ps()
+#define VLOAD(p) _mm256_loadu_ps(p)
+#define VSTORE(p, v) _mm256_storeu_ps(p, v)
+#define VSET1(x) _mm256_set1_ps(x)
+#define VFMA(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define VADD(a, b) _mm256_add_ps(a, b)
+#define VSUB(a, b) _mm256_sub_ps(a, b)
+#define VMUL(a, b) _mm256_mul_ps(a, b)
+#define VDIV(a, b) _mm256_div_ps(a, b)
+#define VSQRT(a) _mm256_sqrt_ps(a)
+#define VMIN(a, b) _mm256_min_ps(a, b)
+#define VMAX(a, b) _mm256_max_ps(a, b)
+#define VAND(a, b) _mm256_and_ps(a, b)
+#define VANDNOT(a, b) _mm256_andnot_ps(a, b)
+#define VXOR(a, b) _mm256_xor_ps(a, b)
+#define VPOW2(t) _mm256_castsi256_ps(_mm256_add_epi32(                  \
+        _mm256_slli_epi32(_mm256_castps_si256(t), 23), _mm256_set1_epi32(127 << 23)))
+#else
+#define VEC __m256d
+#define LANES 4
+#define VZERO() _mm256_setzero_pd()
+#define VLOAD(p) _mm256_loadu_pd(p)
+#define VSTORE(p, v) _mm256_storeu_pd(p, v)
+#define VSET1(x) _mm256_set1_pd(x)
+#define VFMA(a, b, c) _mm256_fmadd_pd(a, b, c)
+#define VADD(a, b) _mm256_add_pd(a, b)
+#define VSUB(a, b) _mm256_sub_pd(a, b)
+#define VMUL(a, b) _mm256_mul_pd(a, b)
+#define VDIV(a, b) _mm256_div_pd(a, b)
+#define VSQRT(a) _mm256_sqrt_pd(a)
+#define VMIN(a, b) _mm256_min_pd(a, b)
+#define VMAX(a, b) _mm256_max_pd(a, b)
+#define VAND(a, b) _mm256_and_pd(a, b)
+#define VANDNOT(a, b) _mm256_andnot_pd(a, b)
+#define VXOR(a, b) _mm256_xor_pd(a, b)
+#define VPOW2(t) _mm256_castsi256_pd(_mm256_add_epi64(                  \
+        _mm256_slli_epi64(_mm256_castpd_si256(t), 52), _mm256_set1_epi64x(1023LL << 52)))
+#endif
+#define VEND() _mm256_zeroupper()
+#include "simd_impl.h"
+#undef SIMD_FN
+#undef VEC
+#undef LANES
+#undef VZERO
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VFMA
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VSQRT
+#undef VMIN
+#undef VMAX
+#undef VAND
+#undef VANDNOT
+#undef VXOR
+#undef VPOW2
+#undef VEND
+
+/* gemm8_avxvnni(kc, pa, b, zero, scale, bias, c)
+   16 rows x 8 columns with AVX-VNNI (vpdpbusd on 8 lanes).
+   Each step multiplies 4 uint8 of a column (broadcast) with
+   4 int8 of each row and adds them to the int32 lanes.
+*/
+#define REQUANT256(acc, r) _mm256_fmadd_ps(                             \
+        _mm256_cvtepi32_ps(_mm256_sub_epi32(acc, z##r)), s##r, o##r)
+__attribute__((target("avxvnni")))
+static void gemm8_avxvnni(
+    int kc, const int8_t* pa, const uint8_t* const* b,
+    const int32_t* zero, const float* scale, const float* bias, float* c)
+{
+    __m256i z0 = _mm256_loadu_si256((const __m256i*)&zero[0]);
+    __m256i z1 = _mm256_loadu_si256((const __m256i*)&zero[8]);
+    __m256 s0 = _mm256_loadu_ps(&scale[0]), s1 = _mm256_loadu_ps(&scale[8]);
+    __m256 o0 = _mm256_loadu_ps(&bias[0]), o1 = _mm256_loadu_ps(&bias[8]);
+    for (int j = 0; j < SIMD_NR8; j += 4) {
+        const uint8_t* b0 = b[j];
+        const uint8_t* b1 = b[j+1];
+        const uint8_t* b2 = b[j+2];
+        const uint8_t* b3 = b[j+3];
+        const int8_t* p = pa;
+        __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+        __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+        __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+        __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+        for (int k = 0; k < kc; k += 4) {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*)&p[0]);
+            __m256i a1 = _mm256_loadu_si256((const __m256i*)&p[32]);
+            __m256i v;
+            v = _mm256_set1_epi32(load32(&b0[k]));
+            c00 = _mm256_dpbusd_avx_epi32(c00, v, a0);
+            c01 = _mm256_dpbusd_avx_epi32(c01, v, a1);
+            v = _mm256_set1_epi32(load32(&b1[k]));
+            c10 = _mm256_dpbusd_avx_epi32(c10, v, a0);
+            c11 = _mm256_dpbusd_avx_epi32(c11, v, a1);
+            v = _mm256_set1_epi32(load32(&b2[k]));
+            c20 = _mm256_dpbusd_avx_epi32(c20, v, a0);
+            c21 = _mm256_dpbusd_avx_epi32(c21, v, a1);
+            v = _mm256_set1_epi32(load32(&b3[k]));
+            c30 = _mm256_dpbusd_avx_epi32(c30, v, a0);
+            c31 = _mm256_dpbusd_avx_epi32(c31, v, a1);
+            p += 4 * SIMD_MR8;
+        }
+        float* t = &c[j * SIMD_MR8];
+        _mm256_storeu_ps(&t[0], REQUANT256(c00, 0));
+        _mm256_storeu_ps(&t[8], REQUANT256(c01, 1));
+        _mm256_storeu_ps(&t[16], REQUANT256(c10, 0));
+        _mm256_storeu_ps(&t[24], REQUANT256(c11, 1));
+        _mm256_storeu_ps(&t[32], REQUANT256(c20, 0));
+        _mm256_storeu_ps(&t[40], REQUANT256(c21, 1));
+        _mm256_storeu_ps(&t[48], REQUANT256(c30, 0));
+        _mm256_storeu_ps(&t[56], REQUANT256(c31, 1));
+    }
+    _mm256_zeroupper();
+}
+#undef REQUANT256
+
+/* quant8_avx2(n, x, inv, lo, y) */
+static void quant8_avx2(int n, const float* x, float inv, int lo, uint8_t* y)
+{
+    __m256 vinv = _mm256_set1_ps(inv);
+    __m256 vlo = _mm256_set1_ps(lo);
+    __m256 vhi = _mm256_set1_ps(127);
+    __m256i zero = _mm256_set1_epi32(128);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(&x[i]), vinv);
+        v = _mm256_min_ps(_mm256_max_ps(v, vlo), vhi);
+        __m256i q = _mm256_add_epi32(_mm256_cvtps_epi32(v), zero);
+        /* Pack 8 int32 into 8 uint8. */
+        __m128i w = _mm_packs_epi32(
+            _mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i*)&y[i], _mm_packus_epi16(w, w));
+    }
+    _mm256_zeroupper();
+    quant8_scalar(n-i, &x[i], inv, lo, &y[i]);
+}
+
+/* gemm8_avx2(kc, pa, b, zero, scale, bias, c)
+   16 rows x 8 columns with AVX2 (no VNNI).
+   Both operands are widened to int16, so that vpmaddwd adds
+   exact products in pairs: each int32 lane gets 2 of the 4 terms
+   of a row, and the pairs are summed at the end.
+*/
+#define REQUANT256(acc, r) _mm256_fmadd_ps(                             \
+        _mm256_cvtepi32_ps(_mm256_sub_epi32(acc, z##r)), s##r, o##r)
+static void gemm8_avx2(
+    int kc, const int8_t* pa, const uint8_t* const* b,
+    const int32_t* zero, const float* scale, const float* bias, float* c)
+{
+    __m256i z0 = _mm256_loadu_si256((const __m256i*)&zero[0]);
+    __m256i z1 = _mm256_loadu_si256((const __m256i*)&zero[8]);
+    __m256 s0 = _mm256_loadu_ps(&scale[0]), s1 = _mm256_loadu_ps(&scale[8]);
+    __m256 o0 = _mm256_loadu_ps(&bias[0]), o1 = _mm256_loadu_ps(&bias[8]);
+    /* hadd leaves the rows as 0,1,4,5 | 2,3,6,7. */
+    __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    for (int j = 0; j < SIMD_NR8; j += 2) {
+        const uint8_t* b0 = b[j];
+        const uint8_t* b1 = b[j+1];
+        const int8_t* p = pa;
+        /* cXq: column X, rows 4q..4q+3 (2 partial sums each). */
+        __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+        __m256i c02 = _mm256_setzero_si256(), c03 = _mm256_setzero_si256();
+        __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+        __m256i c12 = _mm256_setzero_si256(), c13 = _mm256_setzero_si256();
+        for (int k = 0; k < kc; k += 4) {
+            __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)&p[0]));
+            __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)&p[16]));
+            __m256i a2 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)&p[32]));
+            __m256i a3 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)&p[48]));
+            __m256i v;
+            v = _mm256_broadcastq_epi64(
+                _mm_cvtepu8_epi16(_mm_cvtsi32_si128(load32(&b0[k]))));
+            c00 = _mm256_add_epi32(c00, _mm256_madd_epi16(a0, v));
+            c01 = _mm256_add_epi32(c01, _mm256_madd_epi16(a1, v));
+            c02 = _mm256_add_epi32(c02, _mm256_madd_epi16(a2, v));
+            c03 = _mm256_add_epi32(c03, _mm256_madd_epi16(a3, v));
+            v = _mm256_broadcastq_epi64(
+                _mm_cvtepu8_epi16(_mm_cvtsi32_si128(load32(&b1[k]))));
+            c10 = _mm256_add_epi32(c10, _mm256_madd_epi16(a0, v));
+            c11 = _mm256_add_epi32(c11, _mm256_madd_epi16(a1, v));
+            c12 = _mm256_add_epi32(c12, _mm256_madd_epi16(a2, v));
+            c13 = _mm256_add_epi32(c13, _mm256_madd_epi16(a3, v));
+            p += 4 * SIMD_MR8;
+        }
+        float* t = &c[j * SIMD_MR8];
+        __m256i r;
+        r = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(c00, c01), order);
+        _mm256_storeu_ps(&t[0], REQUANT256(r, 0));
+        r = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(c02, c03), order);
+        _mm256_storeu_ps(&t[8], REQUANT256(r, 1));
+        r = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(c10, c11), order);
+        _mm256_storeu_ps(&t[16], REQUANT256(r, 0));
+        r = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(c12, c13), order);
+        _mm256_storeu_ps(&t[24], REQUANT256(r, 1));
+    }
+    _mm256_zeroupper();
+}
+#undef REQUANT256
+#pragma GCC pop_options
+
+/*  AVX-512 kernels
+ */
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#define SIMD_FN(name) name##_avx512
+#ifdef NN_FLOAT
+#define VEC __m512
+#define LANES 16
+#define VZERO() _mm512_setzero_ps()
+#define VLOAD(p) _mm512_loadu_ps(p)
+#define VSTORE(p, v) _mm512_storeu_ps(p, v)
+#define VSET1(x) _mm512_set1_ps(x)
+#define VFMA(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define VADD(a, b) _mm512_add_ps(a, b)
+#define VSUB(a, b) _mm512_sub_ps(a, b)
+#define VMUL(a, b) _mm512_mul_ps(a, b)
+#define VDIV(a, b) _mm512_div_ps(a, b)
+#define VSQRT(a) _mm512_sqrt_ps(a)
+#define VMIN(a, b) _mm512_min_ps(a, b)
+#define VMAX(a, b) _mm512_max_ps(a, b)
+#define VAND(a, b) _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define VANDNOT(a, b) _mm512_castsi512_ps(_mm512_andnot_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define VXOR(a, b) _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define VPOW2(t) _mm512_castsi512_ps(_mm512_add_epi32(                          \
+        _mm512_slli_epi32(_mm512_castps_si512(t), 23), _mm512_set1_epi32(127 << 23)))
+#else
+#define VEC __m512d
+#define LANES 8
+#define VZERO() _mm512_setzero_pd()
+#define VLOAD(p) _mm512_loadu_pd(p)
+#define VSTORE(p, v) _mm512_storeu_pd(p, v)
+#define VSET1(x) _mm512_set1_pd(x)
+#define VFMA(a, b, c) _mm512_fmadd_pd(a, b, c)
+#define VADD(a, b) _mm512_add_pd(a, b)
+#define VSUB(a, b) _mm512_sub_pd(a, b)
+#define VMUL(a, b) _mm512_mul_pd(a, b)
+#define VDIV(a, b) _mm512_div_pd(a, b)
+#define VSQRT(a) _mm512_sqrt_pd(a)
+#define VMIN(a, b) _mm512_min_pd(a, b)
+#define VMAX(a, b) _mm512_max_pd(a, b)
+#define VAND(a, b) _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)))
+#define VANDNOT(a, b) _mm512_castsi512_pd(_mm512_andnot_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)))
+#define VXOR(a, b) _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)))
+#define VPOW2(t) _mm512_castsi512_pd(_mm512_add_epi64(                          \
+        _mm512_slli_epi64(_mm512_castpd_si512(t), 52), _mm512_set1_epi64(1023LL << 52)))
+#endif
+#define VEND() _mm256_zeroupper()
+#include "simd_impl.h"
+#undef SIMD_FN
+#undef VEC
+#undef LANES
+#undef VZERO
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VFMA
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VSQRT
+#undef VMIN
+#undef VMAX
+#undef VAND
+#undef VANDNOT
+#undef VXOR
+#undef VPOW2
+#undef VEND
+
+/* gemm8_avx512(kc, pa, b, zero, scale, bias, c)
+   16 rows x 8 columns with AVX512-VNNI (vpdpbusd on 16 lanes).
+*/
+#define REQUANT512(acc) _mm512_fmadd_ps(                                \
+        _mm512_cvtepi32_ps(_mm512_sub_epi32(acc, z)), sc, o)
+__attribute__((target("avx512vnni")))
+static void gemm8_avx512(
+    int kc, const int8_t* pa, const uint8_t* const* b,
+    const int32_t* zero, const float* scale, const float* bias, float* c)
+{
+    const uint8_t* b0 = b[0];
+    const uint8_t* b1 = b[1];
+    const uint8_t* b2 = b[2];
+    const uint8_t* b3 = b[3];
+    const uint8_t* b4 = b[4];
+    const uint8_t* b5 = b[5];
+    const uint8_t* b6 = b[6];
+    const uint8_t* b7 = b[7];
+    __m512i c0 = _mm512_setzero_si512(), c1 = _mm512_setzero_si512();
+    __m512i c2 = _mm512_setzero_si512(), c3 = _mm512_setzero_si512();
+    __m512i c4 = _mm512_setzero_si512(), c5 = _mm512_setzero_si512();
+    __m512i c6 = _mm512_setzero_si512(), c7 = _mm512_setzero_si512();
+    for (int k = 0; k < kc; k += 4) {
+        __m512i a = _mm512_loadu_si512(pa);
+        c0 = _mm512_dpbusd_epi32(c0, _mm512_set1_epi32(load32(&b0[k])), a);
+        c1 = _mm512_dpbusd_epi32(c1, _mm512_set1_epi32(load32(&b1[k])), a);
+        c2 = _mm512_dpbusd_epi32(c2, _mm512_set1_epi32(load32(&b2[k])), a);
+        c3 = _mm512_dpbusd_epi32(c3, _mm512_set1_epi32(load32(&b3[k])), a);
+        c4 = _mm512_dpbusd_epi32(c4, _mm512_set1_epi32(load32(&b4[k])), a);
+        c5 = _mm512_dpbusd_epi32(c5, _mm512_set1_epi32(load32(&b5[k])), a);
+        c6 = _mm512_dpbusd_epi32(c6, _mm512_set1_epi32(load32(&b6[k])), a);
+        c7 = _mm512_dpbusd_epi32(c7, _mm512_set1_epi32(load32(&b7[k])), a);
+        pa += 4 * SIMD_MR8;
+    }
+    __m512i z = _mm512_loadu_si512(zero);
+    __m512 sc = _mm512_loadu_ps(scale);
+    __m512 o = _mm512_loadu_ps(bias);
+    _mm512_storeu_ps(&c[0*SIMD_MR8], REQUANT512(c0));
+    _mm512_storeu_ps(&c[1*SIMD_MR8], REQUANT512(c1));
+    _mm512_storeu_ps(&c[2*SIMD_MR8], REQUANT512(c2));
+    _mm512_storeu_ps(&c[3*SIMD_MR8], REQUANT512(c3));
+    _mm512_storeu_ps(&c[4*SIMD_MR8], REQUANT512(c4));
+    _mm512_storeu_ps(&c[5*SIMD_MR8], REQUANT512(c5));
+    _mm512_storeu_ps(&c[6*SIMD_MR8], REQUANT512(c6));
+    _mm512_storeu_ps(&c[7*SIMD_MR8], REQUANT512(c7));
+    _mm256_zeroupper();
+}
+#undef REQUANT512
+
+/* quant8_avx512(n, x, inv, lo, y) */
+static void quant8_avx512(int n, const float* x, float inv, int lo, uint8_t* y)
+{
+    __m512 vinv = _mm512_set1_ps(inv);
+    __m512 vlo = _mm512_set1_ps(lo);
+    __m512 vhi = _mm512_set1_ps(127);
+    __m512i zero = _mm512_set1_epi32(128);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_mul_ps(_mm512_loadu_ps(&x[i]), vinv);
+        v = _mm512_min_ps(_mm512_max_ps(v, vlo), vhi);
+        __m512i q = _mm512_add_epi32(_mm512_cvtps_epi32(v), zero);
+        _mm_storeu_si128((__m128i*)&y[i], _mm512_cvtepi32_epi8(q));
+    }
+    _mm256_zeroupper();
+    quant8_scalar(n-i, &x[i], inv, lo, &y[i]);
+}
+#pragma GCC pop_options
+
+#endif /* SIMD_X86 */
+
+
+/*  Dispatch
+ */
+
+static SimdLevel simd_level = SIMD_SCALAR;
+nn_real (*simd_dot)(int n, const nn_real* x, const nn_real* y) = dot_scalar;
+void (*simd_axpy)(int n, nn_real a, const nn_real* x, nn_real* y) = axpy_scalar;
+int simd_nr = 8;
+void (*simd_kernel)(
+    int kc, const nn_real* pa, const nn_real* pb, nn_real* tile) = kernel_scalar;
+void (*simd_gemm8)(
+    int kc, const int8_t* pa, const uint8_t* const* b,
+    const int32_t* zero, const float* scale, const float* bias,
+    float* c) = gemm8_scalar;
+void (*simd_quant8)(
+    int n, const float* x, float inv, int lo, uint8_t* y) = quant8_scalar;
+void (*simd_exp)(int n, const nn_real* x, nn_real* y) = exp_scalar;
+void (*simd_tanh)(int n, const nn_real* x, nn_real* y) = tanh_scalar;
+void (*simd_sgd)(int n, nn_real a, nn_real* p, nn_real* u) = sgd_scalar;
+void (*simd_momentum)(
+    int n, nn_real a, nn_real s, nn_real mu, int nesterov,
+    nn_real* p, nn_real* u, nn_real* v) = momentum_scalar;
+void (*simd_adam)(
+    int n, nn_real a, nn_real s, nn_real b1, nn_real b2, nn_real eps,
+    nn_real* p, nn_real* u, nn_real* m, nn_real* v) = adam_scalar;
+
+/* simd_detect()
+   Returns the best level supported by the CPU.
+*/
+SimdLevel simd_detect(void)
+{
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("fma")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+/* simd_setLevel(level)
+   Selects the kernels of the given level.
+*/
+int simd_setLevel(SimdLevel level)
+{
+    if (simd_detect() < level) return 0;
+
+    switch (level) {
+#if SIMD_X86
+    case SIMD_SSE2:
+        simd_dot = dot_sse2;
+        simd_axpy = axpy_sse2;
+        simd_kernel = kernel_sse2;
+        simd_exp = exp_sse2;
+        simd_tanh = tanh_sse2;
+        simd_sgd = sgd_sse2;
+        simd_momentum = momentum_sse2;
+        simd_adam = adam_sse2;
+        simd_gemm8 = gemm8_scalar;
+        simd_quant8 = quant8_scalar;
+        simd_nr = 2 * sizeof(__m128) / sizeof(nn_real);
+        break;
+    case SIMD_AVX2:
+        simd_dot = dot_avx2;
+        simd_axpy = axpy_avx2;
+        simd_kernel = kernel_avx2;
+        simd_exp = exp_avx2;
+        simd_tanh = tanh_avx2;
+        simd_sgd = sgd_avx2;
+        simd_momentum = momentum_avx2;
+        simd_adam = adam_avx2;
+        simd_gemm8 = (__builtin_cpu_supports("avxvnni"))?
+            gemm8_avxvnni : gemm8_avx2;
+        simd_quant8 = quant8_avx2;
+        simd_nr = 2 * sizeof(__m256) / sizeof(nn_real);
+        break;
+    case SIMD_AVX512:
+        simd_dot = dot_avx512;
+        simd_axpy = axpy_avx512;
+        simd_kernel = kernel_avx512;
+        simd_exp = exp_avx512;
+        simd_tanh = tanh_avx512;
+        simd_sgd = sgd_avx512;
+        simd_momentum = momentum_avx512;
+        simd_adam = adam_avx512;
+        simd_gemm8 = (__builtin_cpu_supports("avx512vnni"))? gemm8_avx512 :
+            (__builtin_cpu_supports("avxvnni"))? gemm8_avxvnni : gemm8_avx2;
+        simd_quant8 = quant8_avx512;
+        simd_nr = 2 * sizeof(__m512) / sizeof(nn_real);
+        break;
+#endif
+    default:
+        simd_dot = dot_scalar;
+        simd_axpy = axpy_scalar;
+        simd_kernel = kernel_scalar;
+        simd_exp = exp_scalar;
+        simd_tanh = tanh_scalar;
+        simd_sgd = sgd_scalar;
+        simd_momentum = momentum_scalar;
+        simd_adam = adam_scalar;
+        simd_gemm8 = gemm8_scalar;
+        simd_quant8 = quant8_scalar;
+        simd_nr = 8;
+        break;
+    }
+    assert (simd_nr <= SIMD_MAXNR);
+    simd_level = level;
+    return 1;
+}
+
+/* simd_getLevel()
+   Returns the selected level.
+*/
+SimdLevel simd_getLevel(void)
+{
+    return simd_level;
+}
+
+/* simd_name(level)
+   Returns the name of the level.
+*/
+const char* simd_name(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_SSE2:
+        return "sse2";
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_AVX512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+/* simd_init()
+   Selects the best kernels at startup.
+*/
+__attribute__((constructor))
+static void simd_init(void)
+{
+    simd_setLevel(simd_detect());
+}
@@ -0,0 +1,123 @@
+/*
+  simd.h
+  Vectorized kernels with runtime CPU dispatch.
+  Operates on nn_real (cnn.h).
+*/
+
+#include <stdint.h>
+
+
+/*  SimdLevel
+ */
+typedef enum _SimdLevel {
+    SIMD_SCALAR = 0,            /* Plain C */
+    SIMD_SSE2,                  /* SSE2 */
+    SIMD_AVX2,                  /* AVX2 + FMA */
+    SIMD_AVX512                 /* AVX-512F */
+} SimdLevel;
+
+/* simd_detect()
+   Returns the best level supported by the CPU.
+*/
+SimdLevel simd_detect(void);
+
+/* simd_setLevel(level)
+   Selects the kernels of the given level.
+   Returns 0 if the CPU does not support it.
+   The best level is selected at startup.
+*/
+int simd_setLevel(SimdLevel level);
+
+/* simd_getLevel()
+   Returns the selected level.
+*/
+SimdLevel simd_getLevel(void);
+
+/* simd_name(level)
+   Returns the name of the level.
+*/
+const char* simd_name(SimdLevel level);
+
+/* simd_dot(n, x, y)
+   Returns sum(x[i] * y[i]).
+*/
+extern nn_real (*simd_dot)(int n, const nn_real* x, const nn_real* y);
+
+/* simd_axpy(n, a, x, y)
+   Computes y[i] += a * x[i].
+*/
+extern void (*simd_axpy)(int n, nn_real a, const nn_real* x, nn_real* y);
+
+/* simd_kernel(kc, pa, pb, tile)
+   GEMM micro kernel: computes an (SIMD_MR x simd_nr) tile
+   from a packed A panel (kc x SIMD_MR) and B panel (kc x simd_nr).
+   The tile is stored row by row.
+*/
+#define SIMD_MR 4
+#define SIMD_MAXNR 32
+extern int simd_nr;
+extern void (*simd_kernel)(
+    int kc, const nn_real* pa, const nn_real* pb, nn_real* tile);
+
+/* simd_gemm8(kc, pa, b, zero, scale, bias, c)
+   Int8 micro kernel: computes an (SIMD_MR8 x SIMD_NR8) tile
+     t(r,j) = sum(A(r,k) * b[j][k]) accumulated in int32,
+     c[j*SIMD_MR8 + r] = (t(r,j) - zero[r]) * scale[r] + bias[r].
+   A is a panel of int8 rows packed by groups of 4 columns:
+     A(r,k) = pa[(k/4*SIMD_MR8 + r)*4 + k%4]
+   b[j] are uint8 columns. kc must be a multiple of 4.
+*/
+#define SIMD_MR8 16
+#define SIMD_NR8 8
+extern void (*simd_gemm8)(
+    int kc, const int8_t* pa, const uint8_t* const* b,
+    const int32_t* zero, const float* scale, const float* bias, float* c);
+
+/* simd_quant8(n, x, inv, lo, y)
+   Computes y[i] = clamp(round(x[i] * inv), lo, 127) + 128,
+   rounding half to even (the default rounding mode) in every
+   implementation.
+*/
+extern void (*simd_quant8)(
+    int n, const float* x, float inv, int lo, uint8_t* y);
+
+/* simd_exp(n, x, y)
+   Computes y[i] = exp(x[i]) with a polynomial approximation.
+   x is clamped to the normal range (about +-87 for float and
+   +-708 for double). Max. relative error (measured against the
+   libm exp): about 1.1e-7 (float), 5e-16 (double).
+*/
+extern void (*simd_exp)(int n, const nn_real* x, nn_real* y);
+
+/* simd_tanh(n, x, y)
+   Computes y[i] = tanh(x[i]) from simd_exp().
+   Max. absolute error: 1e-7 (float), 4e-16 (double).
+*/
+extern void (*simd_tanh)(int n, const nn_real* x, nn_real* y);
+
+/* simd_sgd(n, a, p, u)
+   Plain SGD step: p[i] -= a * u[i], then u[i] = 0.
+*/
+extern void (*simd_sgd)(int n, nn_real a, nn_real* p, nn_real* u);
+
+/* simd_momentum(n, a, s, mu, nesterov, p, u, v)
+   Momentum step with the gradient g = s * u[i]:
+     v[i] = mu * v[i] + g
+     p[i] -= a * v[i]                (nesterov = 0)
+     p[i] -= a * (g + mu * v[i])     (nesterov = 1)
+   then u[i] = 0.
+*/
+extern void (*simd_momentum)(
+    int n, nn_real a, nn_real s, nn_real mu, int nesterov,
+    nn_real* p, nn_real* u, nn_real* v);
+
+/* simd_adam(n, a, s, b1, b2, eps, p, u, m, v)
+   Adam step with the gradient g = s * u[i]:
+     m[i] = b1 * m[i] + (1-b1) * g
+     v[i] = b2 * v[i] + (1-b2) * g^2
+     p[i] -= a * m[i] / (sqrt(v[i]) + eps)
+   then u[i] = 0. The bias correction is left to a.
+*/
+extern void (*simd_adam)(
+    int n, nn_real a, nn_real s, nn_real b1, nn_real b2, nn_real eps,
+    nn_real* p, nn_real* u, nn_real* m, nn_real* v);
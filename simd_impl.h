@@ -0,0 +1,200 @@
+/*
+  simd_impl.h
+  Kernel template for simd.c. Included once per instruction set with:
+    SIMD_FN(name)   function name
+    VEC             vector type
+    LANES           num. of nn_real per vector
+    VZERO()         zero vector
+    VLOAD(p)        unaligned load
+    VSTORE(p, v)    unaligned store
+    VSET1(x)        broadcast
+    VFMA(a, b, c)   a * b + c
+    VADD/VSUB/VMUL/VDIV/VMIN/VMAX(a, b)
+                    arithmetic (VMIN/VMAX return b if either is NaN)
+    VSQRT(a)        square root
+    VAND/VANDNOT/VXOR(a, b)
+                    bitwise (VANDNOT(a, b) = ~a & b)
+    VPOW2(t)        2^n, where t = n + FEXP_SHIFT
+    VEND()          cleanup before returning to non-VEX code
+*/
+
+/* dot(n, x, y) */
+static nn_real SIMD_FN(dot)(int n, const nn_real* x, const nn_real* y)
+{
+    VEC s0 = VZERO(), s1 = VZERO();
+    int i = 0;
+    for (; i + 2*LANES <= n; i += 2*LANES) {
+        s0 = VFMA(VLOAD(&x[i]), VLOAD(&y[i]), s0);
+        s1 = VFMA(VLOAD(&x[i+LANES]), VLOAD(&y[i+LANES]), s1);
+    }
+    for (; i + LANES <= n; i += LANES) {
+        s0 = VFMA(VLOAD(&x[i]), VLOAD(&y[i]), s0);
+    }
+    nn_real v[2*LANES];
+    VSTORE(&v[0], s0);
+    VSTORE(&v[LANES], s1);
+    nn_real t = 0;
+    for (int j = 0; j < 2*LANES; j++) {
+        t += v[j];
+    }
+    for (; i < n; i++) {
+        t += x[i] * y[i];
+    }
+    VEND();
+    return t;
+}
+
+/* axpy(n, a, x, y) */
+static void SIMD_FN(axpy)(int n, nn_real a, const nn_real* x, nn_real* y)
+{
+    VEC va = VSET1(a);
+    int i = 0;
+    for (; i + 2*LANES <= n; i += 2*LANES) {
+        VSTORE(&y[i], VFMA(va, VLOAD(&x[i]), VLOAD(&y[i])));
+        VSTORE(&y[i+LANES], VFMA(va, VLOAD(&x[i+LANES]), VLOAD(&y[i+LANES])));
+    }
+    for (; i < n; i++) {
+        y[i] += a * x[i];
+    }
+    VEND();
+}
+
+/* kernel(kc, pa, pb, tile)
+   4 rows x 2 vectors: nr = 2*LANES.
+*/
+static void SIMD_FN(kernel)(
+    int kc, const nn_real* pa, const nn_real* pb, nn_real* tile)
+{
+    VEC c00 = VZERO(), c01 = VZERO();
+    VEC c10 = VZERO(), c11 = VZERO();
+    VEC c20 = VZERO(), c21 = VZERO();
+    VEC c30 = VZERO(), c31 = VZERO();
+    for (int p = 0; p < kc; p++) {
+        VEC b0 = VLOAD(&pb[0]);
+        VEC b1 = VLOAD(&pb[LANES]);
+        VEC a;
+        a = VSET1(pa[0]);
+        c00 = VFMA(a, b0, c00);
+        c01 = VFMA(a, b1, c01);
+        a = VSET1(pa[1]);
+        c10 = VFMA(a, b0, c10);
+        c11 = VFMA(a, b1, c11);
+        a = VSET1(pa[2]);
+        c20 = VFMA(a, b0, c20);
+        c21 = VFMA(a, b1, c21);
+        a = VSET1(pa[3]);
+        c30 = VFMA(a, b0, c30);
+        c31 = VFMA(a, b1, c31);
+        pa += 4;
+        pb += 2*LANES;
+    }
+    VSTORE(&tile[0*LANES], c00);
+    VSTORE(&tile[1*LANES], c01);
+    VSTORE(&tile[2*LANES], c10);
+    VSTORE(&tile[3*LANES], c11);
+    VSTORE(&tile[4*LANES], c20);
+    VSTORE(&tile[5*LANES], c21);
+    VSTORE(&tile[6*LANES], c30);
+    VSTORE(&tile[7*LANES], c31);
+    VEND();
+}
+
+/* vexp(x): see fexp(). */
+static inline VEC SIMD_FN(vexp)(VEC x)
+{
+    /* min/max return their 2nd operand if either is NaN:
+       keep x second so that NaN goes through, as in fexp(). */
+    x = VMIN(VSET1(FEXP_MAX), VMAX(VSET1(FEXP_MIN), x));
+    VEC shift = VSET1(FEXP_SHIFT);
+    VEC t = VFMA(x, VSET1(FEXP_LOG2E), shift);
+    VEC n = VSUB(t, shift);
+    VEC r = VFMA(n, VSET1(-FEXP_LN2HI), x);
+    r = VFMA(n, VSET1(-FEXP_LN2LO), r);
+    VEC p = VSET1(fexp_coefs[0]);
+    for (int k = 1; k <= FEXP_DEG; k++) {
+        p = VFMA(p, r, VSET1(fexp_coefs[k]));
+    }
+    return VMUL(p, VPOW2(t));
+}
+
+/* exp(n, x, y) */
+static void SIMD_FN(exp)(int n, const nn_real* x, nn_real* y)
+{
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        VSTORE(&y[i], SIMD_FN(vexp)(VLOAD(&x[i])));
+    }
+    VEND();
+    exp_scalar(n-i, &x[i], &y[i]);
+}
+
+/* tanh(n, x, y) */
+static void SIMD_FN(tanh)(int n, const nn_real* x, nn_real* y)
+{
+    VEC sign = VSET1(-0.0);
+    VEC one = VSET1(1);
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        VEC v = VLOAD(&x[i]);
+        VEC e = SIMD_FN(vexp)(VMUL(VANDNOT(sign, v), VSET1(-2)));
+        VEC t = VDIV(VSUB(one, e), VADD(one, e));
+        VSTORE(&y[i], VXOR(t, VAND(sign, v)));
+    }
+    VEND();
+    tanh_scalar(n-i, &x[i], &y[i]);
+}
+
+/* sgd(n, a, p, u) */
+static void SIMD_FN(sgd)(int n, nn_real a, nn_real* p, nn_real* u)
+{
+    VEC va = VSET1(-a);
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        VSTORE(&p[i], VFMA(va, VLOAD(&u[i]), VLOAD(&p[i])));
+        VSTORE(&u[i], VZERO());
+    }
+    VEND();
+    sgd_scalar(n-i, a, &p[i], &u[i]);
+}
+
+/* momentum(n, a, s, mu, nesterov, p, u, v) */
+static void SIMD_FN(momentum)(
+    int n, nn_real a, nn_real s, nn_real mu, int nesterov,
+    nn_real* p, nn_real* u, nn_real* v)
+{
+    VEC va = VSET1(-a), vs = VSET1(s), vmu = VSET1(mu);
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        VEC g = VMUL(vs, VLOAD(&u[i]));
+        VEC w = VFMA(vmu, VLOAD(&v[i]), g);
+        VEC d = (nesterov)? VFMA(vmu, w, g) : w;
+        VSTORE(&v[i], w);
+        VSTORE(&p[i], VFMA(va, d, VLOAD(&p[i])));
+        VSTORE(&u[i], VZERO());
+    }
+    VEND();
+    momentum_scalar(n-i, a, s, mu, nesterov, &p[i], &u[i], &v[i]);
+}
+
+/* adam(n, a, s, b1, b2, eps, p, u, m, v) */
+static void SIMD_FN(adam)(
+    int n, nn_real a, nn_real s, nn_real b1, nn_real b2, nn_real eps,
+    nn_real* p, nn_real* u, nn_real* m, nn_real* v)
+{
+    VEC va = VSET1(-a), vs = VSET1(s), veps = VSET1(eps);
+    VEC vb1 = VSET1(b1), vc1 = VSET1(1 - b1);
+    VEC vb2 = VSET1(b2), vc2 = VSET1(1 - b2);
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        VEC g = VMUL(vs, VLOAD(&u[i]));
+        VEC m1 = VFMA(vb1, VLOAD(&m[i]), VMUL(vc1, g));
+        VEC v1 = VFMA(vb2, VLOAD(&v[i]), VMUL(vc2, VMUL(g, g)));
+        VSTORE(&m[i], m1);
+        VSTORE(&v[i], v1);
+        VEC d = VDIV(m1, VADD(VSQRT(v1), veps));
+        VSTORE(&p[i], VFMA(va, d, VLOAD(&p[i])));
+        VSTORE(&u[i], VZERO());
+    }
+    VEND();
+    adam_scalar(n-i, a, s, b1, b2, eps, &p[i], &u[i], &m[i], &v[i]);
+}
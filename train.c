@@ -0,0 +1,307 @@
+/*
+  train.c
+  Data-parallel training with threads.
+
+  Every thread owns a replica of the Layers that shares the
+  weights/biases (read only during a minibatch) but has its own
+  outputs and updates. A minibatch is split into fixed slices,
+  and the updates are gathered in thread order, so the results
+  only depend on the seed and the number of threads.
+
+  With an Arena, the updates are then summed by all the threads at
+  once: each one takes a fixed stripe of the update block and adds
+  the replicas into the original in thread order.
+
+  In Hogwild mode the threads instead write their updates to the
+  shared weights as they go, without any locking.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cnn.h"
+#include "train.h"
+#include "simd.h"
+
+
+/*  Trainer
+ */
+struct _Trainer {
+
+    int nthreads;               /* Num. of Threads */
+    Layer** inputs;             /* Input Layer of each thread */
+    Layer** outputs;            /* Output Layer of each thread */
+    double* etotals;            /* Error total of each thread */
+    pthread_t* threads;         /* Threads (except 0) */
+    pthread_barrier_t start;    /* Minibatch start */
+    pthread_barrier_t done;     /* Minibatch done */
+    pthread_barrier_t reduced;  /* Updates summed */
+    int striped;                /* Sum the Arena updates in stripes */
+
+    /* Current job */
+    const nn_real* x;
+    const nn_real* y;
+    int nbatch;
+    int quit;
+
+    /* Current Hogwild job */
+    int hogwild;
+    TrainerFetch fetch;
+    void* ctx;
+    int nsamples;
+    double rate;
+};
+
+typedef struct _TrainerArg {
+    Trainer* trainer;
+    int id;
+} TrainerArg;
+
+/* Trainer_learnSlice(self, id)
+   Learns the id-th slice of the current minibatch.
+*/
+static void Trainer_learnSlice(Trainer* self, int id)
+{
+    int i0 = self->nbatch * id / self->nthreads;
+    int i1 = self->nbatch * (id+1) / self->nthreads;
+    self->etotals[id] = 0;
+    if (i0 == i1) return;
+
+    Layer* linput = self->inputs[id];
+    Layer* loutput = self->outputs[id];
+    Layer_setInputsBatch(
+        linput, &self->x[i0 * linput->nnodes], i1-i0);
+    Layer_learnOutputsBatch(
+        loutput, &self->y[i0 * loutput->nnodes], i1-i0);
+    self->etotals[id] = Layer_getErrorTotal(loutput);
+}
+
+/* Trainer_reduceStripe(self, id)
+   Adds the id-th stripe of the replica updates to the original
+   ones (in thread order) and clears them.
+*/
+static void Trainer_reduceStripe(Trainer* self, int id)
+{
+    /* Stripes of whole cache lines. */
+    size_t nparams = self->inputs[0]->arena->nparams;
+    size_t nlines = (nparams + 15) / 16;
+    size_t i0 = 16 * (nlines * id / self->nthreads);
+    size_t i1 = 16 * (nlines * (id+1) / self->nthreads);
+    if (nparams < i0) { i0 = nparams; }
+    if (nparams < i1) { i1 = nparams; }
+    if (i0 == i1) return;
+
+    nn_real* dst = &self->inputs[0]->arena->updates[i0];
+    for (int r = 1; r < self->nthreads; r++) {
+        nn_real* src = &self->inputs[r]->arena->updates[i0];
+        simd_axpy(i1-i0, 1, src, dst);
+        memset(src, 0, (i1-i0) * sizeof(nn_real));
+    }
+}
+
+/* Trainer_learnFree(self, id)
+   Learns the id-th share of the current Hogwild job.
+*/
+static void Trainer_learnFree(Trainer* self, int id)
+{
+    int n = (self->nsamples * (id+1) / self->nthreads -
+             self->nsamples * id / self->nthreads);
+    Layer* linput = self->inputs[id];
+    Layer* loutput = self->outputs[id];
+    nn_real* x = (nn_real*)calloc(self->nbatch * linput->nnodes, sizeof(nn_real));
+    nn_real* y = (nn_real*)calloc(self->nbatch * loutput->nnodes, sizeof(nn_real));
+
+    double etotal = 0;
+    for (int i = 0; i < n; i += self->nbatch) {
+        int nbatch = (n-i < self->nbatch)? (n-i) : self->nbatch;
+        self->fetch(self->ctx, id, x, y, nbatch);
+        Layer_setInputsBatch(linput, x, nbatch);
+        Layer_learnOutputsBatch(loutput, y, nbatch);
+        etotal += Layer_getErrorTotal(loutput);
+        Layer_updateSparse(loutput, self->rate / nbatch);
+    }
+    self->etotals[id] = etotal;
+
+    free(x);
+    free(y);
+}
+
+/* Trainer_worker(arg)
+   Thread main loop.
+*/
+static void* Trainer_worker(void* arg)
+{
+    Trainer* self = ((TrainerArg*)arg)->trainer;
+    int id = ((TrainerArg*)arg)->id;
+    free(arg);
+
+    for (;;) {
+        pthread_barrier_wait(&self->start);
+        if (self->quit) break;
+        if (self->hogwild) {
+            Trainer_learnFree(self, id);
+            pthread_barrier_wait(&self->done);
+        } else {
+            Trainer_learnSlice(self, id);
+            pthread_barrier_wait(&self->done);
+            if (self->striped) {
+                Trainer_reduceStripe(self, id);
+                pthread_barrier_wait(&self->reduced);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Trainer_create(linput, nthreads)
+   Creates a Trainer for the Layers starting from linput.
+*/
+Trainer* Trainer_create(Layer* linput, int nthreads)
+{
+    assert (linput != NULL);
+    assert (linput->lprev == NULL);
+    assert (0 < nthreads);
+
+    Trainer* self = (Trainer*)calloc(1, sizeof(Trainer));
+    if (self == NULL) return NULL;
+    self->nthreads = nthreads;
+    self->inputs = (Layer**)calloc(nthreads, sizeof(Layer*));
+    self->outputs = (Layer**)calloc(nthreads, sizeof(Layer*));
+    self->etotals = (double*)calloc(nthreads, sizeof(double));
+    self->threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+
+    /* Thread 0 (the caller) uses the original Layers. */
+    self->inputs[0] = linput;
+    self->outputs[0] = linput;
+    while (self->outputs[0]->lnext != NULL) {
+        self->outputs[0] = self->outputs[0]->lnext;
+    }
+    for (int id = 1; id < nthreads; id++) {
+        Layer* layer = NULL;
+        for (Layer* src = linput; src != NULL; src = src->lnext) {
+            layer = Layer_create_replica(layer, src);
+            if (src == linput) {
+                self->inputs[id] = layer;
+            }
+        }
+        self->outputs[id] = layer;
+        if (linput->arena != NULL) {
+            Arena_create(self->inputs[id]);
+        }
+    }
+
+    pthread_barrier_init(&self->start, NULL, nthreads);
+    pthread_barrier_init(&self->done, NULL, nthreads);
+    pthread_barrier_init(&self->reduced, NULL, nthreads);
+    self->striped = (linput->arena != NULL && linput->arena->updates != NULL);
+    for (int id = 1; id < nthreads; id++) {
+        TrainerArg* arg = (TrainerArg*)malloc(sizeof(TrainerArg));
+        arg->trainer = self;
+        arg->id = id;
+        pthread_create(&self->threads[id], NULL, Trainer_worker, arg);
+    }
+
+    return self;
+}
+
+/* Trainer_destroy(self)
+   Stops the threads and releases the replicas.
+*/
+void Trainer_destroy(Trainer* self)
+{
+    assert (self != NULL);
+
+    self->quit = 1;
+    pthread_barrier_wait(&self->start);
+    for (int id = 1; id < self->nthreads; id++) {
+        pthread_join(self->threads[id], NULL);
+        Layer* layer = self->inputs[id];
+        Arena* arena = layer->arena;
+        while (layer != NULL) {
+            Layer* lnext = layer->lnext;
+            Layer_destroy(layer);
+            layer = lnext;
+        }
+        if (arena != NULL) {
+            Arena_destroy(arena);
+        }
+    }
+    pthread_barrier_destroy(&self->start);
+    pthread_barrier_destroy(&self->done);
+    pthread_barrier_destroy(&self->reduced);
+
+    free(self->inputs);
+    free(self->outputs);
+    free(self->etotals);
+    free(self->threads);
+    free(self);
+}
+
+/* Trainer_learnBatch(self, x, y, nbatch)
+   Splits a minibatch among the threads and learns it.
+*/
+double Trainer_learnBatch(
+    Trainer* self, const nn_real* x, const nn_real* y, int nbatch)
+{
+    assert (self != NULL);
+    assert (0 < nbatch);
+
+    self->hogwild = 0;
+    self->x = x;
+    self->y = y;
+    self->nbatch = nbatch;
+    if (1 < self->nthreads) {
+        pthread_barrier_wait(&self->start);
+    }
+    Trainer_learnSlice(self, 0);
+    if (1 < self->nthreads) {
+        pthread_barrier_wait(&self->done);
+        if (self->striped) {
+            Trainer_reduceStripe(self, 0);
+            pthread_barrier_wait(&self->reduced);
+        }
+    }
+
+    /* Gather the updates in a fixed order. */
+    double etotal = self->etotals[0];
+    for (int id = 1; id < self->nthreads; id++) {
+        if (!self->striped) {
+            Layer_gatherUpdates(self->outputs[0], self->outputs[id]);
+        }
+        etotal += self->etotals[id];
+    }
+    return etotal;
+}
+
+/* Trainer_learnHogwild(self, fetch, ctx, nsamples, nbatch, rate)
+   Lock-free asynchronous SGD (Hogwild).
+*/
+double Trainer_learnHogwild(
+    Trainer* self, TrainerFetch fetch, void* ctx,
+    int nsamples, int nbatch, double rate)
+{
+    assert (self != NULL);
+    assert (0 < nbatch);
+
+    self->hogwild = 1;
+    self->fetch = fetch;
+    self->ctx = ctx;
+    self->nsamples = nsamples;
+    self->nbatch = nbatch;
+    self->rate = rate;
+    if (1 < self->nthreads) {
+        pthread_barrier_wait(&self->start);
+    }
+    Trainer_learnFree(self, 0);
+    if (1 < self->nthreads) {
+        pthread_barrier_wait(&self->done);
+    }
+
+    double etotal = 0;
+    for (int id = 0; id < self->nthreads; id++) {
+        etotal += self->etotals[id];
+    }
+    return etotal;
+}
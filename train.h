@@ -0,0 +1,48 @@
+/*
+  train.h
+  Data-parallel training with threads.
+  Requires cnn.h.
+*/
+
+
+/* TrainerFetch(ctx, id, x, y, nbatch)
+   Fills x and y with nbatch samples for thread id.
+   Called from several threads at once.
+*/
+typedef void (*TrainerFetch)(
+    void* ctx, int id, nn_real* x, nn_real* y, int nbatch);
+
+
+/*  Trainer
+ */
+typedef struct _Trainer Trainer;
+
+/* Trainer_create(linput, nthreads)
+   Creates a Trainer for the Layers starting from linput.
+   Each extra thread gets a replica that shares the weights.
+*/
+Trainer* Trainer_create(Layer* linput, int nthreads);
+
+/* Trainer_destroy(self)
+   Stops the threads and releases the replicas.
+*/
+void Trainer_destroy(Trainer* self);
+
+/* Trainer_learnBatch(self, x, y, nbatch)
+   Splits a minibatch among the threads and learns it.
+   x is (nbatch x input nnodes) and y is (nbatch x output nnodes).
+   The updates of all the threads are gathered into the original
+   Layers, ready for Layer_update(). Returns the error total.
+*/
+double Trainer_learnBatch(
+    Trainer* self, const nn_real* x, const nn_real* y, int nbatch);
+
+/* Trainer_learnHogwild(self, fetch, ctx, nsamples, nbatch, rate)
+   Lock-free asynchronous SGD (Hogwild). Every thread repeatedly
+   fetches nbatch samples, learns them and applies its own updates
+   directly to the shared weights, until nsamples are processed
+   in total. Returns the error total.
+*/
+double Trainer_learnHogwild(
+    Trainer* self, TrainerFetch fetch, void* ctx,
+    int nsamples, int nbatch, double rate);